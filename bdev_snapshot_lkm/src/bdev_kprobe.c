@@ -1,6 +1,16 @@
 #include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#ifdef CONFIG_FPROBE
+#include <linux/fprobe.h>
+#endif
+#include <linux/jump_label.h>
 #include <linux/kprobes.h>
 #include <linux/major.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/string.h>
 
 #include "bdev_fs.h"
 #include "bdev_kprobe.h"
@@ -12,6 +22,36 @@
 static struct kretprobe rp_mount;
 static struct kretprobe rp_unmount;
 static struct kretprobe rp_write_fs;
+static struct kretprobe rp_bread;
+static struct kprobe kp_rw_verify;
+
+/*
+ * The write and block read probes are only registered while a snapshot
+ * is open on some device (see snap_capture_probes_get()): the other
+ * writes of the host do not even enter the trampoline. The key turns
+ * their handlers into a plain return while they are being registered
+ * or unregistered.
+ */
+static DEFINE_STATIC_KEY_FALSE(snap_capture_armed);
+static DEFINE_MUTEX(capture_probes_lock);
+static unsigned int capture_probes_users;   /* open snapshots (capture_probes_lock) */
+
+/* Misses of the capture probes registered before (capture_probes_lock) */
+static u64 capture_probes_missed[SNAP_PROBE_MAX];
+
+static unsigned int probe_maxactive;
+module_param(probe_maxactive, uint, 0444);
+MODULE_PARM_DESC(probe_maxactive, "Calls each return probe may follow at once (0 = from the number of possible CPUs)");
+
+/* Calls a return probe may follow at once: a probe missing one reports it, see snap_probes_missed() */
+static int snap_probe_maxactive(unsigned int per_cpu, unsigned int min)
+{
+    unsigned int n = READ_ONCE(probe_maxactive);
+
+    if (n)
+        return n;
+    return clamp_t(unsigned int, per_cpu * num_possible_cpus(), min, SNAP_MAXACTIVE_MAX);
+}
 
 /* ================= Helper functions ================= */
 
@@ -28,12 +68,12 @@ static int get_snap_dev_name(struct block_device *bdev, char *buf, size_t sz)
     return 0;
 }
 
-/* ================= Workqueue Handlers ================= */
+/* ================= Writeback Job Handlers ================= */
 
 /* Handler for mount work */
-static void mount_work_handler(struct work_struct *work)
+static void mount_work_handler(struct snap_wb_job *job)
 {
-    struct mount_work *mw = container_of(work, struct mount_work, work);
+    struct mount_work *mw = container_of(job, struct mount_work, job);
     struct snap_device *dev;
 
     dev = snap_find_device_get(mw->dev_name);
@@ -52,9 +92,9 @@ static void mount_work_handler(struct work_struct *work)
 }
 
 /* Handler for unmount work */
-static void unmount_work_handler(struct work_struct *work)
+static void unmount_work_handler(struct snap_wb_job *job)
 {
-    struct unmount_work *uw = container_of(work, struct unmount_work, work);
+    struct unmount_work *uw = container_of(job, struct unmount_work, job);
     struct snap_device *dev;
 
     if (!*uw->dev_name || uw->unmount_ret < 0)
@@ -77,7 +117,7 @@ out:
     kfree(uw);
 }
 
-/* ================= Workqueue Scheduling ================= */
+/* ================= Job Scheduling ================= */
 
 /* Generic function to schedule mount work */
 static void schedule_mount_work(const char *dev_name)
@@ -88,7 +128,7 @@ static void schedule_mount_work(const char *dev_name)
     if (!mw)
         return;
 
-    INIT_WORK(&mw->work, mount_work_handler);
+    snap_wb_job_init(&mw->job, mount_work_handler);
     strscpy(mw->dev_name, dev_name, DEV_NAME_LEN_MAX);
 
     dev = snap_find_device_get(dev_name);
@@ -97,7 +137,8 @@ static void schedule_mount_work(const char *dev_name)
         return;
     }
 
-    queue_work(dev->wq, &mw->work);
+    /* Ordered before the flushes of the device */
+    snap_wb_queue(&dev->wb, &mw->job);
     snap_device_put(dev);
 }
 
@@ -110,7 +151,7 @@ static void schedule_unmount_work(const char *dev_name, long ret)
     if (!uw)
         return;
 
-    INIT_WORK(&uw->work, unmount_work_handler);
+    snap_wb_job_init(&uw->job, unmount_work_handler);
     strscpy(uw->dev_name, dev_name, DEV_NAME_LEN_MAX);
     uw->unmount_ret = ret;
 
@@ -120,7 +161,7 @@ static void schedule_unmount_work(const char *dev_name, long ret)
         return;
     }
 
-    queue_work(dev->wq, &uw->work);
+    snap_wb_queue(&dev->wb, &uw->job);
     snap_device_put(dev);
 }
 
@@ -142,7 +183,7 @@ static void handle_mount_device(struct block_device *bdev)
     if (!dev)
         return;
 
-    ret = snapdev_mark_mounted(dev);
+    ret = snapdev_mark_mounted(dev, bdev->bd_dev);
     if (ret == 0) {            
         schedule_mount_work(snap_name);
     } else if (ret == -EBUSY) {
@@ -188,10 +229,8 @@ static int kill_sb_entry_handler(struct kretprobe_instance *ri,
     struct umount_kretprobe_metadata *meta =
         (struct umount_kretprobe_metadata *)ri->data;
 
-    if (meta && sb && sb->s_bdev) {
-        if (get_snap_dev_name(sb->s_bdev, meta->dev_name, sizeof(meta->dev_name)) != 0)
-            meta->dev_name[0] = '\0';
-    }
+    if (meta)
+        meta->devt = (sb && sb->s_bdev) ? sb->s_dev : 0;
 
     return 0;
 }
@@ -202,21 +241,21 @@ static int kill_sb_ret_handler(struct kretprobe_instance *ri,
     struct umount_kretprobe_metadata *meta =
         (struct umount_kretprobe_metadata *)ri->data;
 
-    if (meta) {
+    if (meta && meta->devt) {
         struct snap_device *dev;
         int ret;
     
-        dev = snap_find_device_get(meta->dev_name);
+        dev = snap_find_device_by_devt_get(meta->devt);
         if (!dev)
             return 0;
     
         ret = snapdev_mark_unmounted(dev);
         if (ret == 0) {
-            schedule_unmount_work(meta->dev_name, 0);
+            schedule_unmount_work(dev->dev_name, 0);
         } else if (ret == -EINVAL) {
-            pr_debug("%s: device %s was not mounted, nothing to unmount\n", MOD_NAME, meta->dev_name);
+            pr_debug("%s: device %s was not mounted, nothing to unmount\n", MOD_NAME, dev->dev_name);
         } else {
-            pr_warn("%s: failed to mark device %s as unmounted, ret=%d\n", MOD_NAME, meta->dev_name, ret);
+            pr_warn("%s: failed to mark device %s as unmounted, ret=%d\n", MOD_NAME, dev->dev_name, ret);
         }   
 
         snap_device_put(dev);
@@ -226,127 +265,470 @@ static int kill_sb_ret_handler(struct kretprobe_instance *ri,
     return 0;
 }
 
-/* ================= VFS Write Kretprobe Handlers ================= */
+/* ================= VFS Write Handlers ================= */
 
-static void populate_singlefilefs_write_metadata(struct singlefilefs_write_kretprobe_metadata *meta,
-                                    struct snap_device *sdev,
-                                    struct inode *inode,
-                                    loff_t *offptr)
+/*
+ * Device written to, referenced, if the write is to be snapshotted:
+ * writes to file systems that are not snapshotted pay only for the
+ * dev_t lookup.
+ */
+static struct snap_device *snap_write_device_get(struct file *filp, size_t len, loff_t *offptr)
 {
-    if (!meta || !sdev || !inode || !offptr)
+    struct inode *inode;
+    struct snap_device *sdev;
+
+    if (!filp || !offptr || len == 0)
+        return NULL;
+
+    inode = filp->f_inode;
+    if (!inode || !inode->i_sb || !inode->i_sb->s_bdev)
+        return NULL;
+
+    /* One hash lookup rejects writes to file systems not being snapshotted */
+    sdev = snap_find_device_by_devt_get(inode->i_sb->s_dev);
+    if (!sdev)
+        return NULL;
+
+    if (bdev_read_only(inode->i_sb->s_bdev) || !snapdev_is_mounted(sdev)) {
+        snap_device_put(sdev);
+        return NULL;
+    }
+
+    return sdev;
+}
+
+/* Capture the blocks a write is about to modify; true if it claimed at least one */
+static bool snap_write_capture(struct snap_device *sdev, struct file *filp,
+                               loff_t *offptr, size_t len)
+{
+    struct snap_pending_block *blocks;
+    bool first_touch = false;
+
+    /*
+     * Every pending block was claimed in the saved bitmap and holds the
+     * block content from before this write: it is a valid pre-image
+     * whether or not the write succeeds, so it is queued right away. In
+     * ordered mode the write itself waits for it to be saved, so it
+     * cannot wait for the return of the write either.
+     */
+    blocks = snap_prepare_singlefilefs_block_save(sdev, filp->f_inode, offptr, len, &first_touch);
+    snap_queue_pending_blocks(blocks);
+
+    return first_touch;
+}
+
+/* Return of a snapshotted write: record its latency, drop the device */
+static void snap_write_done(struct singlefilefs_write_metadata *meta)
+{
+    struct snap_device *sdev = meta->sdev;
+    u64 lat;
+
+    if (!sdev)
         return;
 
-    meta->original_offset = *offptr;
-    meta->inode = inode;
-    meta->original_inode_size = i_size_read(inode);
-    meta->pending_blocks = snap_prepare_singlefilefs_block_save(sdev, inode, offptr);
+    /* First-touch writes pay for the capture (and in ordered mode, its save) */
+    lat = ktime_get_ns() - meta->start_ns;
+    snap_lat_record(meta->first_touch ? sdev->stats.lat_first_write : sdev->stats.lat_steady_write,
+                    lat);
+
+    meta->sdev = NULL;
+    snap_device_put(sdev);
 }
 
+/*
+ * Writes that do not go through vfs_write() (writev, io_uring, AIO,
+ * splice, copy_file_range) all have their range checked by
+ * rw_verify_area() before the file system is called, and are captured
+ * there. So are those of vfs_write(), already captured on its entry:
+ * what that entry saw on this CPU lets them pass.
+ */
+struct snap_vfs_write_seen {
+    struct task_struct *task;   /* writer, NULL once its rw_verify_area() was seen */
+    const loff_t *offptr;
+    loff_t pos;
+    size_t len;
+};
+static DEFINE_PER_CPU(struct snap_vfs_write_seen, snap_vfs_write_seen);
+
+/* Entry of vfs_write(), whether the write is snapshotted or not */
+static void snap_vfs_write_enter(const loff_t *offptr, size_t len)
+{
+    struct snap_vfs_write_seen *seen = this_cpu_ptr(&snap_vfs_write_seen);
 
-static int vfs_write_entry_handler(struct kretprobe_instance *ri, struct pt_regs *regs)
+    seen->task = current;
+    seen->offptr = offptr;
+    seen->pos = offptr ? *offptr : 0;
+    seen->len = len;
+}
+
+static void snap_rw_verify_capture(int read_write, struct file *filp,
+                                   const loff_t *offptr, size_t len)
 {
-    struct singlefilefs_write_kretprobe_metadata *meta;
-    struct file *filp = (struct file *)PT_REGS_PARM1(regs);
-    size_t len = (size_t)PT_REGS_PARM3(regs);
-    loff_t *offptr = (loff_t *)PT_REGS_PARM4(regs);
+    struct snap_vfs_write_seen *seen;
+    struct snap_device *sdev;
 
-    struct inode *inode;
-    struct snap_device *sdev = NULL;
-    char dev_name[DEV_NAME_LEN_MAX];
+    if (read_write != WRITE || !static_branch_likely(&snap_capture_armed))
+        return;
 
-    if (!filp || !offptr || len == 0)
-        return 0;
+    /*
+     * A vfs_write() preempted and moved between its entry and here is
+     * captured twice: the second capture finds its blocks claimed
+     */
+    seen = this_cpu_ptr(&snap_vfs_write_seen);
+    if (seen->task == current) {
+        seen->task = NULL;
+        if (seen->offptr == offptr && seen->len == len && (!offptr || seen->pos == *offptr))
+            return;
+    }
 
-    inode = filp->f_inode;
-    if (!inode || !inode->i_sb || !inode->i_sb->s_bdev)
-        return 0;
-    
-    if (bdev_read_only(inode->i_sb->s_bdev))
-        return 0;
+    sdev = snap_write_device_get(filp, len, (loff_t *)offptr);
+    if (!sdev)
+        return;
+
+    snap_write_capture(sdev, filp, (loff_t *)offptr, len);
+    snap_device_put(sdev);
+}
+
+/* ================= VFS Write Fprobes ================= */
+
+#ifdef SNAP_WRITE_FPROBE
+
+static bool write_fprobe = true;
+module_param(write_fprobe, bool, 0644);
+MODULE_PARM_DESC(write_fprobe, "Intercept writes with fprobes rather than a kretprobe, from the next snapshot opened");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+typedef struct ftrace_regs snap_fprobe_regs_t;
+# define SNAP_FPROBE_ARG(regs, n)  ((void *)ftrace_regs_get_argument(regs, n))
+#else
+typedef struct pt_regs snap_fprobe_regs_t;
+# define SNAP_FPROBE_ARG(regs, n)  ((void *)regs_get_kernel_argument(regs, n))
+#endif
+
+/*
+ * Two fprobes share vfs_write, a third one is on rw_verify_area for the
+ * other write paths. fp_write has no exit handler, so it needs
+ * no per-call return instance and is never missed for lack of one: it
+ * does the capture. fp_write_lat only measures the latency of the
+ * snapshotted writes; when it runs out of return instances, a latency
+ * sample is lost, never a capture.
+ */
+static struct fprobe fp_write;
+static struct fprobe fp_write_lat;
+static struct fprobe fp_rw_verify;
+
+/*
+ * Hand-off between the two entry handlers of one vfs_write() call. They
+ * run back to back on this CPU, with preemption disabled, and share the
+ * registers of the call, which tell it apart; in which order they run is
+ * up to ftrace. The first one leaves its part here, the second one pairs
+ * with it:
+ * - fp_write first: whether the write claimed a block, and when it began
+ * - fp_write_lat first: its entry data, which fp_write then completes.
+ *   Its exit handler withdraws it, so that it is never used past the call.
+ */
+struct snap_write_mark {
+    struct task_struct *task;   /* writer of the call, NULL once paired */
+    snap_fprobe_regs_t *regs;   /* registers of the call */
+    struct singlefilefs_write_metadata *meta;  /* fp_write_lat first: its entry data */
+    u64 start_ns;
+    bool first_touch;
+};
+static DEFINE_PER_CPU(struct snap_write_mark, snap_write_mark);
+
+/* The mark left by the other handler of this call, taken; NULL if none */
+static struct snap_write_mark *snap_write_mark_pair(snap_fprobe_regs_t *regs)
+{
+    struct snap_write_mark *mark = this_cpu_ptr(&snap_write_mark);
+
+    if (mark->task != current || mark->regs != regs)
+        return NULL;
+
+    mark->task = NULL;
+    return mark;
+}
 
-    if (get_snap_dev_name(inode->i_sb->s_bdev, dev_name, sizeof(dev_name)) != 0)
+static void snap_write_mark_leave(snap_fprobe_regs_t *regs,
+                                  struct singlefilefs_write_metadata *meta,
+                                  u64 start_ns, bool first_touch)
+{
+    struct snap_write_mark *mark = this_cpu_ptr(&snap_write_mark);
+
+    mark->regs = regs;
+    mark->start_ns = start_ns;
+    mark->first_touch = first_touch;
+    WRITE_ONCE(mark->meta, meta);
+    mark->task = current;
+}
+
+static int vfs_write_fprobe_entry(struct fprobe *fp, unsigned long entry_ip,
+                                  unsigned long ret_ip, snap_fprobe_regs_t *regs,
+                                  void *entry_data)
+{
+    struct file *filp = (struct file *)SNAP_FPROBE_ARG(regs, 0);
+    size_t len = (size_t)SNAP_FPROBE_ARG(regs, 2);
+    loff_t *offptr = (loff_t *)SNAP_FPROBE_ARG(regs, 3);
+    struct singlefilefs_write_metadata *meta = NULL;
+    struct snap_write_mark *mark;
+    struct snap_device *sdev;
+    bool first_touch;
+    u64 start_ns;
+
+    if (!static_branch_likely(&snap_capture_armed))
         return 0;
 
-    sdev = snap_find_device_get(dev_name);
+    snap_vfs_write_enter(offptr, len);
+    sdev = snap_write_device_get(filp, len, offptr);
     if (!sdev)
         return 0;
 
-    if (!snapdev_is_mounted(sdev)) {
-        snap_device_put(sdev);
-        return 0;
+    start_ns = ktime_get_ns();
+    first_touch = snap_write_capture(sdev, filp, offptr, len);
+    snap_device_put(sdev);
+
+    /* Still there unless the exit handler of its call withdrew it */
+    mark = snap_write_mark_pair(regs);
+    if (mark)
+        meta = xchg(&mark->meta, NULL);
+
+    if (meta)
+        meta->first_touch = first_touch;
+    else
+        snap_write_mark_leave(regs, NULL, start_ns, first_touch);
+    return 0;
+}
+
+/* Returning non-zero skips the exit handler of this call */
+static int vfs_write_lat_entry(struct fprobe *fp, unsigned long entry_ip,
+                               unsigned long ret_ip, snap_fprobe_regs_t *regs,
+                               void *entry_data)
+{
+    struct singlefilefs_write_metadata *meta = entry_data;
+    struct snap_write_mark *mark;
+    struct snap_device *sdev;
+
+    if (!static_branch_likely(&snap_capture_armed))
+        return 1;
+
+    sdev = snap_write_device_get((struct file *)SNAP_FPROBE_ARG(regs, 0),
+                                 (size_t)SNAP_FPROBE_ARG(regs, 2),
+                                 (loff_t *)SNAP_FPROBE_ARG(regs, 3));
+    if (!sdev)
+        return 1;
+
+    /* The device reference is kept until the exit handler */
+    meta->sdev = sdev;
+    meta->cpu = smp_processor_id();
+
+    mark = snap_write_mark_pair(regs);
+    if (mark && !READ_ONCE(mark->meta)) {
+        meta->start_ns = mark->start_ns;
+        meta->first_touch = mark->first_touch;
+    } else {
+        /* fp_write has yet to run: it tells whether a block was claimed */
+        meta->start_ns = ktime_get_ns();
+        meta->first_touch = false;
+        snap_write_mark_leave(regs, meta, 0, false);
     }
+    return 0;
+}
+
+static void vfs_write_lat_exit(struct fprobe *fp, unsigned long entry_ip,
+                               unsigned long ret_ip, snap_fprobe_regs_t *regs,
+                               void *entry_data)
+{
+    struct singlefilefs_write_metadata *meta = entry_data;
 
-    meta = (struct singlefilefs_write_kretprobe_metadata *)ri->data;
-    populate_singlefilefs_write_metadata(meta, sdev, inode, offptr);
+    /* Left for an fp_write that never ran: not to be used past the call */
+    cmpxchg(&per_cpu_ptr(&snap_write_mark, meta->cpu)->meta, meta, NULL);
+
+    snap_write_done(meta);
+}
+
+static int rw_verify_fprobe_entry(struct fprobe *fp, unsigned long entry_ip,
+                                  unsigned long ret_ip, snap_fprobe_regs_t *regs,
+                                  void *entry_data)
+{
+    snap_rw_verify_capture((int)(long)SNAP_FPROBE_ARG(regs, 0),
+                           (struct file *)SNAP_FPROBE_ARG(regs, 1),
+                           (const loff_t *)SNAP_FPROBE_ARG(regs, 2),
+                           (size_t)SNAP_FPROBE_ARG(regs, 3));
+    return 0;
+}
+
+static int vfs_write_fprobe_init(void)
+{
+    int ret, cpu;
+
+    /* Registered again at every first snapshot: no state of the last time */
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(&snap_write_mark, cpu), 0, sizeof(struct snap_write_mark));
+
+    memset(&fp_write_lat, 0, sizeof(fp_write_lat));
+    fp_write_lat.entry_handler = vfs_write_lat_entry;
+    fp_write_lat.exit_handler = vfs_write_lat_exit;
+    fp_write_lat.entry_data_size = sizeof(struct singlefilefs_write_metadata);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+    /* From 6.14 on fprobes run on fgraph, which sizes its own return stack */
+    fp_write_lat.nr_maxactive = snap_probe_maxactive(SNAP_MAXACTIVE_WRITE_PER_CPU,
+                                                     SNAP_MAXACTIVE_WRITE_MIN);
+#endif
+
+    ret = register_fprobe(&fp_write_lat, "vfs_write", NULL);
+    if (ret) {
+        pr_err("%s: failed to register vfs_write latency fprobe: %d\n", MOD_NAME, ret);
+        return ret;
+    }
+
+    memset(&fp_write, 0, sizeof(fp_write));
+    fp_write.entry_handler = vfs_write_fprobe_entry;
+
+    ret = register_fprobe(&fp_write, "vfs_write", NULL);
+    if (ret) {
+        pr_err("%s: failed to register vfs_write fprobe: %d\n", MOD_NAME, ret);
+        goto err_write;
+    }
+
+    memset(&fp_rw_verify, 0, sizeof(fp_rw_verify));
+    fp_rw_verify.entry_handler = rw_verify_fprobe_entry;
+
+    ret = register_fprobe(&fp_rw_verify, "rw_verify_area", NULL);
+    if (ret) {
+        pr_err("%s: failed to register rw_verify_area fprobe: %d\n", MOD_NAME, ret);
+        goto err_rw_verify;
+    }
+
+    pr_debug("%s: write fprobes registered\n", MOD_NAME);
+    return 0;
+
+err_rw_verify:
+    unregister_fprobe(&fp_write);
+err_write:
+    unregister_fprobe(&fp_write_lat);
+    return ret;
+}
+
+static void vfs_write_fprobe_exit(void)
+{
+    unregister_fprobe(&fp_rw_verify);
+    unregister_fprobe(&fp_write);
+    unregister_fprobe(&fp_write_lat);
+}
+
+#endif /* SNAP_WRITE_FPROBE */
+
+/* ================= VFS Write Kretprobe Handlers ================= */
+
+/*
+ * Kernels without fprobes. Returning non-zero from the entry handler
+ * tells kretprobe not to run the return handler for this instance.
+ */
+static int vfs_write_entry_handler(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+    struct singlefilefs_write_metadata *meta;
+    struct file *filp = (struct file *)PT_REGS_PARM1(regs);
+    size_t len = (size_t)PT_REGS_PARM3(regs);
+    loff_t *offptr = (loff_t *)PT_REGS_PARM4(regs);
+    struct snap_device *sdev;
+
+    if (!static_branch_likely(&snap_capture_armed))
+        return 1;
+
+    snap_vfs_write_enter(offptr, len);
+    sdev = snap_write_device_get(filp, len, offptr);
+    if (!sdev)
+        return 1;
+
+    /* The device reference is kept until the return handler */
+    meta = (struct singlefilefs_write_metadata *)ri->data;
+    meta->sdev = sdev;
+    meta->start_ns = ktime_get_ns();
+    meta->first_touch = snap_write_capture(sdev, filp, offptr, len);
 
-    snap_device_put(sdev);
     return 0;
 }
 
 /* This is only valid for the singlefilefs */
 static int vfs_write_ret_handler(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-    struct singlefilefs_write_kretprobe_metadata *meta = (struct singlefilefs_write_kretprobe_metadata *)ri->data;
-    struct snap_pending_block *blk, *next;
-    ssize_t ret = (ssize_t)regs_return_value(regs);
-    loff_t final_offset;
+    snap_write_done((struct singlefilefs_write_metadata *)ri->data);
+    return 0;
+}
 
-    if (!meta->pending_blocks)
-        return 0;
+/* The other write paths: an entry probe, which needs no return instance */
+static int rw_verify_pre_handler(struct kprobe *p, struct pt_regs *regs)
+{
+    snap_rw_verify_capture((int)(long)PT_REGS_PARM1(regs),
+                           (struct file *)PT_REGS_PARM2(regs),
+                           (const loff_t *)PT_REGS_PARM3(regs),
+                           (size_t)PT_REGS_PARM4(regs));
+    return 0;
+}
 
-    blk = meta->pending_blocks;
+/* ================= Block Read Kretprobe Handler ================= */
 
-    /* If writing fails → free pending_block memory */
-    if (ret <= 0) {
-        while (blk) {
-            next = blk->next;
-            kfree(blk->data);
-            kfree(blk);
-            blk = next;
-        }
-        meta->pending_blocks = NULL;
-        return 0;
-    }
+static unsigned long kretprobe_missed(struct kretprobe *rp)
+{
+    /* Out of instances, or hit again from its own handlers */
+    return rp->nmissed + rp->kp.nmissed;
+}
 
-    final_offset = meta->original_offset + ret;
+/*
+ * Only the reads of blocks with an armed capture are followed. A block
+ * armed once the read started is completed by its writer's own read.
+ */
+static int bread_entry_handler(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+    struct bread_metadata *meta;
+    struct block_device *bdev = (struct block_device *)PT_REGS_PARM1(regs);
+    sector_t block = (sector_t)PT_REGS_PARM2(regs);
+    unsigned int size = (unsigned int)(unsigned long)PT_REGS_PARM3(regs);
+    struct buffer_head *bh;
+    struct snap_device *sdev;
 
-    /* Writing OK → for each pending_block create a work_struct */
-    while (blk) {
-        next = blk->next;
+    if (!static_branch_likely(&snap_capture_armed))
+        return 1;
 
-        /* Inode lock: schedule only if writing has extended the file */
-        if (blk->block_num == SINGLEFILEFS_INODE_BLOCK_NUMBER && final_offset <= meta->original_inode_size) {
-            kfree(blk->data);
-            kfree(blk);
-            blk = next;
-            continue;
-        }
+    if (!bdev || block > ULONG_MAX)
+        return 1;
 
-        /* Check if the block has already been saved */
-        if (!snap_try_mark_block_saved(blk->dev, blk->block_num)) {
-            struct snap_block_work *bw = kmalloc(sizeof(*bw), GFP_ATOMIC);
-            if (bw) {
-                bw->dev       = blk->dev;
-                bw->block_num = blk->block_num;
-                bw->len       = blk->len;
-                bw->data      = blk->data;
-
-                snap_device_get(bw->dev);
-
-                INIT_WORK(&bw->work, snap_block_work_handler);
-                queue_work(bw->dev->wq, &bw->work);
-            } else {
-                kfree(blk->data);
-            }
-        } else {
-            kfree(blk->data);
-        }
+    sdev = snap_find_device_by_devt_get(bdev->bd_dev);
+    if (!sdev)
+        return 1;
 
-        kfree(blk);
-        blk = next;
+    if (!xa_load(&sdev->deferred, block)) {
+        snap_device_put(sdev);
+        return 1;
     }
 
-    meta->pending_blocks = NULL;
+    /* A block cached already may have been read and modified unseen */
+    bh = __find_get_block(bdev, block, size);
+
+    /* The device reference is kept until the return handler */
+    meta = (struct bread_metadata *)ri->data;
+    meta->sdev = sdev;
+    meta->fresh = !bh || !buffer_uptodate(bh);
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Runs when a buffer has been read, before the caller can modify it:
+ * completes the captures that the write path had to defer because the
+ * block was not in the buffer cache.
+ */
+static int bread_ret_handler(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+    struct bread_metadata *meta = (struct bread_metadata *)ri->data;
+    struct buffer_head *bh = (struct buffer_head *)regs_return_value(regs);
+    struct snap_device *sdev = meta->sdev;
+
+    /* Any read missed since the snapshot opened may be the first one */
+    if (bh)
+        snap_complete_deferred_capture(sdev, bh, meta->fresh &&
+                                       kretprobe_missed(&rp_bread) == READ_ONCE(sdev->bread_missed));
+
+    snap_device_put(sdev);
     return 0;
 }
 
@@ -358,7 +740,7 @@ static int mount_kretprobe_init(void)
 
     rp_mount.kp.symbol_name = "mount_bdev";
     rp_mount.handler = mount_bdev_ret_handler;
-    rp_mount.maxactive = 20;
+    rp_mount.maxactive = snap_probe_maxactive(SNAP_MAXACTIVE_MOUNT_PER_CPU, SNAP_MAXACTIVE_MOUNT_MIN);
     rp_mount.data_size = 0;
 
     ret = register_kretprobe(&rp_mount);
@@ -382,7 +764,7 @@ static int unmount_kretprobe_init(void)
     rp_unmount.kp.symbol_name = "kill_block_super";
     rp_unmount.entry_handler = kill_sb_entry_handler;
     rp_unmount.handler = kill_sb_ret_handler;
-    rp_unmount.maxactive = 20;
+    rp_unmount.maxactive = snap_probe_maxactive(SNAP_MAXACTIVE_MOUNT_PER_CPU, SNAP_MAXACTIVE_MOUNT_MIN);
     rp_unmount.data_size = sizeof(struct umount_kretprobe_metadata);
 
     ret = register_kretprobe(&rp_unmount);
@@ -403,26 +785,190 @@ static int vfs_write_kretprobe_init(void)
 {
     int ret;
 
+    /* Registered again at every first snapshot: no state of the last time */
+    memset(&rp_write_fs, 0, sizeof(rp_write_fs));
     rp_write_fs.kp.symbol_name = "vfs_write";
     rp_write_fs.entry_handler = vfs_write_entry_handler;
     rp_write_fs.handler = vfs_write_ret_handler;
-    rp_write_fs.maxactive = 40;
-    rp_write_fs.data_size = sizeof(struct singlefilefs_write_kretprobe_metadata);
+    rp_write_fs.maxactive = snap_probe_maxactive(SNAP_MAXACTIVE_WRITE_PER_CPU, SNAP_MAXACTIVE_WRITE_MIN);
+    rp_write_fs.data_size = sizeof(struct singlefilefs_write_metadata);
 
     ret = register_kretprobe(&rp_write_fs);
-    if (ret)
+    if (ret) {
         pr_err("%s: failed to register vfs_write kretprobe: %d\n", MOD_NAME, ret);
-    else
-        pr_debug("%s: vfs_write kretprobe registered\n", MOD_NAME);
+        return ret;
+    }
 
-    return ret;
+    memset(&kp_rw_verify, 0, sizeof(kp_rw_verify));
+    kp_rw_verify.symbol_name = "rw_verify_area";
+    kp_rw_verify.pre_handler = rw_verify_pre_handler;
+
+    ret = register_kprobe(&kp_rw_verify);
+    if (ret) {
+        pr_err("%s: failed to register rw_verify_area kprobe: %d\n", MOD_NAME, ret);
+        unregister_kretprobe(&rp_write_fs);
+        return ret;
+    }
+
+    pr_debug("%s: vfs_write kretprobe and rw_verify_area kprobe registered\n", MOD_NAME);
+    return 0;
 }
 
 static void vfs_write_kretprobe_exit(void)
 {
+    unregister_kprobe(&kp_rw_verify);
     unregister_kretprobe(&rp_write_fs);
 }
 
+static int bread_kretprobe_init(void)
+{
+    int ret;
+
+    memset(&rp_bread, 0, sizeof(rp_bread));
+    rp_bread.kp.symbol_name = "__bread_gfp";
+    rp_bread.entry_handler = bread_entry_handler;
+    rp_bread.handler = bread_ret_handler;
+    rp_bread.maxactive = snap_probe_maxactive(SNAP_MAXACTIVE_WRITE_PER_CPU, SNAP_MAXACTIVE_WRITE_MIN);
+    rp_bread.data_size = sizeof(struct bread_metadata);
+
+    ret = register_kretprobe(&rp_bread);
+    if (ret)
+        pr_err("%s: failed to register __bread_gfp kretprobe: %d\n", MOD_NAME, ret);
+    else
+        pr_debug("%s: __bread_gfp kretprobe registered\n", MOD_NAME);
+
+    return ret;
+}
+
+static void bread_kretprobe_exit(void)
+{
+    unregister_kretprobe(&rp_bread);
+}
+
+/* ================= Lazy Capture Probes ================= */
+
+#ifdef SNAP_WRITE_FPROBE
+static bool write_hook_fprobe;  /* the write hook registered (capture_probes_lock) */
+
+static int vfs_write_hook_init(void)
+{
+    write_hook_fprobe = READ_ONCE(write_fprobe);
+    return write_hook_fprobe ? vfs_write_fprobe_init() : vfs_write_kretprobe_init();
+}
+
+static void vfs_write_hook_exit(void)
+{
+    if (write_hook_fprobe)
+        vfs_write_fprobe_exit();
+    else
+        vfs_write_kretprobe_exit();
+}
+#else
+static int vfs_write_hook_init(void)
+{
+    return vfs_write_kretprobe_init();
+}
+
+static void vfs_write_hook_exit(void)
+{
+    vfs_write_kretprobe_exit();
+}
+#endif
+
+/* Add the misses of the capture probes registered now to 'missed' (capture_probes_lock) */
+static void capture_probes_add_missed(u64 *missed)
+{
+#ifdef SNAP_WRITE_FPROBE
+    if (write_hook_fprobe) {
+        missed[SNAP_PROBE_WRITE] += fp_write.nmissed + fp_rw_verify.nmissed;
+        missed[SNAP_PROBE_WRITE_LAT] += fp_write_lat.nmissed;
+    } else
+#endif
+        missed[SNAP_PROBE_WRITE] += kretprobe_missed(&rp_write_fs) + kp_rw_verify.nmissed;
+    missed[SNAP_PROBE_BREAD] += kretprobe_missed(&rp_bread);
+}
+
+static void capture_probes_disarm(void)
+{
+    static_branch_disable(&snap_capture_armed);
+    vfs_write_hook_exit();
+    bread_kretprobe_exit();
+
+    /* Their counters start over at the next registration */
+    capture_probes_add_missed(capture_probes_missed);
+    pr_debug("%s: capture probes unregistered\n", MOD_NAME);
+}
+
+int snap_capture_probes_get(void)
+{
+    int ret = 0;
+
+    mutex_lock(&capture_probes_lock);
+    if (capture_probes_users++)
+        goto out_unlock;
+
+    /* Deferred captures complete on reads: armed before the writes */
+    ret = bread_kretprobe_init();
+    if (ret)
+        goto err;
+
+    ret = vfs_write_hook_init();
+    if (ret) {
+        bread_kretprobe_exit();
+        goto err;
+    }
+
+    static_branch_enable(&snap_capture_armed);
+    pr_debug("%s: capture probes registered\n", MOD_NAME);
+    goto out_unlock;
+
+err:
+    capture_probes_users--;
+out_unlock:
+    mutex_unlock(&capture_probes_lock);
+    return ret;
+}
+
+void snap_capture_probes_put(void)
+{
+    mutex_lock(&capture_probes_lock);
+    /* None left after the module exit, which unregistered them all */
+    if (capture_probes_users && --capture_probes_users == 0)
+        capture_probes_disarm();
+    mutex_unlock(&capture_probes_lock);
+}
+
+void snap_probes_missed(u64 missed[SNAP_PROBE_MAX])
+{
+    mutex_lock(&capture_probes_lock);
+    memcpy(missed, capture_probes_missed, sizeof(capture_probes_missed));
+    if (capture_probes_users)
+        capture_probes_add_missed(missed);
+    mutex_unlock(&capture_probes_lock);
+
+    /* Registered as long as the module is loaded */
+    missed[SNAP_PROBE_MOUNT] = kretprobe_missed(&rp_mount);
+    missed[SNAP_PROBE_UNMOUNT] = kretprobe_missed(&rp_unmount);
+}
+
+unsigned long snap_bread_probe_missed(void)
+{
+    return kretprobe_missed(&rp_bread);
+}
+
+u64 snap_capture_probes_missed(void)
+{
+    u64 missed[SNAP_PROBE_MAX];
+
+    snap_probes_missed(missed);
+    return missed[SNAP_PROBE_WRITE] + missed[SNAP_PROBE_BREAD];
+}
+
+/*
+ * Only the mount and unmount probes are registered here: they are hit
+ * once per mount, and they are what opens a snapshot, and with it arms
+ * the capture probes.
+ */
 int bdev_kprobe_module_init(void)
 {
     int ret;
@@ -435,14 +981,8 @@ int bdev_kprobe_module_init(void)
     if (ret)
         goto err_unmount;
 
-    ret = vfs_write_kretprobe_init();
-    if (ret)
-        goto err_vfs;
-        
     return 0;
     
-err_vfs:
-    unmount_kretprobe_exit();
 err_unmount:
     mount_kretprobe_exit();
 err_mount:
@@ -451,8 +991,15 @@ err_mount:
 
 void bdev_kprobe_module_exit(void)
 {
-    vfs_write_kretprobe_exit();
     unmount_kretprobe_exit();
     mount_kretprobe_exit();
+
+    /* Snapshots still open are closed later, by the device teardown */
+    mutex_lock(&capture_probes_lock);
+    if (capture_probes_users) {
+        capture_probes_users = 0;
+        capture_probes_disarm();
+    }
+    mutex_unlock(&capture_probes_lock);
 }
 
@@ -1,13 +1,56 @@
+#include <linux/ioprio.h>
+#include <linux/jhash.h>
 #include <linux/module.h>
+#include <linux/rhashtable.h>
 
+#include "bdev_kprobe.h"
 #include "bdev_list.h"
+#include "snap_spill.h"
 #include "snap_store.h"
 
 /* ============================================================
- * Global snapshot device list
+ * Global snapshot device registry
  * ============================================================ */
-static LIST_HEAD(snap_dev_list);
-static DEFINE_MUTEX(snap_dev_mutex);
+
+/* Device names are NUL-terminated within DEV_NAME_LEN_MAX */
+static u32 snap_name_hashfn(const void *data, u32 len, u32 seed)
+{
+    return jhash(data, strnlen(data, DEV_NAME_LEN_MAX), seed);
+}
+
+static u32 snap_name_obj_hashfn(const void *data, u32 len, u32 seed)
+{
+    const struct snap_device *dev = data;
+
+    return snap_name_hashfn(dev->dev_name, len, seed);
+}
+
+static int snap_name_obj_cmpfn(struct rhashtable_compare_arg *arg, const void *obj)
+{
+    const struct snap_device *dev = obj;
+
+    return strncmp(dev->dev_name, arg->key, DEV_NAME_LEN_MAX);
+}
+
+/* name -> activated snap_device, used by the control path */
+static const struct rhashtable_params snap_name_params = {
+    .head_offset = offsetof(struct snap_device, name_node),
+    .key_offset = offsetof(struct snap_device, dev_name),
+    .hashfn = snap_name_hashfn,
+    .obj_hashfn = snap_name_obj_hashfn,
+    .obj_cmpfn = snap_name_obj_cmpfn,
+    .automatic_shrinking = true,
+};
+static struct rhashtable snap_name_ht;
+
+/* dev_t -> mounted snap_device index, used by the write hot path */
+static const struct rhashtable_params snap_devt_params = {
+    .head_offset = offsetof(struct snap_device, devt_node),
+    .key_offset = offsetof(struct snap_device, bdev_dev),
+    .key_len = sizeof(dev_t),
+    .automatic_shrinking = true,
+};
+static struct rhashtable snap_devt_ht;
 
 /* Global workqueue for cleanup of individual wqs */
 static struct workqueue_struct *cleanup_wq;
@@ -21,20 +64,39 @@ static void snap_device_release(struct kref *kref)
 {
     struct snap_device *dev = container_of(kref, struct snap_device, ref);
     
+    snap_capture_pools_release(dev);
+    snap_qos_release(&dev->qos);
     kfree(dev);
 }
 
+/* Index a device by the dev_t it is mounted on (dev->spin_lock held) */
+static int snapdev_hash_devt(struct snap_device *dev, dev_t devt)
+{
+    int ret;
+
+    if (dev->devt_hashed) {
+        rhashtable_remove_fast(&snap_devt_ht, &dev->devt_node, snap_devt_params);
+        dev->devt_hashed = false;
+    }
+
+    WRITE_ONCE(dev->bdev_dev, devt);
+    ret = rhashtable_lookup_insert_fast(&snap_devt_ht, &dev->devt_node, snap_devt_params);
+    if (ret == -EEXIST)
+        return -EBUSY; /* already snapshotted under another name */
+    if (ret < 0)
+        return ret;
 
-/* Find device by name (RCU read-only) */
-static struct snap_device *_find_snap_device_rcu(const char *dev_name)
+    dev->devt_hashed = true;
+    return 0;
+}
+
+/* Drop a device from the dev_t index (dev->spin_lock held, no-op if not indexed) */
+static void snapdev_unhash_devt(struct snap_device *dev)
 {
-    struct snap_device *dev;
-    
-    list_for_each_entry_rcu(dev, &snap_dev_list, list) {
-        if (strncmp(dev->dev_name, dev_name, DEV_NAME_LEN_MAX) == 0)
-            return dev;
+    if (dev->devt_hashed) {
+        rhashtable_remove_fast(&snap_devt_ht, &dev->devt_node, snap_devt_params);
+        dev->devt_hashed = false;
     }
-    return NULL;
 }
 
 /* Workqueue cleanup work handler */
@@ -45,17 +107,23 @@ static void wq_cleanup_work_handler(struct work_struct *work)
 
     snap_device_get(dev);
 
-    if (dev->wq) {
-        flush_workqueue(dev->wq);
-        destroy_workqueue(dev->wq);
-        dev->wq = NULL;
-    }
+    snap_wb_drain(&dev->wb);
+    snap_shards_drain(dev);
+
+    /* No snapshot opened meanwhile: nothing is left for the shards to do */
+    mutex_lock(&dev->lock);
+    if (!dev->mounted && dev->shards_gen == cw->shards_gen)
+        dev->shards_idle = true;
+    mutex_unlock(&dev->lock);
 
     snap_device_put(dev);
     kfree(cw);
 }
 
-/* Schedule workqueue cleanup on cleanup_wq */
+/*
+ * Schedule the wait for pending jobs on cleanup_wq: the jobs waited for
+ * need engine slots, which the device's own jobs may be holding
+ */
 static void schedule_cleanup_device_wq(struct snap_device *dev)
 {
     struct wq_cleanup_work *cw = kmalloc(sizeof(*cw), GFP_KERNEL);
@@ -63,45 +131,54 @@ static void schedule_cleanup_device_wq(struct snap_device *dev)
         return;
 
     cw->dev = dev;
+    cw->shards_gen = READ_ONCE(dev->shards_gen);
     snap_device_get(dev);
 
     INIT_WORK(&cw->work, wq_cleanup_work_handler);
     queue_work(cleanup_wq, &cw->work);
 }
 
-/* Internal: remove device (snap_dev_mutex must already be held) */
+/* Release the registry reference of a device no longer in the registry */
+static void snap_device_drop(struct snap_device *dev, bool defer_cleanup)
+{
+    spin_lock_irq(&dev->spin_lock);
+    snapdev_unhash_devt(dev);
+    spin_unlock_irq(&dev->spin_lock);
+
+    /* Lookups may still hold it without a reference */
+    synchronize_rcu();
+
+    /* Deferred when called from one of the device's own jobs */
+    if (defer_cleanup) {
+        schedule_cleanup_device_wq(dev);
+    } else {
+        snap_wb_drain(&dev->wb);
+        snap_shards_drain(dev);
+    }
+    snap_device_put(dev);
+}
+
+/* Internal: remove device from the registry if disabled and not mounted */
 static void __remove_device_if_disabled(struct snap_device *dev, bool defer_cleanup)
 {
     bool drop = false;
 
+    /* Leaves the registry under dev->lock: see add_or_enable_snap_device() */
     mutex_lock(&dev->lock);
-    if (!dev->enabled && !dev->mounted)
+    if (!dev->enabled && !dev->mounted && !dev->unlisted) {
+        rhashtable_remove_fast(&snap_name_ht, &dev->name_node, snap_name_params);
+        dev->unlisted = true;
         drop = true;
+    }
     mutex_unlock(&dev->lock);
 
-    if (drop) {
-        list_del_rcu(&dev->list);
-        synchronize_rcu();
-        
-        if (defer_cleanup) {
-            schedule_cleanup_device_wq(dev);
-        } else {
-            if (dev->wq) {
-                flush_workqueue(dev->wq);
-                destroy_workqueue(dev->wq);
-                dev->wq = NULL;
-            }            
-        }
-        snap_device_put(dev);
-    }
+    if (drop)
+        snap_device_drop(dev, defer_cleanup);
 }
 
-/* Public safe wrapper: acquires snap_dev_mutex */
 static void remove_device_if_disabled_after_unmount(struct snap_device *dev)
 {
-    mutex_lock(&snap_dev_mutex);
     __remove_device_if_disabled(dev, true);
-    mutex_unlock(&snap_dev_mutex);
 }
 
 /* ============================================================
@@ -131,7 +208,21 @@ struct snap_device *snap_find_device_get(const char *dev_name)
         return NULL;
 
     rcu_read_lock();
-    dev = _find_snap_device_rcu(dev_name);
+    dev = rhashtable_lookup(&snap_name_ht, dev_name, snap_name_params);
+    if (dev && !kref_get_unless_zero(&dev->ref))
+        dev = NULL;
+    rcu_read_unlock();
+
+    return dev;
+}
+
+/* Find the mounted device with the given dev_t and increment reference */
+struct snap_device *snap_find_device_by_devt_get(dev_t devt)
+{
+    struct snap_device *dev;
+
+    rcu_read_lock();
+    dev = rhashtable_lookup(&snap_devt_ht, &devt, snap_devt_params);
     if (dev && !kref_get_unless_zero(&dev->ref))
         dev = NULL;
     rcu_read_unlock();
@@ -140,92 +231,90 @@ struct snap_device *snap_find_device_get(const char *dev_name)
 }
 
 /* ============================================================
- * Device list management
+ * Device registry management
  * ============================================================ */
 
 /* Add new device or enable existing one */
 int add_or_enable_snap_device(const char *dev_name)
 {
-    struct snap_device *dev;
-    int ret = 0;
-    char wq_name[DEV_NAME_LEN_MAX + 8];
-
-    mutex_lock(&snap_dev_mutex);
+    struct snap_device *dev, *old;
+    int ret;
 
+retry:
     /* Check if device already exists */
-    list_for_each_entry(dev, &snap_dev_list, list) {
+    dev = snap_find_device_get(dev_name);
+    if (dev) {
         mutex_lock(&dev->lock);
-        if (strncmp(dev->dev_name, dev_name, DEV_NAME_LEN_MAX) == 0) {
-            if (dev->enabled) {
-                ret = 1;  /* already enabled */
-            } else {
-                dev->enabled = true;
-            }
+        if (dev->unlisted) {
+            /* Removed meanwhile: it has left the registry, try again */
             mutex_unlock(&dev->lock);
-            goto out_unlock;
+            snap_device_put(dev);
+            goto retry;
         }
+        ret = dev->enabled ? 1 : 0; /* 1 = already enabled */
+        dev->enabled = true;
         mutex_unlock(&dev->lock);
+        snap_device_put(dev);
+        return ret;
     }
 
     /* Allocate new device */
     dev = kzalloc(sizeof(*dev), GFP_KERNEL);
-    if (!dev) {
-        ret = -ENOMEM;
-        goto out_unlock;
-    }
+    if (!dev)
+        return -ENOMEM;
 
     strscpy(dev->dev_name, dev_name, sizeof(dev->dev_name));
 
-    snprintf(wq_name, sizeof(wq_name), "%s_wq", dev->dev_name);
-    dev->wq = alloc_ordered_workqueue(wq_name, WQ_MEM_RECLAIM);
-    if (!dev->wq) {
-        kfree(dev);
-        ret = -ENOMEM;
-        goto out_unlock;
-    }
-    
     dev->enabled = true;
     dev->mounted = false;
     dev->saved_bitmap = NULL;
     
     mutex_init(&dev->lock);
     spin_lock_init(&dev->spin_lock);
+    xa_init(&dev->deferred);
+    init_rwsem(&dev->store_sem);
+    mutex_init(&dev->store_lock);
+    init_waitqueue_head(&dev->index_wait);
+    cpumask_copy(&dev->flush_cpus, cpu_possible_mask);
+    snap_wb_ctx_init(&dev->wb, &dev->flush_cpus);
+    snap_wb_job_init(&dev->spill_job, snap_spill_job_handler);
+    snap_default_config(&dev->cfg);
+    snap_qos_init(&dev->qos);
     kref_init(&dev->ref);
 
-    list_add_rcu(&dev->list, &snap_dev_list);
+    old = rhashtable_lookup_get_insert_fast(&snap_name_ht, &dev->name_node, snap_name_params);
+    if (old) {
+        /* Concurrent activation of the same name, or no memory */
+        kfree(dev);
+        if (IS_ERR(old))
+            return PTR_ERR(old);
+        goto retry;
+    }
 
-out_unlock:
-    mutex_unlock(&snap_dev_mutex);
-    return ret;
+    return 0;
 }
 
 /* Disable snapshot device */
 int disable_snap_device(const char *dev_name)
 {
     struct snap_device *dev;
-    int ret = -ENOENT;
+    int ret = 1; /* already disabled */
 
-    mutex_lock(&snap_dev_mutex);
-    list_for_each_entry(dev, &snap_dev_list, list) {
-        mutex_lock(&dev->lock);
-        if (strncmp(dev->dev_name, dev_name, DEV_NAME_LEN_MAX) == 0) {
-            if (!dev->enabled) {
-                ret = 1; /* already disabled */
-            } else {
-                dev->enabled = false;
-                mutex_unlock(&dev->lock);
-                
-                __remove_device_if_disabled(dev, false);
-                ret = 0;
-                goto out_unlock;
-            }
-            mutex_unlock(&dev->lock);
-            goto out_unlock;
-        }
-        mutex_unlock(&dev->lock);
+    dev = snap_find_device_get(dev_name);
+    if (!dev)
+        return -ENOENT;
+
+    mutex_lock(&dev->lock);
+    if (dev->enabled && !dev->unlisted) {
+        dev->enabled = false;
+        ret = 0;
     }
-out_unlock:
-    mutex_unlock(&snap_dev_mutex);
+    mutex_unlock(&dev->lock);
+
+    if (ret == 0)
+        __remove_device_if_disabled(dev, false);
+
+    snap_device_put(dev);
     return ret;
 }
 
@@ -233,8 +322,8 @@ out_unlock:
  * Device mount/unmount
  * ============================================================ */
 
-/* Mark device as mounted */
-int snapdev_mark_mounted(struct snap_device *dev)
+/* Mark device as mounted on the block device 'devt' */
+int snapdev_mark_mounted(struct snap_device *dev, dev_t devt)
 {
     unsigned long flags;
     int ret = 0;
@@ -248,9 +337,11 @@ int snapdev_mark_mounted(struct snap_device *dev)
     } else if (dev->mounted) {
         ret = -EBUSY;
     } else {
-        dev->mounted = true;
-        ktime_get_real_ts64(&dev->mount_time);
-        ret = 0;
+        ret = snapdev_hash_devt(dev, devt);
+        if (ret == 0) {
+            dev->mounted = true;
+            ktime_get_real_ts64(&dev->mount_time);
+        }
     }
     
     spin_unlock_irqrestore(&dev->spin_lock, flags);
@@ -261,6 +352,7 @@ int snapdev_mark_mounted(struct snap_device *dev)
 /* Heavy mount work */
 int snapdev_do_mount_work(struct snap_device *dev)
 {
+    struct snap_bitmap *bitmap;
     int ret = 0;
 
     if (!dev)
@@ -274,25 +366,67 @@ int snapdev_do_mount_work(struct snap_device *dev)
         goto out_unlock;
     }
 
-    /* Open snapshot directory + metadata.json */
+    /* Open snapshot directory, metadata index and block log */
+    down_write(&dev->store_sem);
     ret = open_snapshot(dev);
+    up_write(&dev->store_sem);
     if (ret < 0)
         goto fail_unmount;
 
-    /* Allocate bitmap */
-    kfree(dev->saved_bitmap);
-    dev->saved_bitmap = kzalloc(BITS_TO_LONGS(dev->num_blocks) * sizeof(long), GFP_KERNEL);
-    if (!dev->saved_bitmap) {
+    /*
+     * Capture buffers and shards must be ready before the bitmap enables
+     * captures. Nothing is waited for here, as this job holds an engine
+     * slot: the old shards are only resized once drained on cleanup_wq.
+     */
+    ret = snap_capture_pools_setup(dev);
+    if (ret < 0)
+        goto fail_close;
+
+    /* Allocate bitmap, holding the blocks already saved in a resumed snapshot */
+    xa_destroy(&dev->deferred);
+    bitmap = snap_bitmap_alloc(dev->num_blocks);
+    if (!bitmap) {
         ret = -ENOMEM;
-        goto fail_unmount;
+        goto fail_close;
+    }
+
+    if (dev->resumed) {
+        ret = snap_load_saved_bitmap(dev, bitmap);
+        if (ret < 0) {
+            pr_err("%s: cannot load the saved blocks of %s, err=%d\n",
+                   MOD_NAME, dev->snapshot_dir, ret);
+            snap_bitmap_free(bitmap);
+            goto fail_close;
+        }
+    }
+
+    /* The writes are only seen from here on: before the bitmap enables captures */
+    ret = snap_capture_probes_get();
+    if (ret < 0) {
+        snap_bitmap_free(bitmap);
+        goto fail_close;
     }
+    dev->capture_probes = true;
+    dev->capture_missed = snap_capture_probes_missed();
+    dev->bread_missed = snap_bread_probe_missed();
+
+    spin_lock_irq(&dev->spin_lock);
+    swap(dev->saved_bitmap, bitmap);
+    spin_unlock_irq(&dev->spin_lock);
+    snap_bitmap_free(bitmap); /* left over, if any */
 
     goto out_unlock;
 
+fail_close:
+    down_write(&dev->store_sem);
+    close_snapshot(dev);
+    up_write(&dev->store_sem);
+
 fail_unmount:
     /* Rollback: clear mounted flag */
     spin_lock_irq(&dev->spin_lock);
     dev->mounted = false;
+    snapdev_unhash_devt(dev);
     spin_unlock_irq(&dev->spin_lock);
 
 out_unlock:
@@ -312,6 +446,7 @@ int snapdev_mark_unmounted(struct snap_device *dev)
     spin_lock_irqsave(&dev->spin_lock, flags);
     if (dev->mounted) {
         dev->mounted = false;
+        snapdev_unhash_devt(dev);
         ret = 0;
     } else {
         ret = -EINVAL;
@@ -322,9 +457,31 @@ int snapdev_mark_unmounted(struct snap_device *dev)
     return ret;
 }
 
+/*
+ * A capture probe missed hits since the snapshot of a device opened:
+ * the writes they were cannot be told apart, so it may lack blocks of
+ * any open snapshot (dev->lock held)
+ */
+static void snapdev_check_capture_missed(struct snap_device *dev)
+{
+    u64 missed;
+
+    if (!dev->capture_probes || READ_ONCE(dev->incomplete))
+        return;
+
+    missed = snap_capture_probes_missed();
+    if (missed == dev->capture_missed)
+        return;
+
+    WRITE_ONCE(dev->incomplete, true);
+    pr_warn("%s: %llu probe hits missed while the snapshot of %s was open, "
+            "marked incomplete\n", MOD_NAME, missed - dev->capture_missed, dev->dev_name);
+}
+
 /* Internal: heavy unmount work */
 static int __snapdev_do_unmount_work(struct snap_device *dev)
 {
+    struct snap_bitmap *bitmap;
     int ret = 0;
 
     if (!dev)
@@ -337,10 +494,42 @@ static int __snapdev_do_unmount_work(struct snap_device *dev)
         goto out_unlock;
     }
 
+    /* Everything captured so far belongs to this snapshot */
+    snap_flush_capture_queue(dev);
+    snapdev_check_capture_missed(dev);
+
+    /* No batch of any shard may be in flight past this point */
+    down_write(&dev->store_sem);
+
+    /* Session mode: the next mount resumes this snapshot */
+    if (READ_ONCE(dev->cfg.session) && dev->saved_bitmap)
+        snap_save_session(dev);
+
+    /*
+     * After the session unclaimed the armed blocks, before the header is
+     * written: a capture dropped here marks it incomplete
+     */
+    snap_release_deferred_captures(dev, snap_bread_probe_missed() != dev->bread_missed);
+
     close_snapshot(dev);
+    up_write(&dev->store_sem);
 
-    kfree(dev->saved_bitmap);
+    spin_lock_irq(&dev->spin_lock);
+    bitmap = dev->saved_bitmap;
     dev->saved_bitmap = NULL;
+    spin_unlock_irq(&dev->spin_lock);
+    snap_bitmap_free(bitmap);
+
+    /* The last snapshot closed: writes are no longer probed */
+    if (dev->capture_probes) {
+        dev->capture_probes = false;
+        snap_capture_probes_put();
+    }
+
+    /* The flushes kicked above may still be queued: drained off the engine */
+    dev->shards_gen++;
+    if (dev->shards)
+        schedule_cleanup_device_wq(dev);
 
 out_unlock:
     mutex_unlock(&dev->lock);
@@ -361,9 +550,9 @@ int snapdev_do_unmount_work(struct snap_device *dev)
 /* ------------------------------------------------------ */
 
 /* Get saved_bitmap pointer with spinlock protection */
-unsigned long *snapdev_get_saved_bitmap(struct snap_device *dev)
+struct snap_bitmap *snapdev_get_saved_bitmap(struct snap_device *dev)
 {
-    unsigned long *bitmap = NULL;
+    struct snap_bitmap *bitmap = NULL;
     unsigned long flags;
 
     if (!dev)
@@ -394,28 +583,278 @@ bool snapdev_is_mounted(struct snap_device *dev)
     return mounted;
 }
 
+/* Copy the counters of a device */
+int snapdev_get_stats(const char *dev_name, struct snap_dev_stats *out)
+{
+    struct snap_device *dev;
+    int i;
+
+    if (!dev_name || !out)
+        return -EINVAL;
+
+    dev = snap_find_device_get(dev_name);
+    if (!dev)
+        return -ENOENT;
+
+    /* Not while the snapshot is being opened or closed */
+    if (mutex_trylock(&dev->lock)) {
+        snapdev_check_capture_missed(dev);
+        mutex_unlock(&dev->lock);
+    }
+
+    memset(out, 0, sizeof(*out));
+    snap_probes_missed(out->probe_missed);
+    out->capture_hits = atomic64_read(&dev->stats.capture_hits);
+    out->capture_deferred = atomic64_read(&dev->stats.capture_deferred);
+    out->deferred_done = atomic64_read(&dev->stats.deferred_done);
+    out->pool_exhausted = atomic64_read(&dev->stats.pool_exhausted);
+    out->flush_batches = atomic64_read(&dev->stats.flush_batches);
+    out->flushed_blocks = atomic64_read(&dev->stats.flushed_blocks);
+    out->flushed_extents = atomic64_read(&dev->stats.flushed_extents);
+    out->flushed_bytes = atomic64_read(&dev->stats.flushed_bytes);
+    out->flush_ns = atomic64_read(&dev->stats.flush_ns);
+    out->syncs = atomic64_read(&dev->stats.syncs);
+    out->sync_ns = atomic64_read(&dev->stats.sync_ns);
+    out->persisted = atomic64_read(&dev->stats.persisted);
+    out->persist_lat_ns = atomic64_read(&dev->stats.persist_lat_ns);
+    out->persist_lat_max_ns = atomic64_read(&dev->stats.persist_lat_max_ns);
+    out->ordered_holds = atomic64_read(&dev->stats.ordered_holds);
+    out->ordered_misses = atomic64_read(&dev->stats.ordered_misses);
+    out->throttled_ns = atomic64_read(&dev->stats.throttled_ns);
+    out->mem_bytes = max(atomic_long_read(&dev->mem_bytes), 0L);
+    out->mem_overloads = atomic64_read(&dev->stats.mem_overloads);
+    out->mem_holds = atomic64_read(&dev->stats.mem_holds);
+    out->spilled_blocks = atomic64_read(&dev->stats.spilled_blocks);
+    for (i = 0; i < SNAP_LAT_BUCKETS; i++) {
+        out->lat_first_write[i] = atomic64_read(&dev->stats.lat_first_write[i]);
+        out->lat_steady_write[i] = atomic64_read(&dev->stats.lat_steady_write[i]);
+        out->lat_hold[i] = atomic64_read(&dev->stats.lat_hold[i]);
+    }
+    out->queue_depth = max(atomic_read(&dev->queue_depth), 0);
+    out->incomplete = READ_ONCE(dev->incomplete);
+    spin_lock_irq(&dev->spin_lock);
+    if (dev->saved_bitmap)
+        out->bitmap_bytes = (u64)atomic_read(&dev->saved_bitmap->nr_alloc) * PAGE_SIZE;
+    spin_unlock_irq(&dev->spin_lock);
+
+    snap_device_put(dev);
+    return 0;
+}
+
+/*
+ * Parse the CPU list of a configuration into 'cpus', writing it back in
+ * canonical form: "all" or a list of possible CPUs
+ */
+static int snapdev_parse_cpus(char *list, size_t size, struct cpumask *cpus)
+{
+    if (sysfs_streq(list, "all")) {
+        cpumask_copy(cpus, cpu_possible_mask);
+    } else {
+        if (cpulist_parse(list, cpus) < 0)
+            return -EINVAL;
+        cpumask_and(cpus, cpus, cpu_possible_mask);
+        if (cpumask_empty(cpus))
+            return -EINVAL;
+    }
+
+    if (cpumask_equal(cpus, cpu_possible_mask))
+        strscpy(list, "all", size);
+    else
+        scnprintf(list, size, "%*pbl", cpumask_pr_args(cpus));
+    return 0;
+}
+
+/* Serializes the configuration updates, whose QoS part may sleep */
+static DEFINE_MUTEX(snapdev_config_lock);
+
+/* Update the tunables of a device (SNAP_CFG_KEEP fields are kept) and return them */
+int snapdev_config(const char *dev_name, struct snap_dev_config *cfg)
+{
+    struct snap_device *dev;
+    cpumask_var_t cpus;
+    bool set_cpus;
+    int ret = 0;
+
+    if (!dev_name || !cfg)
+        return -EINVAL;
+
+    if ((cfg->flush_batch != SNAP_CFG_KEEP &&
+         (cfg->flush_batch == 0 || cfg->flush_batch > SNAP_FLUSH_BATCH_MAX)) ||
+        (cfg->flush_latency_us != SNAP_CFG_KEEP &&
+         cfg->flush_latency_us > SNAP_FLUSH_LATENCY_MAX_US) ||
+        (cfg->durability != SNAP_CFG_KEEP && cfg->durability >= SNAP_DURABILITY_MAX) ||
+        (cfg->commit_interval_ms != SNAP_CFG_KEEP &&
+         cfg->commit_interval_ms > SNAP_COMMIT_INTERVAL_MAX_MS) ||
+        (cfg->ordered != SNAP_CFG_KEEP && cfg->ordered > 1) ||
+        (cfg->session != SNAP_CFG_KEEP && cfg->session > 1) ||
+        (cfg->ioprio_class != SNAP_CFG_KEEP && cfg->ioprio_class > IOPRIO_CLASS_IDLE) ||
+        (cfg->ioprio_level != SNAP_CFG_KEEP && cfg->ioprio_level >= IOPRIO_NR_LEVELS) ||
+        (cfg->overload != SNAP_CFG_KEEP && cfg->overload >= SNAP_OVERLOAD_MAX))
+        return -EINVAL;
+
+    cfg->cgroup[sizeof(cfg->cgroup) - 1] = '\0';
+    if (cfg->cgroup[0] != '\0' && cfg->cgroup[0] != '/')
+        return -EINVAL;
+
+    if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+        return -ENOMEM;
+
+    cfg->flush_cpus[sizeof(cfg->flush_cpus) - 1] = '\0';
+    set_cpus = cfg->flush_cpus[0] != '\0';
+    if (set_cpus) {
+        ret = snapdev_parse_cpus(cfg->flush_cpus, sizeof(cfg->flush_cpus), cpus);
+        if (ret < 0)
+            goto out_free;
+    }
+
+    dev = snap_find_device_get(dev_name);
+    if (!dev) {
+        ret = -ENOENT;
+        goto out_free;
+    }
+
+    mutex_lock(&snapdev_config_lock);
+    if (cfg->cgroup[0] != '\0') {
+        ret = snap_qos_set_cgroup(&dev->qos, cfg->cgroup);
+        if (ret < 0) {
+            mutex_unlock(&snapdev_config_lock);
+            goto out_put;
+        }
+    }
+
+    if (cfg->flush_batch != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.flush_batch, cfg->flush_batch);
+    if (cfg->flush_latency_us != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.flush_latency_us, cfg->flush_latency_us);
+    if (cfg->durability != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.durability, cfg->durability);
+    if (cfg->commit_interval_ms != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.commit_interval_ms, cfg->commit_interval_ms);
+    if (cfg->ordered != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.ordered, cfg->ordered);
+    if (cfg->session != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.session, cfg->session);
+    if (cfg->ioprio_class != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.ioprio_class, cfg->ioprio_class);
+    if (cfg->ioprio_level != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.ioprio_level, cfg->ioprio_level);
+    if (cfg->max_kbps != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.max_kbps, cfg->max_kbps);
+    if (cfg->max_iops != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.max_iops, cfg->max_iops);
+    if (cfg->overload != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.overload, cfg->overload);
+    if (cfg->mem_budget_kb != SNAP_CFG_KEEP)
+        WRITE_ONCE(dev->cfg.mem_budget_kb, cfg->mem_budget_kb);
+
+    /* Class 0 leaves the priority of the worker, whatever the level */
+    snap_qos_set_limits(&dev->qos,
+                        dev->cfg.ioprio_class == IOPRIO_CLASS_NONE ? 0 :
+                        IOPRIO_PRIO_VALUE(dev->cfg.ioprio_class, dev->cfg.ioprio_level),
+                        dev->cfg.max_kbps, dev->cfg.max_iops);
+
+    /* The CPU list and its mask, the cgroup path and its cgroup change together */
+    spin_lock_irq(&dev->spin_lock);
+    if (set_cpus) {
+        strscpy(dev->cfg.flush_cpus, cfg->flush_cpus, sizeof(dev->cfg.flush_cpus));
+        snap_wb_set_cpus(&dev->flush_cpus, cpus);
+    }
+    if (cfg->cgroup[0] != '\0')
+        strscpy(dev->cfg.cgroup, cfg->cgroup, sizeof(dev->cfg.cgroup));
+    *cfg = dev->cfg;
+    spin_unlock_irq(&dev->spin_lock);
+    mutex_unlock(&snapdev_config_lock);
+
+out_put:
+    snap_device_put(dev);
+
+out_free:
+    free_cpumask_var(cpus);
+    return ret;
+}
+
+/* Visit every registered device; the registry reference keeps it alive meanwhile */
+void snapdev_for_each_rcu(void (*fn)(struct snap_device *dev, void *arg), void *arg)
+{
+    struct rhashtable_iter iter;
+    struct snap_device *dev;
+
+    rhashtable_walk_enter(&snap_name_ht, &iter);
+    rhashtable_walk_start(&iter);
+    while ((dev = rhashtable_walk_next(&iter)) != NULL) {
+        /* -EAGAIN: resized meanwhile, some devices may be seen twice */
+        if (IS_ERR(dev))
+            continue;
+        fn(dev, arg);
+    }
+    rhashtable_walk_stop(&iter);
+    rhashtable_walk_exit(&iter);
+}
+
 /* ============================================================
  * Cleanup
  * ============================================================ */
 
-/* Clear all devices */
+/* Any device left in the registry, referenced; NULL once it is empty */
+static struct snap_device *snap_any_device_get(void)
+{
+    struct rhashtable_iter iter;
+    struct snap_device *dev;
+
+    rhashtable_walk_enter(&snap_name_ht, &iter);
+    rhashtable_walk_start(&iter);
+    while ((dev = rhashtable_walk_next(&iter)) != NULL) {
+        /* -EAGAIN: resized meanwhile, walk on */
+        if (!IS_ERR(dev) && kref_get_unless_zero(&dev->ref))
+            break;
+    }
+    rhashtable_walk_stop(&iter);
+    rhashtable_walk_exit(&iter);
+
+    return dev;
+}
+
+/* Tear down one device of the registry, leaving it as __remove_device_if_disabled() does */
+static void snap_device_teardown(struct snap_device *dev)
+{
+    bool drop = false;
+
+    mutex_lock(&dev->lock);
+    dev->enabled = false;  // force the removal
+    if (!dev->unlisted) {
+        rhashtable_remove_fast(&snap_name_ht, &dev->name_node, snap_name_params);
+        dev->unlisted = true;
+        drop = true;
+    }
+    mutex_unlock(&dev->lock);
+
+    snapdev_mark_unmounted(dev);
+    __snapdev_do_unmount_work(dev);
+
+    if (drop)
+        snap_device_drop(dev, false);
+}
+
+/*
+ * Clear all devices. The jobs still queued for the others look the
+ * tables up meanwhile: the devices leave them one at a time, and the
+ * tables are only destroyed once empty and no longer in use.
+ */
 static void clear_snap_devices(void)
 {
-    struct snap_device *dev, *tmp;
+    struct snap_device *dev;
 
-    mutex_lock(&snap_dev_mutex);
-    list_for_each_entry_safe(dev, tmp, &snap_dev_list, list) {
-        mutex_lock(&dev->lock);
-        dev->enabled = false;  // force the removal
-        mutex_unlock(&dev->lock);
-        
-        snapdev_mark_unmounted(dev);
-        __snapdev_do_unmount_work(dev);
-        
-        __remove_device_if_disabled(dev, false);
+    while ((dev = snap_any_device_get()) != NULL) {
+        snap_device_teardown(dev);
+        snap_device_put(dev);
     }
-    mutex_unlock(&snap_dev_mutex);
+
+    /* Devices dropped from their own jobs: their contexts drain there */
+    flush_workqueue(cleanup_wq);
     synchronize_rcu();
+
+    rhashtable_destroy(&snap_name_ht);
+    rhashtable_destroy(&snap_devt_ht);
 }
 
 /* ============================================================
@@ -424,20 +863,56 @@ static void clear_snap_devices(void)
 
 int bdev_list_init(void)
 {
+    int ret;
+
+    ret = snap_wb_init();
+    if (ret) {
+        pr_err("%s: failed to start the writeback workers\n", MOD_NAME);
+        return ret;
+    }
+
+    ret = rhashtable_init(&snap_name_ht, &snap_name_params);
+    if (ret)
+        goto err_name;
+
+    ret = rhashtable_init(&snap_devt_ht, &snap_devt_params);
+    if (ret)
+        goto err_devt;
+
     /* Creating the global cleanup workqueue */
     cleanup_wq = alloc_workqueue("snap_cleanup_wq",
                                  WQ_UNBOUND | WQ_HIGHPRI | WQ_MEM_RECLAIM,
                                  0);
     if (!cleanup_wq) {
         pr_err("%s: failed to allocate cleanup_wq\n", MOD_NAME);
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto err_wq;
+    }
+
+    /* Walks the registry: after it is set up */
+    ret = snap_spill_init();
+    if (ret) {
+        pr_err("%s: failed to register the capture memory shrinker\n", MOD_NAME);
+        goto err_shrinker;
     }
     
     return 0;
+
+err_shrinker:
+    destroy_workqueue(cleanup_wq);
+    cleanup_wq = NULL;
+err_wq:
+    rhashtable_destroy(&snap_devt_ht);
+err_devt:
+    rhashtable_destroy(&snap_name_ht);
+err_name:
+    snap_wb_exit();
+    return ret;
 }
 
 void bdev_list_exit(void)
 {
+    snap_spill_exit();
     clear_snap_devices();
 
     if (cleanup_wq) {
@@ -445,5 +920,7 @@ void bdev_list_exit(void)
         destroy_workqueue(cleanup_wq);
         cleanup_wq = NULL;
     }
+
+    snap_wb_exit();
 }
 
@@ -5,6 +5,7 @@
 #include "cdev_snap.h"
 #include "snap_auth.h"
 #include "snap_ioctl.h"
+#include "snap_recovery.h"
 #include "uapi/bdev_snapshot.h"
 
 /* Module parameter: initial password */
@@ -58,6 +59,11 @@ static int __init bdevsnapshot_init(void)
         goto err_kprobe_init;
     }
 
+    /* Close the snapshots left open by a crash, without delaying the load */
+    ret = snap_recovery_start();
+    if (ret)
+        pr_warn("%s: crash recovery of open snapshots not started (%d)\n", MOD_NAME, ret);
+
     pr_info("%s: module loaded successfully\n", MOD_NAME);
     return 0;
 
@@ -73,6 +79,7 @@ err_cdev_init:
 
 static void __exit bdevsnapshot_exit(void)
 {
+    snap_recovery_exit();
     bdev_kprobe_module_exit();
     bdev_list_exit();
     cdev_snap_exit();
@@ -1,8 +1,19 @@
 #ifndef _BDEV_KPROBE_H
 #define _BDEV_KPROBE_H
 
+#include <linux/version.h>
+
+#include "snap_wb.h"
 #include "uapi/bdev_snapshot.h"
 
+/*
+ * Writes are intercepted by fprobes where the kernel has them, with the
+ * handler signatures of 6.5 and later, by a kretprobe otherwise
+ */
+#if defined(CONFIG_FPROBE) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+# define SNAP_WRITE_FPROBE
+#endif
+
 /* Portable macro to extract first argument from pt_regs on x86-64 */
 #ifndef PT_REGS_PARM1
 # if defined(CONFIG_X86_64)
@@ -12,6 +23,15 @@
 # endif
 #endif
 
+/* Portable macro to extract second argument from pt_regs on x86-64 */
+#ifndef PT_REGS_PARM2
+# if defined(CONFIG_X86_64)
+#  define PT_REGS_PARM2(x) ((void *)((x)->si))
+# else
+#  define PT_REGS_PARM2(x) NULL
+# endif
+#endif
+
 /* Portable macro to extract third argument from pt_regs on x86-64 */
 #ifndef PT_REGS_PARM3
 # if defined(CONFIG_X86_64)
@@ -30,26 +50,44 @@
 # endif
 #endif
 
+/*
+ * Calls each return probe may follow at once, per possible CPU, with a
+ * floor, unless the probe_maxactive module parameter sets them all.
+ * Writers may sleep in vfs_write, held until their pre-image is saved.
+ */
+#define SNAP_MAXACTIVE_MOUNT_PER_CPU  2
+#define SNAP_MAXACTIVE_MOUNT_MIN      20
+#define SNAP_MAXACTIVE_WRITE_PER_CPU  8
+#define SNAP_MAXACTIVE_WRITE_MIN      64
+#define SNAP_MAXACTIVE_MAX            4096
+
 /* Metadata for unmount kretprobe */
 struct umount_kretprobe_metadata {
-    char dev_name[DEV_NAME_LEN_MAX];
+    dev_t devt;
+};
+
+/* Entry data of a snapshotted write, until its return */
+struct singlefilefs_write_metadata {
+    struct snap_device *sdev;   /* device written to, referenced until return */
+    u64 start_ns;               /* entry time, for the latency histograms */
+    bool first_touch;           /* the write claimed at least one block */
+    int cpu;                    /* fprobes: CPU whose write mark may point here */
 };
 
-struct singlefilefs_write_kretprobe_metadata {
-    struct snap_pending_block *pending_blocks;
-    loff_t original_offset;
-    loff_t original_inode_size; 
-    struct inode *inode;
+/* Entry data of a read of a block with an armed capture, until its return */
+struct bread_metadata {
+    struct snap_device *sdev;   /* device read from, referenced until return */
+    bool fresh;                 /* not cached as the read started: unmodified */
 };
 
-/* ================= Workqueue Structures ================= */
+/* ================= Writeback Jobs ================= */
 struct mount_work {
-    struct work_struct work;
+    struct snap_wb_job job;
     char dev_name[DEV_NAME_LEN_MAX];
 };
 
 struct unmount_work {
-    struct work_struct work;
+    struct snap_wb_job job;
     char dev_name[DEV_NAME_LEN_MAX];
     long unmount_ret;
 };
@@ -57,5 +95,27 @@ struct unmount_work {
 int bdev_kprobe_module_init(void);
 void bdev_kprobe_module_exit(void);
 
+/*
+ * Register the write and block read probes for one more open snapshot,
+ * or drop it, unregistering them with the last one (may sleep)
+ */
+int snap_capture_probes_get(void);
+void snap_capture_probes_put(void);
+
+/* Hits each probe missed since the module was loaded (may sleep) */
+void snap_probes_missed(u64 missed[SNAP_PROBE_MAX]);
+
+/*
+ * Misses of the probes a capture goes through, summed: while it grows,
+ * any open snapshot may lack blocks (may sleep)
+ */
+u64 snap_capture_probes_missed(void);
+
+/*
+ * Misses of the block read probe since it was registered: only valid
+ * while the caller holds the capture probes
+ */
+unsigned long snap_bread_probe_missed(void);
+
 #endif
 
@@ -1,46 +1,160 @@
 #ifndef _BDEV_LIST_H
 #define _BDEV_LIST_H
 
+#include <linux/cpumask.h>
+#include <linux/llist.h>
+#include <linux/rhashtable-types.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+#include "snap_bitmap.h"
+#include "snap_pool.h"
+#include "snap_qos.h"
+#include "snap_wb.h"
 #include "uapi/bdev_snapshot.h"
 
+struct kvec;
+struct snap_device;
+struct snap_extent_rec;
+struct snap_pending_block;
+
+/* Per-device counters, reported through SNAP_STATS */
+struct snap_dev_counters {
+    atomic64_t capture_hits;       /* pre-images copied from the buffer cache */
+    atomic64_t capture_deferred;   /* captures armed on a buffer cache miss */
+    atomic64_t deferred_done;      /* deferred captures completed on block read */
+    atomic64_t pool_exhausted;     /* captures dropped (snapshot incomplete) */
+    atomic64_t flush_batches;      /* batches written by the flusher */
+    atomic64_t flushed_blocks;     /* blocks written by the flusher */
+    atomic64_t flushed_extents;    /* extent records written by the flusher */
+    atomic64_t flushed_bytes;      /* block data written by the flusher */
+    atomic64_t flush_ns;           /* flusher time spent writing and syncing */
+    atomic64_t syncs;              /* fdatasync calls on the snapshot store */
+    atomic64_t sync_ns;            /* time spent in them */
+    atomic64_t persisted;          /* batches or group commits made persistent */
+    atomic64_t persist_lat_ns;     /* sum of their capture-to-persistent latencies */
+    atomic64_t persist_lat_max_ns; /* worst of those latencies */
+    atomic64_t ordered_holds;      /* writes held until their pre-image was durable */
+    atomic64_t ordered_misses;     /* ordered captures whose buffer could not be held */
+    atomic64_t throttled_ns;       /* time the snapshot I/O waited for the QoS caps */
+    atomic64_t mem_overloads;      /* captures over the device or global memory budget */
+    atomic64_t mem_holds;          /* writes held because of the memory budget */
+    atomic64_t spilled_blocks;     /* pre-images moved to the overflow file */
+    atomic64_t lat_first_write[SNAP_LAT_BUCKETS];
+    atomic64_t lat_steady_write[SNAP_LAT_BUCKETS];
+    atomic64_t lat_hold[SNAP_LAT_BUCKETS];
+};
+
+/*
+ * Writeback shard of a device: the captures of its block ranges, with
+ * their own flush job. The shards of a device flush in parallel on the
+ * writeback engine; the batches of one shard are written in order.
+ */
+struct snap_shard {
+    struct snap_device *dev;
+    struct mutex lock;             /* serializes the flushes of the shard */
+    struct llist_head capture_q;   /* claimed pre-images waiting for the flusher (MPSC) */
+    atomic_t queue_depth;          /* blocks in capture_q */
+    struct snap_wb_ctx wb;         /* runs flush_job, independently of the other shards */
+    struct snap_wb_job flush_job;  /* drains capture_q, holds a device reference while pending */
+    struct delayed_work flush_work;/* flush latency timer, queues flush_job */
+    struct llist_node *flush_backlog; /* FIFO rest of capture_q not yet flushed (lock) */
+    struct kvec *flush_vec;        /* flusher batch: block data (lock) */
+    struct snap_pending_block **flush_blks; /* flusher batch: blocks sorted by number (lock) */
+    struct snap_extent_rec *flush_recs; /* flusher batch: extent records (lock) */
+    void *spill_buf;               /* flusher batch: data read back from the overflow file (lock) */
+    size_t spill_buf_size;
+};
+
 /* Snapshot device representation */
 struct snap_device {
     char dev_name[DEV_NAME_LEN_MAX];
     bool enabled;                  /* true = snapshot active */
     bool mounted;                  /* true = scurrently mounted and snapshot in progress */
     struct timespec64 mount_time;  /* mount timestamp */
-    struct list_head list;         
+    dev_t bdev_dev;                /* block device the snapshotted fs is mounted on */
+    struct rhash_head name_node;   /* registry entry, keyed by dev_name */
+    struct rhash_head devt_node;   /* dev_t index, hashed only while mounted */
+    bool devt_hashed;              /* devt_node is in the dev_t index (spin_lock) */
+    bool unlisted;                 /* removed from the registry (lock) */
     struct kref ref;               
     struct mutex lock;
     spinlock_t spin_lock;             
-    unsigned long *saved_bitmap;   /* bitmap for saved blocks */
-    unsigned long num_blocks;      /* number of blocks in the device */
+    struct snap_bitmap *saved_bitmap; /* sparse bitmap of the saved blocks */
+    bool capture_probes;           /* holds the capture probes for its open snapshot (lock) */
+    u64 capture_missed;            /* their misses when the snapshot opened (lock) */
+    unsigned long bread_missed;    /* block read probe misses then, of its registration */
+    struct xarray deferred;        /* claimed blocks waiting to be read (deferred capture) */
+    u64 num_blocks;                /* number of blocks in the device */
     u64 block_size;                /* actual block size of the device (filesystem block size) */
     loff_t device_size;
     char snapshot_dir[DEV_NAME_LEN_MAX + 32]; /* folder name for current snapshot */
-    struct workqueue_struct *wq;
+    time64_t snapshot_time;        /* creation time of the open snapshot */
+    bool resumed;                  /* session mode: the open snapshot was resumed */
+    struct file *data_filp;        /* packed block log of the open snapshot */
+    struct file *meta_filp;        /* metadata index: header + (block number -> offset) records */
+    struct rw_semaphore store_sem; /* shared by the flushes, exclusive to open or close the store */
+    struct mutex store_lock;       /* space reservation and group commit state below */
+    loff_t data_tail;              /* next free offset in the block log (store_lock) */
+    loff_t data_prealloc;          /* end of the preallocated region of the block log (store_lock) */
+    loff_t index_tail;             /* next free offset in the metadata index (index turn) */
+    u64 store_seq;                 /* next batch to reserve space in the block log (store_lock) */
+    u64 index_seq;                 /* next batch allowed to append its index records */
+    wait_queue_head_t index_wait;  /* batches waiting for their index turn */
+    struct snap_wb_ctx wb;         /* mount and unmount jobs, run in order */
+    struct cpumask flush_cpus;     /* CPUs of the writeback of the device (cfg.flush_cpus) */
+    struct snap_pool blk_pool;     /* pending blocks with their block-sized buffer */
+    u64 pool_block_size;           /* block size blk_pool was sized for */
+    struct snap_shard *shards;     /* writeback shards, set up at mount (lock) */
+    unsigned int nr_shards;
+    unsigned int shards_gen;       /* snapshots closed, to tell stale drains apart (lock) */
+    bool shards_idle;              /* shards drained since the last one closed: may be resized (lock) */
+    atomic_t queue_depth;          /* blocks waiting in the capture queues of all shards */
+    atomic_long_t mem_bytes;       /* memory held by captured pre-images (cfg.mem_budget_kb) */
+    struct snap_wb_job spill_job;  /* moves queued pre-images to spill_filp, on wb */
+    atomic_t spill_force;          /* the shrinker asked to spill all that can be */
+    struct file *spill_filp;       /* overflow file of the open snapshot (spill job, store_sem) */
+    bool spill_named;              /* spill_filp is not a temporary file (spill job) */
+    loff_t spill_tail;             /* next free offset in spill_filp (spill job) */
+    atomic_t nr_spilled;           /* blocks in spill_filp not yet saved */
+    struct snap_dev_config cfg;    /* tunables, set through SNAP_CONFIG */
+    struct snap_qos qos;           /* priority, caps and cgroup of the snapshot I/O (cfg) */
+    u64 commit_since_ns;           /* oldest capture written but not yet committed, 0 if none (store_lock) */
+    unsigned long last_commit;     /* jiffies of the last group commit (store_lock) */
+    bool incomplete;               /* a captured block was dropped in this snapshot */
+    bool unordered;                /* ordered mode could not hold a write of this snapshot */
+    struct snap_dev_counters stats;
 };
 
 /* Work struct for workqueue cleanup */
 struct wq_cleanup_work {
     struct work_struct work;
     struct snap_device *dev;
+    unsigned int shards_gen;       /* dev->shards_gen when it was scheduled */
 };
 
 int add_or_enable_snap_device(const char *dev_name);
 int disable_snap_device(const char *dev_name);
 
 struct snap_device *snap_find_device_get(const char *dev_name);
+struct snap_device *snap_find_device_by_devt_get(dev_t devt);
 void snap_device_get(struct snap_device *dev);
 void snap_device_put(struct snap_device *dev);
 
-int snapdev_mark_mounted(struct snap_device *dev);
+int snapdev_mark_mounted(struct snap_device *dev, dev_t devt);
 int snapdev_do_mount_work(struct snap_device *dev);
 int snapdev_mark_unmounted(struct snap_device *dev);
 int snapdev_do_unmount_work(struct snap_device *dev);
 
-unsigned long *snapdev_get_saved_bitmap(struct snap_device *dev);
+struct snap_bitmap *snapdev_get_saved_bitmap(struct snap_device *dev);
 bool snapdev_is_mounted(struct snap_device *dev);
+int snapdev_get_stats(const char *dev_name, struct snap_dev_stats *out);
+int snapdev_config(const char *dev_name, struct snap_dev_config *cfg);
+
+/* Call 'fn' on every registered device, under RCU: 'fn' must not sleep */
+void snapdev_for_each_rcu(void (*fn)(struct snap_device *dev, void *arg), void *arg);
 
 int bdev_list_init(void);
 void bdev_list_exit(void);
@@ -0,0 +1,65 @@
+#ifndef _SNAP_BITMAP_H
+#define _SNAP_BITMAP_H
+
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/types.h>
+
+/* Blocks covered by one leaf of the saved bitmap: one page of bits */
+#define SNAP_BITMAP_LEAF_BITS   (PAGE_SIZE * BITS_PER_BYTE)
+
+/*
+ * Two-level sparse bitmap of the saved blocks. The top level is an
+ * array of pointers to leaf pages, allocated on the first bit set in
+ * their region, so memory follows the blocks actually written rather
+ * than the device size. A summary bit per leaf tells in O(1) that its
+ * whole region is saved; leaf_count[] keeps the bits set per leaf.
+ */
+struct snap_bitmap {
+    u64 nbits;
+    unsigned long nr_leaves;
+    unsigned long **leaves;     /* NULL until the first bit of the region is set */
+    atomic_t *leaf_count;       /* bits set in each leaf */
+    unsigned long *full;        /* summary: one bit per fully saved leaf */
+    atomic_t nr_alloc;          /* leaves allocated */
+};
+
+/* Allocate an empty bitmap of 'nbits' bits (may sleep) */
+struct snap_bitmap *snap_bitmap_alloc(u64 nbits);
+void snap_bitmap_free(struct snap_bitmap *bm);
+
+/*
+ * Atomically set a bit, allocating its leaf if needed (atomic context).
+ * Returns 1 if the bit was already set, 0 if it was just set, -ENOMEM
+ * if its leaf could not be allocated: the whole region of the leaf is
+ * then given up and reported as set from now on.
+ */
+int snap_bitmap_test_and_set(struct snap_bitmap *bm, u64 bit);
+void snap_bitmap_clear(struct snap_bitmap *bm, u64 bit);
+
+/* Lockless test, ordered after the setting of the bit */
+bool snap_bitmap_test(struct snap_bitmap *bm, u64 bit);
+
+/* Whether the whole region of the leaf holding 'bit' is set, in O(1) */
+static inline bool snap_bitmap_region_full(struct snap_bitmap *bm, u64 bit)
+{
+    return test_bit_acquire(div_u64(bit, SNAP_BITMAP_LEAF_BITS), bm->full);
+}
+
+/* Bits covered by leaf 'idx' (the last leaf may be partial) */
+static inline unsigned long snap_bitmap_leaf_bits(const struct snap_bitmap *bm, unsigned long idx)
+{
+    return min_t(u64, bm->nbits - (u64)idx * SNAP_BITMAP_LEAF_BITS, SNAP_BITMAP_LEAF_BITS);
+}
+
+/* Leaf 'idx', NULL if none of its bits was ever set */
+static inline unsigned long *snap_bitmap_leaf(struct snap_bitmap *bm, unsigned long idx)
+{
+    return smp_load_acquire(&bm->leaves[idx]);
+}
+
+/* Fill leaf 'idx' from a saved copy of PAGE_SIZE bytes (may sleep, not concurrent) */
+int snap_bitmap_load_leaf(struct snap_bitmap *bm, unsigned long idx, const void *src);
+
+#endif
@@ -9,6 +9,8 @@ int deactivate_snapshot(const char *dev_name, const char *password);
 int list_snapshots(struct snap_list_args *out_args);
 int restore_snapshot(const char *dev_name, const char *password, const char *timestamp);
 int set_snapshot_pw(const char *password);
+int get_snapshot_stats(struct snap_stats_args *args);
+int config_snapshot(struct snap_config_args *args);
 
 /* --- File operations --- */
 int snap_dev_open(struct inode *inode, struct file *file);
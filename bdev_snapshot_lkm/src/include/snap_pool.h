@@ -0,0 +1,45 @@
+#ifndef _SNAP_POOL_H
+#define _SNAP_POOL_H
+
+#include <linux/mempool.h>
+#include <linux/percpu.h>
+
+/* Objects kept in each per-CPU cache of a pool */
+#define SNAP_POOL_PCPU_CACHE   16
+/* Objects preloaded in each per-CPU cache when the pool is created */
+#define SNAP_POOL_PCPU_FILL    4
+/* Shared emergency reserve behind the per-CPU caches */
+#define SNAP_POOL_RESERVE      64
+
+/* Per-CPU cache of free objects */
+struct snap_pool_cache {
+    unsigned int nr;
+    void *objs[SNAP_POOL_PCPU_CACHE];
+};
+
+/*
+ * Pool of fixed-size objects usable from kprobe context. Allocation
+ * takes an object from the local CPU cache and only falls back to the
+ * mempool (GFP_ATOMIC slab allocation, then the reserve) when it is
+ * empty; frees refill the local cache first, with objects of the local
+ * NUMA node only, so that captures copy into node-local memory.
+ */
+struct snap_pool {
+    size_t obj_size;
+    struct snap_pool_cache __percpu *cache;
+    mempool_t *reserve;
+};
+
+int snap_pool_init(struct snap_pool *pool, size_t obj_size);
+void snap_pool_destroy(struct snap_pool *pool);
+
+/* Atomic context allowed; returns NULL once the pool is exhausted */
+void *snap_pool_alloc(struct snap_pool *pool);
+void snap_pool_free(struct snap_pool *pool, void *obj);
+
+static inline bool snap_pool_ready(const struct snap_pool *pool)
+{
+    return pool->reserve != NULL;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _SNAP_QOS_H
+#define _SNAP_QOS_H
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct cgroup_subsys_state;
+struct mem_cgroup;
+
+/* I/O a device may issue at once past its caps, in time of the caps */
+#define SNAP_QOS_BURST_NS  (100 * NSEC_PER_MSEC)
+
+/*
+ * Quality of service of the snapshot I/O of a device, saves and restores
+ * alike. The caps are enforced by a virtual clock (GCRA): each I/O moves
+ * 'tat' forward by its cost, the larger of its bytes over max_kbps and
+ * of one I/O over max_iops, and a new I/O waits while 'tat' is more than
+ * one burst ahead of the real time.
+ */
+struct snap_qos {
+    spinlock_t lock;
+    u16 ioprio;                 /* IOPRIO_PRIO_VALUE() of the I/O, 0 = the worker's own */
+    u32 max_kbps;               /* KiB/s, 0 = unlimited */
+    u32 max_iops;               /* 0 = unlimited */
+    u64 tat;                    /* when the I/O admitted so far is paid for (ns, lock) */
+    struct cgroup_subsys_state *blkcg_css; /* io controller charged, NULL = none (lock) */
+    struct mem_cgroup *memcg;   /* memory controller charged, NULL = none (lock) */
+};
+
+/* What snap_qos_enter() changed in the calling task, undone by snap_qos_exit() */
+struct snap_qos_scope {
+    int old_ioprio;
+    bool set_ioprio;
+    bool blkcg;
+    struct mem_cgroup *memcg;
+    struct mem_cgroup *old_memcg;
+};
+
+void snap_qos_init(struct snap_qos *qos);
+void snap_qos_release(struct snap_qos *qos);
+
+/* Change the priority and caps; a new cap starts from a full burst */
+void snap_qos_set_limits(struct snap_qos *qos, u16 ioprio, u32 max_kbps, u32 max_iops);
+
+/*
+ * Charge the I/O to the cgroup at 'path' of the unified hierarchy, "/"
+ * for none (may sleep)
+ */
+int snap_qos_set_cgroup(struct snap_qos *qos, const char *path);
+
+/*
+ * Issue the I/O of the calling task with the priority and cgroups of
+ * 'qos' until snap_qos_exit(). The io controller is only associated in
+ * kernel threads, such as the writeback workers; buffered writes are
+ * attributed through their pages, charged to the memory controller.
+ */
+void snap_qos_enter(struct snap_qos *qos, struct snap_qos_scope *scope);
+void snap_qos_exit(struct snap_qos_scope *scope);
+
+/* Time (ns) before the next I/O is within the caps, 0 if now */
+u64 snap_qos_delay(struct snap_qos *qos);
+
+/* Account I/O issued: 'bytes' in 'ios' calls */
+void snap_qos_charge(struct snap_qos *qos, size_t bytes, unsigned int ios);
+
+/* Wait until I/O is within the caps, then charge it; returns the time waited (ns, may sleep) */
+u64 snap_qos_throttle(struct snap_qos *qos, size_t bytes, unsigned int ios);
+
+#endif
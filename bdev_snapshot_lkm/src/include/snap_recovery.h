@@ -0,0 +1,35 @@
+#ifndef _SNAP_RECOVERY_H
+#define _SNAP_RECOVERY_H
+
+#include <linux/fs.h>
+#include <linux/workqueue.h>
+
+/* Largest single read issued while verifying an extent */
+#define SNAP_RECOVERY_IO_MAX   (1 << 20)
+
+/* Work item recovering one snapshot directory */
+struct snap_recovery_work {
+    struct work_struct work;
+    char dir_name[NAME_MAX + 1];
+};
+
+/* Context for the scan of SNAP_ROOT_DIR */
+struct snap_recovery_ctx {
+    struct dir_context ctx;
+    int queued;             /* directories handed over to recovery */
+};
+
+/**
+ * snap_recovery_start - Recover the snapshots left open by a crash
+ *
+ * Scans SNAP_ROOT_DIR asynchronously, with one work item per snapshot
+ * directory: module load does not wait for it.
+ *
+ * Return: 0 on success, negative error code if recovery cannot start.
+ */
+int snap_recovery_start(void);
+
+/* Wait for the recovery to complete and release its resources */
+void snap_recovery_exit(void);
+
+#endif
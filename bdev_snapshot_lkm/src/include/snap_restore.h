@@ -18,10 +18,10 @@ struct snap_list_ctx {
 struct snap_restore_tmp {
     u64 block_size;
     u64 num_blocks;
-    u64 *saved_blocks;
-    int num_saved_blocks;
+    u64 num_records;        /* number of extent records in the metadata index */
     u32 magic;
     u16 version;
+    u16 flags;
 };
 
 /**
@@ -37,7 +37,6 @@ int list_snapshots_for_device(const char *dev_name,
                               int *count);
 
 int snap_load_metadata(struct snap_restore_tmp *dev, const char *snap_dir);
-void snap_free_metadata(struct snap_restore_tmp *dev);
 
 /**
  * restore_snapshot_for_device - Restore a device from a snapshot
@@ -0,0 +1,42 @@
+#ifndef _SNAP_SPILL_H
+#define _SNAP_SPILL_H
+
+#include "bdev_list.h"
+
+struct snap_pending_block;
+
+/* Overflow file of the pre-images spilled out of memory, if O_TMPFILE is not supported */
+#define SNAP_SPILL_FILE   "spill.dat"
+
+/* Blocks written to the overflow file at once */
+#define SNAP_SPILL_BATCH  16
+
+/* What a capture over the memory budget does, see enum snap_overload */
+enum snap_mem_verdict {
+    SNAP_MEM_OK = 0,            /* within the budget, or spilling */
+    SNAP_MEM_HOLD,              /* hold the write until the pre-image is saved */
+    SNAP_MEM_DROP,              /* not captured, the snapshot is incomplete */
+};
+
+/*
+ * Charge the memory of one captured pre-image to the budget of its
+ * device and to the global one (atomic context). Nothing is charged
+ * on SNAP_MEM_DROP.
+ */
+enum snap_mem_verdict snap_mem_charge(struct snap_device *dev, size_t size);
+void snap_mem_uncharge(struct snap_device *dev, size_t size);
+
+/* Spill job of a device, on dev->wb: moves queued pre-images to the overflow file */
+void snap_spill_job_handler(struct snap_wb_job *job);
+
+/* Data of a spilled block, read back into 'buf' (shard->lock held) */
+int snap_spill_read(struct snap_device *dev, struct snap_pending_block *blk, void *buf);
+
+/* Close the overflow file with the store (dev->store_sem exclusive) */
+void snap_spill_close(struct snap_device *dev);
+
+/* Global memory shrinker, forcing spills under memory pressure */
+int snap_spill_init(void);
+void snap_spill_exit(void);
+
+#endif
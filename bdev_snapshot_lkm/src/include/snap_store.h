@@ -3,39 +3,144 @@
 
 #include "bdev_list.h"
 
+struct buffer_head;
+
 /* Magic/version info */
 #define SNAP_MAGIC    0x534E4150  /* "SNAP" in ASCII */
-#define SNAP_VERSION  1
+#define SNAP_VERSION  4
 
-/* Work structure for saving a single block */
-struct snap_block_work {
-    struct work_struct work;
-    struct snap_device *dev;
-    int block_num;
-    char *data;
-    size_t len;
+/* Packed snapshot data format */
+#define SNAP_META_FILE        "metadata.bin" /* header + one snap_extent_rec per saved extent */
+#define SNAP_DATA_FILE        "blocks.dat"   /* append-only log of saved blocks */
+#define SNAP_DATA_PREALLOC    (4 << 20)      /* block log preallocation step (bytes) */
+#define SNAP_BITMAP_FILE      "bitmap.bin"   /* session mode: saved blocks at the last unmount */
+#define SNAP_BITMAP_MAGIC     0x534E4254     /* "SNBT" in ASCII */
+
+/* Header flags */
+#define SNAP_META_OPEN        0x0001         /* snapshot still being written */
+#define SNAP_META_INCOMPLETE  0x0002         /* some captured blocks were dropped */
+#define SNAP_META_RECOVERED   0x0004         /* left open by a crash, closed at module load */
+#define SNAP_META_UNORDERED   0x0008         /* ordered mode let writes go before their pre-image was durable */
+
+/* Writeback shards of a device: ranges of 2^SNAP_SHARD_SPAN_SHIFT blocks, dealt round-robin */
+#define SNAP_SHARDS_MAX       16
+#define SNAP_SHARD_SPAN_SHIFT 10
+
+/* Seed of the crc32_le() of the data of an extent */
+#define SNAP_CRC_SEED         (~0U)
+
+/* On-disk fixed header of the metadata index */
+struct snap_meta_header {
+    __le32 magic;
+    __le16 version;
+    __le16 flags;
+    __le64 block_size;
+    __le64 num_blocks;
+    __le64 device_size;
+    __le64 timestamp;     /* mount time (seconds since the epoch) */
+    __le64 opened;        /* last (re)open of the snapshot, 0 = same as timestamp */
+    __le64 reserved[2];
+};
+
+/*
+ * On-disk header of SNAP_BITMAP_FILE, followed by nr_leaves allocated
+ * leaves of the saved bitmap, each as its __le64 leaf index and then
+ * leaf_size bytes of host-order longs. Only valid while the index and
+ * the block log still have the sizes it was written with.
+ */
+struct snap_bitmap_header {
+    __le32 magic;
+    __le32 long_size;     /* sizeof(long) of the writer */
+    __le32 leaf_size;     /* bytes per leaf (PAGE_SIZE of the writer) */
+    __le32 nr_leaves;     /* leaves stored */
+    __le64 num_blocks;
+    __le64 index_size;    /* size of SNAP_META_FILE when the bitmap was saved */
+    __le64 data_size;     /* size of SNAP_DATA_FILE when the bitmap was saved */
 };
 
+/*
+ * On-disk record locating a run of consecutive saved blocks inside the
+ * block log, where their data is stored contiguously
+ */
+struct snap_extent_rec {
+    __le64 start;       /* first block number on the device */
+    __le64 offset;      /* byte offset of the first block data in SNAP_DATA_FILE */
+    __le32 nr;          /* number of blocks (>= 1) */
+    __le32 crc;         /* crc32_le(SNAP_CRC_SEED, data of the nr blocks) */
+};
+
+/* Captured pre-image; allocated from dev->blk_pool with its data inline */
 struct snap_pending_block {
     struct snap_device *dev;
-    int block_num;
+    u64 block_num;
     size_t len;
     void *data;
-    struct snap_pending_block *next;
+    u64 captured_ns;            /* capture time, for the persistence latency */
+    struct buffer_head *held_bh;/* ordered mode or over budget: locked buffer, released once saved */
+    loff_t spill_pos;           /* data NULL: offset of the data in dev->spill_filp */
+    struct llist_node node;     /* chain of one write, then the capture queue of its shard */
 };
 
+/* Size the capture pools and writeback shards of a device at mount (may sleep) */
+int snap_capture_pools_setup(struct snap_device *dev);
+void snap_capture_pools_release(struct snap_device *dev);
+
+/* Wait until no flush of the shards of a device is queued or running (may sleep) */
+void snap_shards_drain(struct snap_device *dev);
+
 /* Atomically check and mark a block as saved */
 bool snap_try_mark_block_saved(struct snap_device *dev, u64 block);
 
-void snap_block_work_handler(struct work_struct *work);
+/* Lockless check whether a block has already been claimed */
+bool snap_block_is_saved(struct snap_device *dev, u64 block);
+
+/* Flusher of the capture queue of a shard (flush_job), and its latency timer (flush_work) */
+void snap_flush_job_handler(struct snap_wb_job *job);
+void snap_flush_work_handler(struct work_struct *work);
+
+/* Save everything queued so far (dev->lock held) */
+void snap_flush_capture_queue(struct snap_device *dev);
+
+/* Queue claimed pre-images of one device for saving, as one unit (atomic context) */
+void snap_queue_pending_blocks(struct snap_pending_block *blk);
+
+/* Open a file of the snapshot directory of a device */
+struct file *snap_open_store_file(struct snap_device *dev, const char *name, int flags);
+
+/* Default flusher configuration of a newly activated device */
+void snap_default_config(struct snap_dev_config *cfg);
 
-/* Returns list of snap_block_work ready to schedule, NULL if nothing */
+/*
+ * Finish a capture deferred until the block was read from disk, from a
+ * read known to be the first one since it was armed ('fresh')
+ */
+void snap_complete_deferred_capture(struct snap_device *dev, struct buffer_head *bh, bool fresh);
+
+/* Forget the armed captures of a closing snapshot, dropped if a read went unseen */
+void snap_release_deferred_captures(struct snap_device *dev, bool reads_missed);
+
+/*
+ * Capture every block touched by a write; returns the claimed blocks,
+ * NULL if nothing. '*claimed' tells whether the write claimed any block,
+ * including deferred captures.
+ */
 struct snap_pending_block *snap_prepare_singlefilefs_block_save(struct snap_device *dev,
                                                                 struct inode *inode,
-                                                                loff_t *off);
+                                                                loff_t *off,
+                                                                size_t len,
+                                                                bool *claimed);
+
+/* Account a latency sample in a SNAP_LAT_BUCKETS histogram */
+void snap_lat_record(atomic64_t *hist, u64 ns);
                               
 int open_snapshot(struct snap_device *dev);
 void close_snapshot(struct snap_device *dev);
 
+/* Session mode: persist the saved bitmap of the open snapshot (dev->lock, store exclusive) */
+int snap_save_session(struct snap_device *dev);
+
+/* Session mode: fill the saved bitmap of a resumed snapshot (dev->lock held) */
+int snap_load_saved_bitmap(struct snap_device *dev, struct snap_bitmap *bitmap);
+
 #endif
 
@@ -0,0 +1,79 @@
+#ifndef _SNAP_WB_H
+#define _SNAP_WB_H
+
+#include <linux/cpumask.h>
+#include <linux/list.h>
+#include <linux/numa.h>
+#include <linux/workqueue.h>
+
+struct snap_wb_job;
+
+typedef void (*snap_wb_fn_t)(struct snap_wb_job *job);
+
+/* Unit of work run by the writeback engine on behalf of one device or shard */
+struct snap_wb_job {
+    struct list_head node;      /* in snap_wb_ctx.jobs while pending */
+    snap_wb_fn_t fn;
+    bool pending;
+};
+
+/*
+ * Context of the writeback engine, one per device and one per shard of
+ * a device: its jobs run one at a time, in submission order, while
+ * different contexts run in parallel. A context with pending jobs waits on the
+ * shared run queue; each turn runs one job, then the context goes back
+ * to the tail of the queue, so that busy devices are served round-robin.
+ *
+ * Workers are bound to CPUs: a context only runs on the CPUs of its set,
+ * preferably on the NUMA node of the CPU that last submitted to it.
+ */
+struct snap_wb_ctx {
+    struct list_head jobs;      /* pending jobs, FIFO */
+    struct list_head run_node;  /* in the run queue while waiting for a worker */
+    const struct cpumask *cpus; /* CPUs its jobs may run on (contents: snap_wb_lock) */
+    int node;                   /* NUMA node of the last submitter */
+    bool scheduled;             /* queued or running */
+};
+
+static inline void snap_wb_ctx_init(struct snap_wb_ctx *ctx, const struct cpumask *cpus)
+{
+    INIT_LIST_HEAD(&ctx->jobs);
+    INIT_LIST_HEAD(&ctx->run_node);
+    ctx->cpus = cpus;
+    ctx->node = NUMA_NO_NODE;
+    ctx->scheduled = false;
+}
+
+static inline void snap_wb_job_init(struct snap_wb_job *job, snap_wb_fn_t fn)
+{
+    INIT_LIST_HEAD(&job->node);
+    job->fn = fn;
+    job->pending = false;
+}
+
+/*
+ * Queue a job on its context (any calling context). Returns false if the
+ * job was already pending.
+ */
+bool snap_wb_queue(struct snap_wb_ctx *ctx, struct snap_wb_job *job);
+
+/* Wait until a context has no job queued or running (may sleep) */
+void snap_wb_drain(struct snap_wb_ctx *ctx);
+
+/*
+ * Change a CPU set used by contexts; their queued jobs move to the new
+ * CPUs, a job already running completes where it is. A set with no
+ * online CPU lets the jobs run anywhere rather than never.
+ */
+void snap_wb_set_cpus(struct cpumask *cpus, const struct cpumask *new_cpus);
+
+/* Batches a flush job may write in one turn before yielding to other devices */
+unsigned int snap_wb_quantum(void);
+
+/* Workers of the engine, i.e. how many contexts may run at the same time */
+unsigned int snap_wb_workers(void);
+
+int snap_wb_init(void);
+void snap_wb_exit(void);
+
+#endif
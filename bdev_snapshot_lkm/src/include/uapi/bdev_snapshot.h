@@ -1,6 +1,8 @@
 #ifndef _BDEV_SNAPSHOT_H
 #define _BDEV_SNAPSHOT_H
 
+#include <linux/types.h>
+
 /* -------------------------------------------------------------------
  * Device file configuration
  * ------------------------------------------------------------------- */
@@ -17,6 +19,18 @@
 #define MAX_SNAPSHOTS      32    /* Maximum snapshots per device */
 #define SNAP_TIMESTAMP_MAX 20    /* Maximum length of timestamp string */
 
+#define SNAP_FLUSH_BATCH_MAX      256      /* Maximum blocks written per flusher batch */
+#define SNAP_FLUSH_LATENCY_MAX_US 1000000  /* Maximum flusher batching delay */
+#define SNAP_COMMIT_INTERVAL_MAX_MS 60000  /* Maximum group-commit interval */
+#define SNAP_CPULIST_MAX          128      /* Maximum length of a CPU list, with its NUL */
+#define SNAP_CGROUP_PATH_MAX      256      /* Maximum length of a cgroup path, with its NUL */
+
+/*
+ * Latency histograms: bucket 0 counts samples under 1 us, bucket i
+ * samples in [2^(i-1), 2^i) us, the last bucket everything above
+ */
+#define SNAP_LAT_BUCKETS   24
+
 #define MOD_NAME "bdev_snapshot"
 
 /* -------------------------------------------------------------------
@@ -65,6 +79,168 @@ struct pw_arg {
     char password[SNAP_PASSWORD_MAX];
 };
 
+/* Probes of the module, whose misses are reported in struct snap_dev_stats */
+enum snap_probe {
+    SNAP_PROBE_MOUNT = 0,       /* mount_bdev: a missed mount opens no snapshot */
+    SNAP_PROBE_UNMOUNT,         /* kill_block_super: a missed unmount leaves it open */
+    SNAP_PROBE_WRITE,           /* write capture (vfs_write, rw_verify_area): blocks may go unsaved */
+    SNAP_PROBE_WRITE_LAT,       /* vfs_write latency (fprobes only): a sample lost */
+    SNAP_PROBE_BREAD,           /* __bread_gfp: deferred captures may go unsaved */
+    SNAP_PROBE_MAX
+};
+
+/**
+ * struct snap_dev_stats - Counters of an activated device
+ * @capture_hits:      Pre-images copied straight from the buffer cache
+ * @capture_deferred:  Captures deferred because the block was not cached
+ * @deferred_done:     Deferred captures completed when the block was read
+ * @pool_exhausted:    Captures dropped, each marking the snapshot incomplete: no
+ *                     capture memory, a deferred capture whose block read failed
+ *                     or went unseen, or a batch that could not be saved
+ * @flush_batches:     Batches written by the flusher
+ * @flushed_blocks:    Blocks written by the flusher
+ * @flushed_extents:   Extents (runs of consecutive blocks) they were merged into
+ * @flushed_bytes:     Bytes of block data written by the flusher
+ * @flush_ns:          Time the flusher spent writing and syncing (ns)
+ * @syncs:             fdatasync calls issued on the snapshot store
+ * @sync_ns:           Time spent in those calls (ns)
+ * @persisted:         Units made persistent: batches, or group commits
+ * @persist_lat_ns:    Sum over units of capture-to-persistent latency of their oldest block (ns)
+ * @persist_lat_max_ns: Largest of those latencies (ns)
+ * @queue_depth:       Captured blocks currently waiting for the flusher
+ * @incomplete:        1 if the current snapshot misses dropped blocks
+ * @ordered_holds:     Ordered mode: original writes held until their pre-image was durable
+ * @ordered_misses:    Ordered mode: captures that could not hold the write (buffer busy);
+ *                     their pre-image is still saved, the snapshot is not incomplete
+ * @lat_first_write:   vfs_write latency of writes that claimed a block (first touch)
+ * @lat_steady_write:  vfs_write latency of the other writes to the device
+ * @lat_hold:          Ordered mode: time a write was held by its pre-image
+ * @bitmap_bytes:      Memory held by the leaves of the saved bitmap
+ * @throttled_ns:      Time saves and restores of the device waited for its I/O caps (ns)
+ * @mem_bytes:         Memory currently held by captured pre-images not yet saved
+ * @mem_overloads:     Captures that found the device or all devices over their memory budget
+ * @mem_holds:         Writes held until their pre-image was saved, over the memory budget
+ * @spilled_blocks:    Pre-images moved from memory to the overflow file
+ * @probe_missed:      Hits each probe missed since the module was loaded, for all
+ *                     devices (enum snap_probe). A write or block read miss sets
+ *                     @incomplete on every snapshot open at the time
+ */
+struct snap_dev_stats {
+    __u64 capture_hits;
+    __u64 capture_deferred;
+    __u64 deferred_done;
+    __u64 pool_exhausted;
+    __u64 flush_batches;
+    __u64 flushed_blocks;
+    __u64 flushed_extents;
+    __u64 flushed_bytes;
+    __u64 flush_ns;
+    __u64 syncs;
+    __u64 sync_ns;
+    __u64 persisted;
+    __u64 persist_lat_ns;
+    __u64 persist_lat_max_ns;
+    __u32 queue_depth;
+    __u32 incomplete;
+    __u64 ordered_holds;
+    __u64 ordered_misses;
+    __u64 lat_first_write[SNAP_LAT_BUCKETS];
+    __u64 lat_steady_write[SNAP_LAT_BUCKETS];
+    __u64 lat_hold[SNAP_LAT_BUCKETS];
+    __u64 bitmap_bytes;
+    __u64 throttled_ns;
+    __u64 mem_bytes;
+    __u64 mem_overloads;
+    __u64 mem_holds;
+    __u64 spilled_blocks;
+    __u64 probe_missed[SNAP_PROBE_MAX];
+};
+
+/**
+ * struct snap_stats_args - Used with SNAP_STATS
+ * @dev_name:  Input device name
+ * @stats:     Output counters
+ */
+struct snap_stats_args {
+    char dev_name[DEV_NAME_LEN_MAX];
+    struct snap_dev_stats stats;
+};
+
+/* Durability modes of the snapshot store */
+enum snap_durability {
+    SNAP_DURABILITY_NONE = 0,   /* left to normal writeback */
+    SNAP_DURABILITY_GROUP,      /* one fdatasync per batch, or per commit interval */
+    SNAP_DURABILITY_STRICT,     /* every batch: data synced before its index, then the index */
+    SNAP_DURABILITY_MAX
+};
+
+/* What a capture does when the captures held in memory exceed their budget */
+enum snap_overload {
+    SNAP_OVERLOAD_INCOMPLETE = 0,   /* drop it, the snapshot is marked incomplete */
+    SNAP_OVERLOAD_THROTTLE,         /* hold the write until the pre-image is saved */
+    SNAP_OVERLOAD_SPILL,            /* move queued pre-images to an overflow file */
+    SNAP_OVERLOAD_MAX
+};
+
+/* Value of a struct snap_dev_config field that keeps the current setting */
+#define SNAP_CFG_KEEP      0xffffffffU
+
+/**
+ * struct snap_dev_config - Tunables of an activated device
+ * @flush_batch:         Blocks written per flusher batch (1..SNAP_FLUSH_BATCH_MAX)
+ * @flush_latency_us:    Longest time a captured block waits for a batch to fill
+ * @durability:          One of enum snap_durability
+ * @commit_interval_ms:  Group commit period, 0 = commit every batch
+ * @ordered:             1 = ordered COW: the first write to a block waits until
+ *                       its pre-image is on stable storage
+ * @session:             1 = session mode: a remount resumes the last snapshot of
+ *                       the device, whose saved blocks are kept across unmounts
+ * @flush_cpus:          CPUs the writeback of the device may run on, as a CPU
+ *                       list ("0-3,8") or "all"
+ * @ioprio_class:        I/O priority class of saves and restores: 0 = that of
+ *                       the worker, 1 = realtime, 2 = best effort, 3 = idle
+ * @ioprio_level:        Level within the class, 0 (highest) to 7
+ * @max_kbps:            Bandwidth cap of saves and restores (KiB/s), 0 = none
+ * @max_iops:            I/O rate cap of saves and restores, 0 = none
+ * @cgroup:              Path of the cgroup (unified hierarchy) their I/O and
+ *                       page cache are charged to, "/" = none
+ * @overload:            One of enum snap_overload, applied over either the
+ *                       device or the global (capture_mem_mb) memory budget
+ * @mem_budget_kb:       Memory the captures of the device may hold (KiB),
+ *                       0 = only the global budget
+ *
+ * A field set to SNAP_CFG_KEEP, or an empty @flush_cpus or @cgroup, leaves
+ * the current value unchanged.
+ */
+struct snap_dev_config {
+    __u32 flush_batch;
+    __u32 flush_latency_us;
+    __u32 durability;
+    __u32 commit_interval_ms;
+    __u32 ordered;
+    __u32 session;
+    char flush_cpus[SNAP_CPULIST_MAX];
+    __u32 ioprio_class;
+    __u32 ioprio_level;
+    __u32 max_kbps;
+    __u32 max_iops;
+    char cgroup[SNAP_CGROUP_PATH_MAX];
+    __u32 overload;
+    __u32 mem_budget_kb;
+};
+
+/**
+ * struct snap_config_args - Used with SNAP_CONFIG
+ * @dev_name:  Device name
+ * @password:  Password to use the service
+ * @config:    Input new values, output resulting configuration
+ */
+struct snap_config_args {
+    char dev_name[DEV_NAME_LEN_MAX];
+    char password[SNAP_PASSWORD_MAX];
+    struct snap_dev_config config;
+};
+
 /* -------------------------------------------------------------------
  * IOCTL interface
  * ------------------------------------------------------------------- */
@@ -76,6 +252,8 @@ struct pw_arg {
 #define SNAP_DEACTIVATE   _IOW(SNAP_IOC_MAGIC, 3, struct snap_args)
 #define SNAP_RESTORE      _IOW(SNAP_IOC_MAGIC, 4, struct snap_restore_args)
 #define SNAP_SETPW        _IOW(SNAP_IOC_MAGIC, 5, struct pw_arg)
+#define SNAP_STATS        _IOW(SNAP_IOC_MAGIC, 6, struct snap_stats_args)
+#define SNAP_CONFIG       _IOW(SNAP_IOC_MAGIC, 7, struct snap_config_args)
 
 #endif
 
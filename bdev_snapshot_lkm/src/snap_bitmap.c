@@ -0,0 +1,163 @@
+#include <linux/bitmap.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+
+#include "snap_bitmap.h"
+
+/* -------------------------------------------------------------------
+ * Allocate the top level of a bitmap; leaves come on first touch
+ * ------------------------------------------------------------------- */
+struct snap_bitmap *snap_bitmap_alloc(u64 nbits)
+{
+    struct snap_bitmap *bm;
+
+    bm = kzalloc(sizeof(*bm), GFP_KERNEL);
+    if (!bm)
+        return NULL;
+
+    bm->nbits = nbits;
+    bm->nr_leaves = max_t(unsigned long, DIV_ROUND_UP_ULL(nbits, SNAP_BITMAP_LEAF_BITS), 1);
+    atomic_set(&bm->nr_alloc, 0);
+
+    bm->leaves = kvcalloc(bm->nr_leaves, sizeof(*bm->leaves), GFP_KERNEL);
+    bm->leaf_count = kvcalloc(bm->nr_leaves, sizeof(*bm->leaf_count), GFP_KERNEL);
+    bm->full = bitmap_zalloc(bm->nr_leaves, GFP_KERNEL);
+    if (!bm->leaves || !bm->leaf_count || !bm->full) {
+        snap_bitmap_free(bm);
+        return NULL;
+    }
+
+    return bm;
+}
+
+void snap_bitmap_free(struct snap_bitmap *bm)
+{
+    unsigned long idx;
+
+    if (!bm)
+        return;
+
+    if (bm->leaves) {
+        for (idx = 0; idx < bm->nr_leaves; idx++)
+            free_page((unsigned long)bm->leaves[idx]);
+        kvfree(bm->leaves);
+    }
+    kvfree(bm->leaf_count);
+    bitmap_free(bm->full);
+    kfree(bm);
+}
+
+/* -------------------------------------------------------------------
+ * Get the leaf 'idx', allocating it if needed. Concurrent first
+ * touches of a region race on the install: the first leaf wins.
+ * ------------------------------------------------------------------- */
+static unsigned long *snap_bitmap_get_leaf(struct snap_bitmap *bm, unsigned long idx, gfp_t gfp)
+{
+    unsigned long *leaf, *old;
+
+    leaf = snap_bitmap_leaf(bm, idx);
+    if (leaf)
+        return leaf;
+
+    leaf = (unsigned long *)get_zeroed_page(gfp);
+    if (!leaf)
+        return NULL;
+
+    old = cmpxchg(&bm->leaves[idx], NULL, leaf);
+    if (old) {
+        free_page((unsigned long)leaf);
+        return old;
+    }
+
+    atomic_inc(&bm->nr_alloc);
+    return leaf;
+}
+
+int snap_bitmap_test_and_set(struct snap_bitmap *bm, u64 bit)
+{
+    unsigned long *leaf;
+    unsigned long idx;
+    u32 off;
+
+    idx = div_u64_rem(bit, SNAP_BITMAP_LEAF_BITS, &off);
+
+    if (test_bit_acquire(idx, bm->full))
+        return 1;
+
+    leaf = snap_bitmap_get_leaf(bm, idx, GFP_ATOMIC | __GFP_NOWARN);
+    if (!leaf) {
+        /* Never claim the region again: a later copy could be modified data */
+        set_bit(idx, bm->full);
+        return -ENOMEM;
+    }
+
+    if (test_and_set_bit(off, leaf))
+        return 1;
+
+    if (atomic_inc_return(&bm->leaf_count[idx]) == snap_bitmap_leaf_bits(bm, idx))
+        set_bit(idx, bm->full);
+
+    return 0;
+}
+
+void snap_bitmap_clear(struct snap_bitmap *bm, u64 bit)
+{
+    unsigned long *leaf;
+    unsigned long idx;
+    u32 off;
+
+    idx = div_u64_rem(bit, SNAP_BITMAP_LEAF_BITS, &off);
+
+    leaf = snap_bitmap_leaf(bm, idx);
+    if (!leaf)
+        return; /* never set, or region given up */
+
+    if (test_and_clear_bit(off, leaf)) {
+        clear_bit(idx, bm->full);
+        atomic_dec(&bm->leaf_count[idx]);
+    }
+}
+
+bool snap_bitmap_test(struct snap_bitmap *bm, u64 bit)
+{
+    unsigned long *leaf;
+    unsigned long idx;
+    u32 off;
+
+    idx = div_u64_rem(bit, SNAP_BITMAP_LEAF_BITS, &off);
+
+    if (test_bit_acquire(idx, bm->full))
+        return true;
+
+    leaf = snap_bitmap_leaf(bm, idx);
+    return leaf && test_bit_acquire(off, leaf);
+}
+
+int snap_bitmap_load_leaf(struct snap_bitmap *bm, unsigned long idx, const void *src)
+{
+    unsigned long nbits, weight;
+    unsigned long *leaf;
+
+    if (idx >= bm->nr_leaves)
+        return -EINVAL;
+
+    leaf = snap_bitmap_get_leaf(bm, idx, GFP_KERNEL);
+    if (!leaf)
+        return -ENOMEM;
+
+    memcpy(leaf, src, PAGE_SIZE);
+
+    /* Bits past the end of the device are never set */
+    nbits = snap_bitmap_leaf_bits(bm, idx);
+    if (nbits < SNAP_BITMAP_LEAF_BITS)
+        bitmap_clear(leaf, nbits, SNAP_BITMAP_LEAF_BITS - nbits);
+
+    weight = bitmap_weight(leaf, nbits);
+    atomic_set(&bm->leaf_count[idx], weight);
+    if (weight == nbits)
+        set_bit(idx, bm->full);
+    else
+        clear_bit(idx, bm->full);
+
+    return 0;
+}
@@ -170,6 +170,59 @@ int set_snapshot_pw(const char *password)
     return ret;
 }
 
+int get_snapshot_stats(struct snap_stats_args *args)
+{
+    int ret;
+
+    if (!valid_dev_name(args->dev_name, DEV_NAME_LEN_MAX)) {
+        pr_err("%s: invalid device name\n", MOD_NAME);
+        return -EINVAL;
+    }
+
+    ret = snapdev_get_stats(args->dev_name, &args->stats);
+    if (ret == -ENOENT)
+        pr_info("%s: snapshot not active for device %s\n", MOD_NAME, args->dev_name);
+
+    return ret;
+}
+
+int config_snapshot(struct snap_config_args *args)
+{
+    int ret;
+    size_t pwlen;
+
+    ret = check_dev_and_pw(args->dev_name, args->password, &pwlen);
+    if (ret)
+        return ret;
+
+    if (!verify_snap_password(args->password, pwlen)) {
+        pr_warn("%s: authentication failed for configuration of device %s\n",
+                MOD_NAME, args->dev_name);
+        return -EACCES;
+    }
+
+    ret = snapdev_config(args->dev_name, &args->config);
+    if (ret == 0) {
+        pr_info("%s: device %s configured (flush_batch=%u, flush_latency_us=%u, "
+                "durability=%u, commit_interval_ms=%u, ordered=%u, session=%u, "
+                "flush_cpus=%s, ioprio=%u/%u, max_kbps=%u, max_iops=%u, cgroup=%s, "
+                "overload=%u, mem_budget_kb=%u)\n",
+                MOD_NAME, args->dev_name, args->config.flush_batch,
+                args->config.flush_latency_us, args->config.durability,
+                args->config.commit_interval_ms, args->config.ordered,
+                args->config.session, args->config.flush_cpus,
+                args->config.ioprio_class, args->config.ioprio_level,
+                args->config.max_kbps, args->config.max_iops, args->config.cgroup,
+                args->config.overload, args->config.mem_budget_kb);
+    } else if (ret == -ENOENT) {
+        pr_info("%s: snapshot not active for device %s\n", MOD_NAME, args->dev_name);
+    } else {
+        pr_err("%s: failed to configure device %s (err=%d)\n", MOD_NAME, args->dev_name, ret);
+    }
+
+    return ret;
+}
+
 /* --- File operations --- */
 int snap_dev_open(struct inode *inode, struct file *file)
 {
@@ -270,6 +323,49 @@ long snap_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
         kfree(pwarg);
         break;
     }
+    case SNAP_STATS: {
+        struct snap_stats_args *args;
+
+        ret = check_permission();
+        if (ret)
+            break;
+
+        args = memdup_user((const void __user *)arg, sizeof(*args));
+        if (IS_ERR(args))
+            return PTR_ERR(args);
+
+        ret = get_snapshot_stats(args);
+
+        if (ret == 0) {
+            if (copy_to_user((void __user *)arg, args, sizeof(*args)))
+                ret = -EFAULT;
+        }
+
+        kfree(args);
+        break;
+    }
+    case SNAP_CONFIG: {
+        struct snap_config_args *args;
+
+        ret = check_permission();
+        if (ret)
+            break;
+
+        args = memdup_user((const void __user *)arg, sizeof(*args));
+        if (IS_ERR(args))
+            return PTR_ERR(args);
+
+        ret = config_snapshot(args);
+
+        memzero_explicit(args->password, sizeof(args->password));
+        if (ret == 0) {
+            if (copy_to_user((void __user *)arg, args, sizeof(*args)))
+                ret = -EFAULT;
+        }
+
+        kfree(args);
+        break;
+    }
     default:
         pr_warn("%s: unknown ioctl command %u\n", MOD_NAME, cmd);
         break;
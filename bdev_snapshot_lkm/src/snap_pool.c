@@ -0,0 +1,109 @@
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "snap_pool.h"
+
+/* -------------------------------------------------------------------
+ * Create a pool of 'obj_size' objects: the shared reserve plus one
+ * partially filled cache per possible CPU (may sleep)
+ * ------------------------------------------------------------------- */
+int snap_pool_init(struct snap_pool *pool, size_t obj_size)
+{
+    struct snap_pool_cache *cache;
+    int cpu;
+
+    pool->obj_size = obj_size;
+
+    pool->cache = alloc_percpu(struct snap_pool_cache);
+    if (!pool->cache)
+        return -ENOMEM;
+
+    pool->reserve = mempool_create_kmalloc_pool(SNAP_POOL_RESERVE, obj_size);
+    if (!pool->reserve) {
+        free_percpu(pool->cache);
+        pool->cache = NULL;
+        return -ENOMEM;
+    }
+
+    /* Preload the caches with node-local objects, best effort */
+    for_each_possible_cpu(cpu) {
+        cache = per_cpu_ptr(pool->cache, cpu);
+        while (cache->nr < SNAP_POOL_PCPU_FILL) {
+            void *obj = kmalloc_node(obj_size, GFP_KERNEL, cpu_to_node(cpu));
+            if (!obj)
+                break;
+            cache->objs[cache->nr++] = obj;
+        }
+    }
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------
+ * Release a pool; every object must have been returned to it
+ * ------------------------------------------------------------------- */
+void snap_pool_destroy(struct snap_pool *pool)
+{
+    struct snap_pool_cache *cache;
+    int cpu;
+
+    if (pool->cache) {
+        for_each_possible_cpu(cpu) {
+            cache = per_cpu_ptr(pool->cache, cpu);
+            while (cache->nr)
+                kfree(cache->objs[--cache->nr]);
+        }
+        free_percpu(pool->cache);
+        pool->cache = NULL;
+    }
+
+    if (pool->reserve) {
+        mempool_destroy(pool->reserve);
+        pool->reserve = NULL;
+    }
+}
+
+void *snap_pool_alloc(struct snap_pool *pool)
+{
+    struct snap_pool_cache *cache;
+    unsigned long flags;
+    void *obj = NULL;
+
+    local_irq_save(flags);
+    cache = this_cpu_ptr(pool->cache);
+    if (cache->nr)
+        obj = cache->objs[--cache->nr];
+    local_irq_restore(flags);
+
+    if (obj)
+        return obj;
+
+    /* Slow path: slab first, then the reserve, never sleeping */
+    return mempool_alloc(pool->reserve, GFP_ATOMIC | __GFP_NOWARN);
+}
+
+void snap_pool_free(struct snap_pool *pool, void *obj)
+{
+    struct snap_pool_cache *cache;
+    unsigned long flags;
+
+    if (!obj)
+        return;
+
+    /*
+     * Objects freed by a flusher on another node go back to the slab of
+     * their own node: cached here, they would be handed to captures of
+     * this node as remote memory
+     */
+    local_irq_save(flags);
+    cache = this_cpu_ptr(pool->cache);
+    if (cache->nr < SNAP_POOL_PCPU_CACHE && page_to_nid(virt_to_page(obj)) == numa_node_id()) {
+        cache->objs[cache->nr++] = obj;
+        obj = NULL;
+    }
+    local_irq_restore(flags);
+
+    /* Cache full or remote object: refills the reserve, or goes back to the slab */
+    if (obj)
+        mempool_free(obj, pool->reserve);
+}
@@ -0,0 +1,188 @@
+#include <linux/cgroup.h>
+#include <linux/delay.h>
+#include <linux/iocontext.h>
+#include <linux/ioprio.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/memcontrol.h>
+#include <linux/sched/mm.h>
+#include <linux/string.h>
+
+#include "snap_qos.h"
+
+void snap_qos_init(struct snap_qos *qos)
+{
+    memset(qos, 0, sizeof(*qos));
+    spin_lock_init(&qos->lock);
+}
+
+/* Drop the cgroups charged so far, replaced by 'css' and 'memcg' */
+static void snap_qos_swap_cgroups(struct snap_qos *qos, struct cgroup_subsys_state *css,
+                                  struct mem_cgroup *memcg)
+{
+    struct cgroup_subsys_state *old_css;
+    struct mem_cgroup *old_memcg;
+
+    spin_lock(&qos->lock);
+    old_css = qos->blkcg_css;
+    old_memcg = qos->memcg;
+    qos->blkcg_css = css;
+    qos->memcg = memcg;
+    spin_unlock(&qos->lock);
+
+    if (old_css)
+        css_put(old_css);
+#ifdef CONFIG_MEMCG
+    if (old_memcg)
+        css_put(&old_memcg->css);
+#endif
+}
+
+void snap_qos_release(struct snap_qos *qos)
+{
+    snap_qos_swap_cgroups(qos, NULL, NULL);
+}
+
+void snap_qos_set_limits(struct snap_qos *qos, u16 ioprio, u32 max_kbps, u32 max_iops)
+{
+    spin_lock(&qos->lock);
+    WRITE_ONCE(qos->ioprio, ioprio);
+    if (max_kbps != qos->max_kbps || max_iops != qos->max_iops) {
+        WRITE_ONCE(qos->max_kbps, max_kbps);
+        WRITE_ONCE(qos->max_iops, max_iops);
+        /* No debt carried over from the old caps */
+        qos->tat = 0;
+    }
+    spin_unlock(&qos->lock);
+}
+
+int snap_qos_set_cgroup(struct snap_qos *qos, const char *path)
+{
+    struct cgroup_subsys_state *css = NULL;
+    struct mem_cgroup *memcg = NULL;
+    struct cgroup *cgrp;
+
+    if (path[0] != '/')
+        return -EINVAL;
+
+    if (strcmp(path, "/") != 0) {
+#if !defined(CONFIG_BLK_CGROUP) && !defined(CONFIG_MEMCG)
+        return -EOPNOTSUPP;
+#endif
+        cgrp = cgroup_get_from_path(path);
+        if (IS_ERR(cgrp))
+            return PTR_ERR(cgrp);
+
+        /* The nearest ancestors with each controller enabled */
+#ifdef CONFIG_BLK_CGROUP
+        css = cgroup_get_e_css(cgrp, &io_cgrp_subsys);
+#endif
+#ifdef CONFIG_MEMCG
+        memcg = mem_cgroup_from_css(cgroup_get_e_css(cgrp, &memory_cgrp_subsys));
+#endif
+        cgroup_put(cgrp);
+    }
+
+    snap_qos_swap_cgroups(qos, css, memcg);
+    return 0;
+}
+
+void snap_qos_enter(struct snap_qos *qos, struct snap_qos_scope *scope)
+{
+    struct cgroup_subsys_state *css;
+    u16 ioprio = READ_ONCE(qos->ioprio);
+
+    memset(scope, 0, sizeof(*scope));
+
+    if (ioprio) {
+        scope->old_ioprio = current->io_context ? current->io_context->ioprio : 0;
+        scope->set_ioprio = set_task_ioprio(current, ioprio) == 0;
+    }
+
+    spin_lock(&qos->lock);
+    css = qos->blkcg_css;
+    if (css)
+        css_get(css);
+#ifdef CONFIG_MEMCG
+    scope->memcg = qos->memcg;
+    if (scope->memcg)
+        css_get(&scope->memcg->css);
+#endif
+    spin_unlock(&qos->lock);
+
+#ifdef CONFIG_BLK_CGROUP
+    /* Takes its own reference; does nothing outside kernel threads */
+    if (css && (current->flags & PF_KTHREAD)) {
+        kthread_associate_blkcg(css);
+        scope->blkcg = true;
+    }
+#endif
+    if (css)
+        css_put(css);
+
+#ifdef CONFIG_MEMCG
+    if (scope->memcg)
+        scope->old_memcg = set_active_memcg(scope->memcg);
+#endif
+}
+
+void snap_qos_exit(struct snap_qos_scope *scope)
+{
+#ifdef CONFIG_MEMCG
+    if (scope->memcg) {
+        set_active_memcg(scope->old_memcg);
+        css_put(&scope->memcg->css);
+    }
+#endif
+#ifdef CONFIG_BLK_CGROUP
+    if (scope->blkcg)
+        kthread_associate_blkcg(NULL);
+#endif
+    if (scope->set_ioprio)
+        set_task_ioprio(current, scope->old_ioprio);
+}
+
+u64 snap_qos_delay(struct snap_qos *qos)
+{
+    u64 now, tat;
+
+    if (!READ_ONCE(qos->max_kbps) && !READ_ONCE(qos->max_iops))
+        return 0;
+
+    now = ktime_get_ns();
+    spin_lock(&qos->lock);
+    tat = qos->tat;
+    spin_unlock(&qos->lock);
+
+    return tat > now + SNAP_QOS_BURST_NS ? tat - now - SNAP_QOS_BURST_NS : 0;
+}
+
+void snap_qos_charge(struct snap_qos *qos, size_t bytes, unsigned int ios)
+{
+    u32 kbps = READ_ONCE(qos->max_kbps), iops = READ_ONCE(qos->max_iops);
+    u64 cost = 0, now;
+
+    if (kbps)
+        cost = div64_u64((u64)bytes * NSEC_PER_SEC, (u64)kbps << 10);
+    if (iops)
+        cost = max(cost, div_u64((u64)ios * NSEC_PER_SEC, iops));
+    if (!cost)
+        return;
+
+    now = ktime_get_ns();
+    spin_lock(&qos->lock);
+    /* Idle time only earns the burst back, see snap_qos_delay() */
+    qos->tat = max(qos->tat, now) + cost;
+    spin_unlock(&qos->lock);
+}
+
+u64 snap_qos_throttle(struct snap_qos *qos, size_t bytes, unsigned int ios)
+{
+    u64 delay = snap_qos_delay(qos);
+
+    if (delay)
+        fsleep(max_t(u64, div_u64(delay, NSEC_PER_USEC), 1));
+    snap_qos_charge(qos, bytes, ios);
+
+    return delay;
+}
@@ -0,0 +1,287 @@
+#include <linux/crc32.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+
+#include "snap_recovery.h"
+#include "snap_store.h"
+#include "uapi/bdev_snapshot.h"
+
+static struct workqueue_struct *recovery_wq;
+static struct work_struct scan_work;
+
+/* Snapshots opened at or after this time belong to the running module */
+static time64_t recovery_load_time;
+
+/* -------------------------------------------------------------------
+ * Open a file of a snapshot directory
+ * ------------------------------------------------------------------- */
+static struct file *snap_recovery_open(const char *dir_name, const char *name, int flags)
+{
+    struct file *filp;
+    char *path;
+
+    path = kmalloc(PATH_MAX, GFP_KERNEL);
+    if (!path)
+        return ERR_PTR(-ENOMEM);
+
+    scnprintf(path, PATH_MAX, "%s/%s/%s", SNAP_ROOT_DIR, dir_name, name);
+    filp = filp_open(path, flags | O_LARGEFILE, 0);
+    kfree(path);
+
+    return filp;
+}
+
+/* -------------------------------------------------------------------
+ * Check an extent record against the data actually present in the
+ * block log: bounds, position in the append order, and checksum
+ * ------------------------------------------------------------------- */
+static bool snap_extent_valid(struct file *data_filp, loff_t data_size,
+                              const struct snap_meta_header *hdr,
+                              const struct snap_extent_rec *rec,
+                              loff_t expected_off, void *buf)
+{
+    u64 block_size = le64_to_cpu(hdr->block_size);
+    u64 num_blocks = le64_to_cpu(hdr->num_blocks);
+    u64 start = le64_to_cpu(rec->start);
+    loff_t pos = le64_to_cpu(rec->offset);
+    u32 nr = le32_to_cpu(rec->nr);
+    u32 crc = SNAP_CRC_SEED;
+    u64 left;
+
+    if (nr == 0 || start >= num_blocks || nr > num_blocks - start)
+        return false;
+
+    /*
+     * The block log is appended in index order; a batch that failed to
+     * write its data leaves a hole, which no record points into
+     */
+    if (pos < expected_off)
+        return false;
+
+    left = (u64)nr * block_size;
+    if (left > data_size - pos)
+        return false;
+
+    while (left > 0) {
+        size_t len = min_t(u64, left, SNAP_RECOVERY_IO_MAX);
+
+        if (kernel_read(data_filp, buf, len, &pos) != len)
+            return false;
+
+        crc = crc32_le(crc, buf, len);
+        left -= len;
+    }
+
+    return crc == le32_to_cpu(rec->crc);
+}
+
+/* -------------------------------------------------------------------
+ * Recover one snapshot directory, if it was left open by a crash: keep
+ * the longest prefix of valid extent records, truncate the torn tail
+ * of both files and close the snapshot as recovered
+ * ------------------------------------------------------------------- */
+static int snap_recover_dir(const char *dir_name)
+{
+    struct snap_meta_header hdr;
+    struct snap_extent_rec *recs = NULL;
+    time64_t opened;
+    struct file *meta_filp, *data_filp = NULL;
+    loff_t meta_size, data_size = 0, data_end = 0;
+    loff_t pos = 0, idx_pos, keep;
+    u64 block_size, nr_recs, valid = 0;
+    void *buf = NULL;
+    u16 flags;
+    int ret = 0;
+    int i;
+
+    meta_filp = snap_recovery_open(dir_name, SNAP_META_FILE, O_RDWR);
+    if (IS_ERR(meta_filp))
+        return 0; /* not a snapshot directory */
+
+    meta_size = i_size_read(file_inode(meta_filp));
+    if (meta_size < (loff_t)sizeof(hdr) ||
+        kernel_read(meta_filp, &hdr, sizeof(hdr), &pos) != sizeof(hdr))
+        goto out_close;
+
+    flags = le16_to_cpu(hdr.flags);
+    if (le32_to_cpu(hdr.magic) != SNAP_MAGIC || le16_to_cpu(hdr.version) != SNAP_VERSION ||
+        !(flags & SNAP_META_OPEN))
+        goto out_close;
+
+    /* Opened by this module instance: a live snapshot, not a crashed one */
+    opened = le64_to_cpu(hdr.opened) ? le64_to_cpu(hdr.opened) : le64_to_cpu(hdr.timestamp);
+    if (opened >= recovery_load_time)
+        goto out_close;
+
+    block_size = le64_to_cpu(hdr.block_size);
+    if (block_size == 0 || block_size > PAGE_SIZE * 16) {
+        pr_warn("%s: cannot recover %s: invalid block size\n", MOD_NAME, dir_name);
+        ret = -EINVAL;
+        goto out_close;
+    }
+
+    data_filp = snap_recovery_open(dir_name, SNAP_DATA_FILE, O_RDWR);
+    if (IS_ERR(data_filp))
+        data_filp = NULL; /* crashed before any block was saved */
+    else
+        data_size = i_size_read(file_inode(data_filp));
+
+    recs = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    buf = kvmalloc(SNAP_RECOVERY_IO_MAX, GFP_KERNEL);
+    if (!recs || !buf) {
+        ret = -ENOMEM;
+        goto out_close;
+    }
+
+    /* Walk the whole records, stopping at the first one that does not check out */
+    nr_recs = (meta_size - sizeof(hdr)) / sizeof(*recs);
+    idx_pos = sizeof(hdr);
+    while (data_filp && valid < nr_recs) {
+        size_t want = min_t(u64, nr_recs - valid, PAGE_SIZE / sizeof(*recs)) * sizeof(*recs);
+        int nrecs;
+
+        if (kernel_read(meta_filp, recs, want, &idx_pos) != want)
+            break;
+
+        nrecs = want / sizeof(*recs);
+        for (i = 0; i < nrecs; i++) {
+            if (!snap_extent_valid(data_filp, data_size, &hdr, &recs[i], data_end, buf))
+                goto truncate;
+
+            data_end = le64_to_cpu(recs[i].offset) + (loff_t)le32_to_cpu(recs[i].nr) * block_size;
+            valid++;
+        }
+    }
+
+truncate:
+    keep = sizeof(hdr) + valid * sizeof(*recs);
+    if (meta_size > keep) {
+        ret = vfs_truncate(&meta_filp->f_path, keep);
+        if (ret)
+            goto out_fail;
+    }
+
+    /* Drops the preallocation and any data not covered by a valid record */
+    if (data_filp && data_size > data_end) {
+        ret = vfs_truncate(&data_filp->f_path, data_end);
+        if (ret)
+            goto out_fail;
+    }
+
+    flags &= ~SNAP_META_OPEN;
+    flags |= SNAP_META_RECOVERED;
+    if (valid < nr_recs)
+        flags |= SNAP_META_INCOMPLETE;
+    hdr.flags = cpu_to_le16(flags);
+
+    pos = 0;
+    if (kernel_write(meta_filp, &hdr, sizeof(hdr), &pos) != sizeof(hdr)) {
+        ret = -EIO;
+        goto out_fail;
+    }
+
+    if (data_filp)
+        vfs_fsync(data_filp, 0);
+    vfs_fsync(meta_filp, 0);
+
+    pr_info("%s: recovered snapshot %s: %llu extents kept, %llu dropped\n",
+            MOD_NAME, dir_name, valid, nr_recs - valid);
+    goto out_close;
+
+out_fail:
+    pr_err("%s: failed to recover snapshot %s (err=%d)\n", MOD_NAME, dir_name, ret);
+out_close:
+    kvfree(buf);
+    kfree(recs);
+    if (data_filp)
+        filp_close(data_filp, NULL);
+    filp_close(meta_filp, NULL);
+    return ret;
+}
+
+static void snap_recovery_work_handler(struct work_struct *work)
+{
+    struct snap_recovery_work *rw = container_of(work, struct snap_recovery_work, work);
+
+    snap_recover_dir(rw->dir_name);
+    kfree(rw);
+}
+
+/* -------------------------------------------------------------------
+ * Directory iteration callback: one recovery work per subdirectory
+ * ------------------------------------------------------------------- */
+static bool snap_recovery_filldir(struct dir_context *ctx,
+                                  const char *name, int namelen,
+                                  loff_t offset, u64 ino,
+                                  unsigned int d_type)
+{
+    struct snap_recovery_ctx *rctx = container_of(ctx, struct snap_recovery_ctx, ctx);
+    struct snap_recovery_work *rw;
+
+    if (d_type != DT_DIR && d_type != DT_UNKNOWN)
+        return true;
+
+    if (name[0] == '.' || namelen > NAME_MAX)
+        return true;
+
+    rw = kzalloc(sizeof(*rw), GFP_KERNEL);
+    if (!rw)
+        return false;
+
+    memcpy(rw->dir_name, name, namelen);
+    INIT_WORK(&rw->work, snap_recovery_work_handler);
+    queue_work(recovery_wq, &rw->work);
+
+    rctx->queued++;
+    return true;
+}
+
+static void snap_recovery_scan(struct work_struct *work)
+{
+    struct snap_recovery_ctx ctx = {
+        .ctx.actor = snap_recovery_filldir,
+        .ctx.pos = 0,
+        .queued = 0,
+    };
+    struct file *dir;
+    int ret;
+
+    dir = filp_open(SNAP_ROOT_DIR, O_RDONLY | O_DIRECTORY, 0);
+    if (IS_ERR(dir))
+        return; /* no snapshot taken yet */
+
+    ret = iterate_dir(dir, &ctx.ctx);
+    filp_close(dir, NULL);
+
+    if (ret)
+        pr_warn("%s: scan of %s for open snapshots failed (err=%d)\n",
+                MOD_NAME, SNAP_ROOT_DIR, ret);
+    else
+        pr_debug("%s: %d snapshot directories checked for recovery\n", MOD_NAME, ctx.queued);
+}
+
+int snap_recovery_start(void)
+{
+    recovery_load_time = ktime_get_real_seconds();
+
+    /* Unbound: the directories are checked in parallel */
+    recovery_wq = alloc_workqueue("snap_recovery_wq", WQ_UNBOUND, 0);
+    if (!recovery_wq)
+        return -ENOMEM;
+
+    INIT_WORK(&scan_work, snap_recovery_scan);
+    queue_work(recovery_wq, &scan_work);
+
+    return 0;
+}
+
+void snap_recovery_exit(void)
+{
+    if (recovery_wq) {
+        /* Drains the scan and every recovery it queued */
+        destroy_workqueue(recovery_wq);
+        recovery_wq = NULL;
+    }
+}
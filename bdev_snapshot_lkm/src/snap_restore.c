@@ -1,6 +1,7 @@
 #include <linux/blkdev.h>
 #include <linux/sort.h>
 
+#include "bdev_list.h"
 #include "snap_restore.h"
 #include "snap_store.h"
 #include "snap_utils.h"
@@ -79,14 +80,16 @@ int list_snapshots_for_device(const char *dev_name,
 }
 
 /* -------------------------------------------------------------------
- * Reads metadata.json and populates temporary restore struct
+ * Reads the header of the metadata index and populates the temporary
+ * restore struct
  * ------------------------------------------------------------------- */
 int snap_load_metadata(struct snap_restore_tmp *dev, const char *snap_dir)
 {
+    struct snap_meta_header hdr;
     struct file *filp = NULL;
     loff_t pos = 0;
     loff_t size;
-    char *buf = NULL;
+    char *path;
     int ret = 0;
 
     if (!dev || !snap_dir)
@@ -94,11 +97,11 @@ int snap_load_metadata(struct snap_restore_tmp *dev, const char *snap_dir)
 
     memset(dev, 0, sizeof(*dev));
 
-    char *path = kmalloc(PATH_MAX, GFP_KERNEL);
+    path = kmalloc(PATH_MAX, GFP_KERNEL);
     if (!path)
         return -ENOMEM;
 
-    snprintf(path, PATH_MAX, "%s/%s/metadata.json", SNAP_ROOT_DIR, snap_dir);
+    snprintf(path, PATH_MAX, "%s/%s/%s", SNAP_ROOT_DIR, snap_dir, SNAP_META_FILE);
 
     filp = filp_open(path, O_RDONLY, 0);
     kfree(path);
@@ -106,124 +109,110 @@ int snap_load_metadata(struct snap_restore_tmp *dev, const char *snap_dir)
         return PTR_ERR(filp);
 
     size = i_size_read(file_inode(filp));
-    if (size <= 0) {
+    if (size < (loff_t)sizeof(hdr)) {
         ret = -EINVAL;
         goto out_close;
     }
 
-    buf = kmalloc(size + 1, GFP_KERNEL);
-    if (!buf) {
-        ret = -ENOMEM;
-        goto out_close;
-    }
-
-    if (kernel_read(filp, buf, size, &pos) != size) {
+    if (kernel_read(filp, &hdr, sizeof(hdr), &pos) != sizeof(hdr)) {
         ret = -EIO;
-        goto out_free;
-    }
-    buf[size] = '\0';
-
-    /* Parsing fields */
-    char *p;
-
-    p = strnstr(buf, "\"magic\":", size);
-    if (!p || sscanf(p, "\"magic\": 0x%X", &dev->magic) != 1) {
-        ret = -EINVAL;
-        goto out_free;
-    }
-
-    p = strnstr(buf, "\"version\":", size);
-    if (!p || sscanf(p, "\"version\": %hu", &dev->version) != 1) {
-        ret = -EINVAL;
-        goto out_free;
+        goto out_close;
     }
 
-    p = strnstr(buf, "\"block_size\":", size);
-    if (!p || sscanf(p, "\"block_size\": %llu", (unsigned long long *)&dev->block_size) != 1) {
-        ret = -EINVAL;
-        goto out_free;
-    }
+    dev->magic = le32_to_cpu(hdr.magic);
+    dev->version = le16_to_cpu(hdr.version);
+    dev->flags = le16_to_cpu(hdr.flags);
+    dev->block_size = le64_to_cpu(hdr.block_size);
+    dev->num_blocks = le64_to_cpu(hdr.num_blocks);
 
-    p = strnstr(buf, "\"num_blocks\":", size);
-    if (!p || sscanf(p, "\"num_blocks\": %llu", (unsigned long long *)&dev->num_blocks) != 1) {
+    if (dev->block_size == 0 || dev->block_size > PAGE_SIZE * 16) {
         ret = -EINVAL;
-        goto out_free;
+        goto out_close;
     }
 
-    p = strnstr(buf, "\"open\":", size);
-    if (!p) {
-        ret = -EINVAL;
-        goto out_free;
-    }
-    int open_flag = 0;
-    if (sscanf(p, "\"open\": %d", &open_flag) != 1) {
-        ret = -EINVAL;
-        goto out_free;
-    }
-    if (open_flag == 1) {
+    if (dev->flags & SNAP_META_OPEN) {
         ret = -EBUSY;
-        goto out_free;
-    }
-
-    /* Parse blocks array */
-    p = strnstr(buf, "\"blocks\": [", size);
-    if (!p) {
-        dev->num_saved_blocks = 0;
-        goto out_free;
-    }
-    p += strlen("\"blocks\": [");
-
-    /* Count the blocks */
-    dev->num_saved_blocks = 0;
-    for (char *q = p; q && *q != ']'; q++)
-        if (*q == ',')
-            dev->num_saved_blocks++;
-    if (*p != ']')
-        dev->num_saved_blocks++;
-
-    if (dev->num_saved_blocks > 0) {
-        dev->saved_blocks = kmalloc_array(dev->num_saved_blocks, sizeof(u64), GFP_KERNEL);
-        if (!dev->saved_blocks) {
-            ret = -ENOMEM;
-            goto out_free;
-        }
-
-        int idx = 0;
-        u64 block;
-        char *blk_p = p;
-        while (blk_p && *blk_p != ']' && idx < dev->num_saved_blocks) {
-            if (sscanf(blk_p, " %llu", (unsigned long long *)&block) == 1) {
-                dev->saved_blocks[idx++] = block;
-            }
-            blk_p = strchr(blk_p, ',');
-            if (blk_p) blk_p++;
-            else break;
-        }
+        goto out_close;
     }
 
-    ret = 0;
+    /* A torn trailing record is ignored */
+    dev->num_records = (size - sizeof(hdr)) / sizeof(struct snap_extent_rec);
 
-out_free:
-    kfree(buf);
 out_close:
     filp_close(filp, NULL);
-    if (ret && dev->saved_blocks) {
-        kfree(dev->saved_blocks);
-        dev->saved_blocks = NULL;
-    }
     return ret;
 }
 
 /* -------------------------------------------------------------------
- * Frees the temporary restore struct's memory
+ * Opens a file of the snapshot store for reading
  * ------------------------------------------------------------------- */
-void snap_free_metadata(struct snap_restore_tmp *dev)
+static struct file *snap_open_snapshot_file(const char *snap_dir, const char *name)
 {
-    if (!dev)
-        return;
-    kfree(dev->saved_blocks);
-    dev->saved_blocks = NULL;
-    dev->num_saved_blocks = 0;
+    struct file *filp;
+    char *path;
+
+    path = kmalloc(PATH_MAX, GFP_KERNEL);
+    if (!path)
+        return ERR_PTR(-ENOMEM);
+
+    snprintf(path, PATH_MAX, "%s/%s/%s", SNAP_ROOT_DIR, snap_dir, name);
+    filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    kfree(path);
+
+    return filp;
+}
+
+/* Largest single read/write issued by the restore */
+#define SNAP_RESTORE_IO_MAX   (1 << 20)
+
+/* -------------------------------------------------------------------
+ * Copy one extent from the block log back to the device, in I/Os of at
+ * most 'chunk' blocks (a whole extent for the usual block sizes)
+ * ------------------------------------------------------------------- */
+static int snap_restore_extent(struct file *dev_file, struct file *data_file,
+                               const struct snap_restore_tmp *dev,
+                               const struct snap_extent_rec *rec,
+                               void *buf, u32 chunk, struct snap_device *snapdev)
+{
+    u64 start = le64_to_cpu(rec->start);
+    loff_t pos = le64_to_cpu(rec->offset);
+    u32 nr = le32_to_cpu(rec->nr);
+    loff_t dev_pos;
+    size_t len;
+
+    if (nr == 0 || start >= dev->num_blocks || nr > dev->num_blocks - start) {
+        pr_err("%s: invalid extent %llu+%u in metadata index\n", MOD_NAME, start, nr);
+        return -EINVAL;
+    }
+
+    dev_pos = start * dev->block_size;
+    while (nr > 0) {
+        u32 n = min(nr, chunk);
+
+        len = (size_t)n * dev->block_size;
+
+        /* Within the I/O caps of the device: one read, one write */
+        if (snapdev)
+            atomic64_add(snap_qos_throttle(&snapdev->qos, len, 2),
+                         &snapdev->stats.throttled_ns);
+
+        /* Read blocks */
+        if (kernel_read(data_file, buf, len, &pos) != len) {
+            pr_err("%s: failed to read blocks %llu+%u\n", MOD_NAME, start, n);
+            return -EIO;
+        }
+
+        /* Write on the device */
+        if (kernel_write(dev_file, buf, len, &dev_pos) != len) {
+            pr_err("%s: failed to write blocks %llu+%u to device\n", MOD_NAME, start, n);
+            return -EIO;
+        }
+
+        start += n;
+        nr -= n;
+    }
+
+    return 0;
 }
 
 /* -------------------------------------------------------------------
@@ -232,11 +221,18 @@ void snap_free_metadata(struct snap_restore_tmp *dev)
 static int restore_snapshot_for_device_file(const char *dev_name, const char *timestamp)
 {
     struct snap_restore_tmp dev = {0};
+    struct snap_device *snapdev = NULL;
+    struct snap_qos_scope scope;
     struct file *dev_file = NULL;
+    struct file *data_file = NULL;
+    struct file *index_file = NULL;  /* metadata index */
+    struct snap_extent_rec *recs = NULL;
     char *snap_dir = NULL;
     char *dev_sanitized = NULL;
-    char *block_path = NULL;
     void *buf = NULL;
+    loff_t idx_pos;
+    u64 left;
+    u32 chunk;
     int ret = 0;
     int i;
 
@@ -267,9 +263,20 @@ static int restore_snapshot_for_device_file(const char *dev_name, const char *ti
     if (dev.magic != SNAP_MAGIC || dev.version != SNAP_VERSION) {
         pr_err("%s: incompatible snapshot format (magic/version mismatch)\n", MOD_NAME);
         ret = -EINVAL;
-        goto out_free_metadata;
+        goto out_free_heap;
     }
 
+    if (dev.flags & SNAP_META_RECOVERED)
+        pr_info("%s: snapshot %s was recovered after a crash\n", MOD_NAME, snap_dir);
+
+    if (dev.flags & SNAP_META_INCOMPLETE)
+        pr_warn("%s: snapshot %s is incomplete, some blocks could not be preserved\n",
+                MOD_NAME, snap_dir);
+
+    if (dev.flags & SNAP_META_UNORDERED)
+        pr_info("%s: snapshot %s let some writes go before their pre-image was durable\n",
+                MOD_NAME, snap_dir);
+
     static DEFINE_MUTEX(device_mutex);
     mutex_lock(&device_mutex);
 
@@ -281,57 +288,82 @@ static int restore_snapshot_for_device_file(const char *dev_name, const char *ti
         goto out_unlock_metadata;
     }
 
-    block_path = kmalloc(PATH_MAX, GFP_KERNEL);
-    buf = kmalloc(dev.block_size, GFP_KERNEL);
-    if (!block_path || !buf) {
+    data_file = snap_open_snapshot_file(snap_dir, SNAP_DATA_FILE);
+    if (IS_ERR(data_file)) {
+        ret = PTR_ERR(data_file);
+        pr_err("%s: cannot open block log of %s (err=%d)\n", MOD_NAME, snap_dir, ret);
+        data_file = NULL;
+        goto out_close_dev;
+    }
+
+    index_file = snap_open_snapshot_file(snap_dir, SNAP_META_FILE);
+    if (IS_ERR(index_file)) {
+        ret = PTR_ERR(index_file);
+        pr_err("%s: cannot open metadata index of %s (err=%d)\n", MOD_NAME, snap_dir, ret);
+        index_file = NULL;
+        goto out_close_dev;
+    }
+
+    chunk = max_t(u32, 1, SNAP_RESTORE_IO_MAX / dev.block_size);
+    recs = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    buf = kvmalloc(chunk * dev.block_size, GFP_KERNEL);
+    if (!recs || !buf) {
         ret = -ENOMEM;
         goto out_close_dev;
     }
 
-    /* Loop through all blocks */
-    for (i = 0; i < dev.num_saved_blocks; i++) {
-        struct file *blk_file = NULL;
-        loff_t dev_pos;
-        loff_t pos = 0;
-        u64 block_num = dev.saved_blocks[i];
-        
-        snprintf(block_path, PATH_MAX, "%s/%s/block_%08llu",
-                 SNAP_ROOT_DIR, snap_dir, (unsigned long long)block_num);
-
-        blk_file = filp_open(block_path, O_RDONLY, 0);
-        if (IS_ERR(blk_file)) {
-            pr_err("%s: cannot open block file %s\n", MOD_NAME, block_path);
-            ret = PTR_ERR(blk_file);
+    /*
+     * A device still registered restores with the I/O priority, caps and
+     * cgroup of its saves
+     */
+    snapdev = snap_find_device_get(dev_name);
+    if (snapdev)
+        snap_qos_enter(&snapdev->qos, &scope);
+
+    /* Walk the records following the header, one page at a time */
+    idx_pos = sizeof(struct snap_meta_header);
+    left = dev.num_records;
+    while (left > 0) {
+        size_t want = min_t(u64, left, PAGE_SIZE / sizeof(*recs)) * sizeof(*recs);
+        ssize_t nread = kernel_read(index_file, recs, want, &idx_pos);
+        int nrecs;
+
+        if (nread < 0) {
+            ret = nread;
             goto out_close_dev;
         }
 
-        /* Read block */
-        if (kernel_read(blk_file, buf, dev.block_size, &pos) != dev.block_size) {
-            pr_err("%s: failed to read block %llu\n", MOD_NAME, block_num);
-            filp_close(blk_file, NULL);
-            ret = -EIO;
-            goto out_close_dev;
-        }
-        filp_close(blk_file, NULL);
+        nrecs = nread / sizeof(*recs);
+        if (nrecs == 0)
+            break;
 
-        /* Write on the device */
-        dev_pos = block_num * dev.block_size;
-        if (kernel_write(dev_file, buf, dev.block_size, &dev_pos) != dev.block_size) {
-            pr_err("%s: failed to write block %llu to device\n", MOD_NAME, block_num);
-            ret = -EIO;
-            goto out_close_dev;
+        /* Only consume whole records */
+        idx_pos -= nread - nrecs * sizeof(*recs);
+        left -= nrecs;
+
+        for (i = 0; i < nrecs; i++) {
+            ret = snap_restore_extent(dev_file, data_file, &dev, &recs[i], buf, chunk,
+                                      snapdev);
+            if (ret)
+                goto out_close_dev;
         }
     }
 
 out_close_dev:
+    if (snapdev) {
+        snap_qos_exit(&scope);
+        snap_device_put(snapdev);
+    }
+    if (index_file)
+        filp_close(index_file, NULL);
+    if (data_file)
+        filp_close(data_file, NULL);
     filp_close(dev_file, NULL);
 out_unlock_metadata:
     mutex_unlock(&device_mutex);
-out_free_metadata:
-    snap_free_metadata(&dev);
 out_free_heap:
-    kfree(buf);
-    kfree(block_path);
+    kvfree(buf);
+    kfree(recs);
     kfree(snap_dir);
     kfree(dev_sanitized);
 
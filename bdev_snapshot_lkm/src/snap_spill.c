@@ -0,0 +1,351 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+
+#include "snap_spill.h"
+#include "snap_store.h"
+
+static unsigned int capture_mem_mb;
+module_param(capture_mem_mb, uint, 0644);
+MODULE_PARM_DESC(capture_mem_mb, "Memory all devices may hold in pre-images not yet saved, in MiB (0 = 1/8 of RAM)");
+
+/* Captured pre-images held in memory by all the devices */
+static atomic_long_t snap_capture_mem = ATOMIC_LONG_INIT(0);
+
+static unsigned long snap_mem_limit(void)
+{
+    unsigned long mb = READ_ONCE(capture_mem_mb);
+
+    if (!mb)
+        return (totalram_pages() / 8) << PAGE_SHIFT;
+    return mb << 20;
+}
+
+static unsigned long snap_dev_mem_limit(struct snap_device *dev)
+{
+    return (unsigned long)READ_ONCE(dev->cfg.mem_budget_kb) << 10;
+}
+
+/* Whether a spill should go on: above half of either budget */
+static bool snap_mem_above_low(struct snap_device *dev)
+{
+    unsigned long dev_limit = snap_dev_mem_limit(dev);
+
+    return (dev_limit && atomic_long_read(&dev->mem_bytes) > dev_limit / 2) ||
+           atomic_long_read(&snap_capture_mem) > snap_mem_limit() / 2;
+}
+
+/* Queue the spill job of a device, keeping the device alive while it is pending */
+static void snap_spill_kick(struct snap_device *dev)
+{
+    snap_device_get(dev);
+    if (!snap_wb_queue(&dev->wb, &dev->spill_job))
+        snap_device_put(dev);
+}
+
+enum snap_mem_verdict snap_mem_charge(struct snap_device *dev, size_t size)
+{
+    unsigned long dev_limit = snap_dev_mem_limit(dev);
+    unsigned long limit = snap_mem_limit();
+    unsigned long dev_mem, all;
+
+    dev_mem = atomic_long_add_return(size, &dev->mem_bytes);
+    all = atomic_long_add_return(size, &snap_capture_mem);
+    if ((!dev_limit || dev_mem <= dev_limit) && all <= limit)
+        return SNAP_MEM_OK;
+
+    atomic64_inc(&dev->stats.mem_overloads);
+
+    switch (READ_ONCE(dev->cfg.overload)) {
+    case SNAP_OVERLOAD_SPILL:
+        snap_spill_kick(dev);
+        /* Twice over: the spill does not keep up, the writers wait meanwhile */
+        if ((dev_limit && dev_mem > 2 * dev_limit) || all > 2 * limit)
+            return SNAP_MEM_HOLD;
+        return SNAP_MEM_OK;
+    case SNAP_OVERLOAD_THROTTLE:
+        return SNAP_MEM_HOLD;
+    default:
+        snap_mem_uncharge(dev, size);
+        return SNAP_MEM_DROP;
+    }
+}
+
+void snap_mem_uncharge(struct snap_device *dev, size_t size)
+{
+    atomic_long_sub(size, &dev->mem_bytes);
+    atomic_long_sub(size, &snap_capture_mem);
+}
+
+/* -------------------------------------------------------------------
+ * Overflow file, opened at the first spill of a snapshot: unnamed when
+ * the file system of the store allows it, so that nothing is left
+ * behind. Only the spill job writes it, sequentially.
+ * ------------------------------------------------------------------- */
+static int snap_spill_open(struct snap_device *dev)
+{
+    struct file *filp;
+
+    filp = snap_open_store_file(dev, ".", O_TMPFILE | O_RDWR);
+    if (IS_ERR(filp)) {
+        filp = snap_open_store_file(dev, SNAP_SPILL_FILE, O_CREAT | O_RDWR | O_TRUNC);
+        if (IS_ERR(filp))
+            return PTR_ERR(filp);
+        dev->spill_named = true;
+    }
+
+    dev->spill_filp = filp;
+    dev->spill_tail = 0;
+    return 0;
+}
+
+void snap_spill_close(struct snap_device *dev)
+{
+    if (!dev->spill_filp)
+        return;
+
+    if (dev->spill_named)
+        vfs_truncate(&dev->spill_filp->f_path, 0);
+    filp_close(dev->spill_filp, NULL);
+    dev->spill_filp = NULL;
+    dev->spill_named = false;
+    dev->spill_tail = 0;
+}
+
+int snap_spill_read(struct snap_device *dev, struct snap_pending_block *blk, void *buf)
+{
+    loff_t pos = blk->spill_pos;
+
+    if (!dev->spill_filp)
+        return -EBADF;
+
+    if (kernel_read(dev->spill_filp, buf, blk->len, &pos) != blk->len) {
+        pr_warn_ratelimited("%s: cannot read back spilled block %llu of %s\n",
+                            MOD_NAME, blk->block_num, dev->dev_name);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------
+ * Write 'nr' queued blocks, reached through 'links', to the overflow
+ * file and replace each of them in the queue by a descriptor without
+ * its data. '*next' is kept valid if it points into a replaced block.
+ * ------------------------------------------------------------------- */
+static int snap_spill_blocks(struct snap_device *dev, struct llist_node ***links,
+                             unsigned int nr, struct llist_node ***next)
+{
+    struct snap_pending_block *old, *desc[SNAP_SPILL_BATCH];
+    struct kvec vec[SNAP_SPILL_BATCH];
+    struct iov_iter iter;
+    size_t total = 0;
+    loff_t pos = dev->spill_tail;
+    ssize_t written;
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        old = llist_entry(*links[i], struct snap_pending_block, node);
+        vec[i].iov_base = old->data;
+        vec[i].iov_len = old->len;
+        total += old->len;
+
+        desc[i] = kmalloc(sizeof(*desc[i]), GFP_KERNEL);
+        if (!desc[i]) {
+            while (i--)
+                kfree(desc[i]);
+            return -ENOMEM;
+        }
+    }
+
+    iov_iter_kvec(&iter, ITER_SOURCE, vec, nr, total);
+    written = vfs_iter_write(dev->spill_filp, &iter, &pos, 0);
+    if (written != total) {
+        for (i = 0; i < nr; i++)
+            kfree(desc[i]);
+        return written < 0 ? written : -EIO;
+    }
+
+    /* Snapshot I/O, but never held back: it relieves memory pressure */
+    snap_qos_charge(&dev->qos, total, 1);
+
+    /*
+     * Backwards: a link may be the next field of the previous block,
+     * which must still be in place when that link is rewritten
+     */
+    pos = dev->spill_tail + total;
+    for (i = nr; i-- > 0;) {
+        old = llist_entry(*links[i], struct snap_pending_block, node);
+        pos -= old->len;
+
+        *desc[i] = *old;
+        desc[i]->data = NULL;
+        desc[i]->spill_pos = pos;
+        *links[i] = &desc[i]->node;
+        if (*next == &old->node.next)
+            *next = &desc[i]->node.next;
+
+        snap_pool_free(&dev->blk_pool, old);
+        snap_mem_uncharge(dev, dev->blk_pool.obj_size);
+    }
+
+    dev->spill_tail += total;
+    atomic_add(nr, &dev->nr_spilled);
+    atomic64_add(nr, &dev->stats.spilled_blocks);
+    return 0;
+}
+
+/* -------------------------------------------------------------------
+ * Spill the queued pre-images of a shard, but for the next batch, soon
+ * written anyway, and the held ones, whose writers wait for their save
+ * (shard->lock held)
+ * ------------------------------------------------------------------- */
+static int snap_spill_shard(struct snap_shard *shard, bool force)
+{
+    struct snap_device *dev = shard->dev;
+    struct llist_node **links[SNAP_SPILL_BATCH], **link, *queued;
+    struct snap_pending_block *blk;
+    unsigned int nr, skip;
+    int ret;
+
+    /* Everything queued goes to the backlog, oldest first */
+    queued = llist_reverse_order(llist_del_all(&shard->capture_q));
+    for (link = &shard->flush_backlog; *link; link = &(*link)->next)
+        ;
+    *link = queued;
+
+    skip = READ_ONCE(dev->cfg.flush_batch);
+    link = &shard->flush_backlog;
+    while (*link && (force || snap_mem_above_low(dev))) {
+        for (nr = 0; *link && nr < SNAP_SPILL_BATCH; link = &(*link)->next) {
+            blk = llist_entry(*link, struct snap_pending_block, node);
+            if (skip) {
+                skip--;
+                continue;
+            }
+            if (blk->data && !blk->held_bh)
+                links[nr++] = link;
+        }
+        if (!nr)
+            break;
+
+        ret = snap_spill_blocks(dev, links, nr, &link);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------
+ * Spill job: runs when a capture finds the device or all the devices
+ * over their memory budget, until both are back under half of it, or
+ * moves everything it can when the shrinker asks for it.
+ * ------------------------------------------------------------------- */
+void snap_spill_job_handler(struct snap_wb_job *job)
+{
+    struct snap_device *dev = container_of(job, struct snap_device, spill_job);
+    bool force = atomic_xchg(&dev->spill_force, 0);
+    unsigned int i;
+    int ret = 0;
+
+    down_read(&dev->store_sem);
+    if (!dev->data_filp || READ_ONCE(dev->cfg.overload) != SNAP_OVERLOAD_SPILL)
+        goto out;
+
+    if (!dev->spill_filp) {
+        ret = snap_spill_open(dev);
+        if (ret < 0)
+            goto out;
+    } else if (!atomic_read(&dev->nr_spilled)) {
+        /* Everything spilled was saved: start over */
+        dev->spill_tail = 0;
+    }
+
+    for (i = 0; i < dev->nr_shards && ret == 0; i++) {
+        if (!force && !snap_mem_above_low(dev))
+            break;
+
+        mutex_lock(&dev->shards[i].lock);
+        ret = snap_spill_shard(&dev->shards[i], force);
+        mutex_unlock(&dev->shards[i].lock);
+    }
+
+out:
+    up_read(&dev->store_sem);
+    if (ret < 0)
+        pr_warn_ratelimited("%s: cannot spill the captures of %s (err=%d)\n",
+                            MOD_NAME, dev->dev_name, ret);
+
+    /* Reference taken when the job was queued */
+    snap_device_put(dev);
+}
+
+/* -------------------------------------------------------------------
+ * Shrinker: the spills run on the writeback engine, so a scan only
+ * queues them, on every device whose overload policy allows it
+ * ------------------------------------------------------------------- */
+static void snap_spill_force(struct snap_device *dev, void *arg)
+{
+    if (READ_ONCE(dev->cfg.overload) != SNAP_OVERLOAD_SPILL ||
+        !atomic_long_read(&dev->mem_bytes))
+        return;
+
+    atomic_set(&dev->spill_force, 1);
+    snap_spill_kick(dev);
+}
+
+static unsigned long snap_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    unsigned long pages = atomic_long_read(&snap_capture_mem) >> PAGE_SHIFT;
+
+    return pages ? pages : SHRINK_EMPTY;
+}
+
+static unsigned long snap_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    snapdev_for_each_rcu(snap_spill_force, NULL);
+    return SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *snap_shrinker;
+
+int snap_spill_init(void)
+{
+    snap_shrinker = shrinker_alloc(0, "%s-capture", MOD_NAME);
+    if (!snap_shrinker)
+        return -ENOMEM;
+
+    snap_shrinker->count_objects = snap_shrink_count;
+    snap_shrinker->scan_objects = snap_shrink_scan;
+    snap_shrinker->seeks = DEFAULT_SEEKS;
+    shrinker_register(snap_shrinker);
+    return 0;
+}
+
+void snap_spill_exit(void)
+{
+    shrinker_free(snap_shrinker);
+    snap_shrinker = NULL;
+}
+#else
+static struct shrinker snap_shrinker = {
+    .count_objects = snap_shrink_count,
+    .scan_objects = snap_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+int snap_spill_init(void)
+{
+    return register_shrinker(&snap_shrinker, "%s-capture", MOD_NAME);
+}
+
+void snap_spill_exit(void)
+{
+    unregister_shrinker(&snap_shrinker);
+}
+#endif
@@ -1,335 +1,1266 @@
 #include <linux/buffer_head.h>
+#include <linux/crc32.h>
+#include <linux/delay.h>
+#include <linux/falloc.h>
+#include <linux/moduleparam.h>
+#include <linux/sort.h>
+#include <linux/uio.h>
 
 #include "bdev_fs.h"
+#include "snap_restore.h"
+#include "snap_spill.h"
 #include "snap_store.h"
 #include "snap_utils.h"
 #include "uapi/bdev_snapshot.h"
 
-static int snap_save_block_to_file(struct snap_device *dev, u64 block_num, void *data, size_t len)
+/* Flusher defaults of newly activated devices, see SNAP_CONFIG */
+static unsigned int flush_batch = 64;
+module_param(flush_batch, uint, 0644);
+MODULE_PARM_DESC(flush_batch, "Default number of blocks written per flusher batch");
+
+static unsigned int flush_latency_us = 1000;
+module_param(flush_latency_us, uint, 0644);
+MODULE_PARM_DESC(flush_latency_us, "Default time (us) a captured block may wait for its batch");
+
+static unsigned int durability = SNAP_DURABILITY_NONE;
+module_param(durability, uint, 0644);
+MODULE_PARM_DESC(durability, "Default durability mode: 0 = none, 1 = group commit, 2 = strict");
+
+static bool session;
+module_param(session, bool, 0644);
+MODULE_PARM_DESC(session, "Default session mode: remounts resume the last snapshot of the device");
+
+static unsigned int overload = SNAP_OVERLOAD_INCOMPLETE;
+module_param(overload, uint, 0644);
+MODULE_PARM_DESC(overload, "Default policy over the memory budget: 0 = drop (incomplete), 1 = throttle, 2 = spill");
+
+static unsigned int wb_shards;
+module_param(wb_shards, uint, 0644);
+MODULE_PARM_DESC(wb_shards, "Writeback shards per device, applied at mount (0 = one per writeback worker)");
+
+void snap_default_config(struct snap_dev_config *cfg)
 {
-    char *path;
-    struct file *filp;
-    loff_t pos = 0;
+    cfg->flush_batch = clamp_t(unsigned int, READ_ONCE(flush_batch), 1, SNAP_FLUSH_BATCH_MAX);
+    cfg->flush_latency_us = min_t(unsigned int, READ_ONCE(flush_latency_us),
+                                  SNAP_FLUSH_LATENCY_MAX_US);
+    cfg->durability = READ_ONCE(durability);
+    if (cfg->durability >= SNAP_DURABILITY_MAX)
+        cfg->durability = SNAP_DURABILITY_NONE;
+    cfg->commit_interval_ms = 0;
+    cfg->ordered = 0;
+    cfg->session = READ_ONCE(session);
+    strscpy(cfg->flush_cpus, "all", sizeof(cfg->flush_cpus));
+    cfg->ioprio_class = 0;
+    cfg->ioprio_level = 0;
+    cfg->max_kbps = 0;
+    cfg->max_iops = 0;
+    strscpy(cfg->cgroup, "/", sizeof(cfg->cgroup));
+    cfg->overload = READ_ONCE(overload);
+    if (cfg->overload >= SNAP_OVERLOAD_MAX)
+        cfg->overload = SNAP_OVERLOAD_INCOMPLETE;
+    cfg->mem_budget_kb = 0;
+}
+
+void snap_lat_record(atomic64_t *hist, u64 ns)
+{
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+    unsigned int b = us ? min_t(unsigned int, ilog2(us) + 1, SNAP_LAT_BUCKETS - 1) : 0;
+
+    atomic64_inc(&hist[b]);
+}
+
+/* -------------------------------------------------------------------
+ * fdatasync a range of a snapshot store file, accounting its cost
+ * ------------------------------------------------------------------- */
+static int snap_sync_file(struct snap_device *dev, struct file *filp, loff_t start, loff_t end)
+{
+    u64 t0 = ktime_get_ns();
     int ret;
 
-    if (!dev || !data)
-        return -EINVAL;
+    ret = vfs_fsync_range(filp, start, end, 1);
+
+    atomic64_inc(&dev->stats.syncs);
+    atomic64_add(ktime_get_ns() - t0, &dev->stats.sync_ns);
+
+    if (ret < 0)
+        pr_warn_ratelimited("%s: fdatasync of the snapshot store of %s failed (err=%d)\n",
+                            MOD_NAME, dev->dev_name, ret);
+    return ret;
+}
+
+/* Account a unit of captures made persistent, 'since_ns' being its oldest capture */
+static void snap_account_persisted(struct snap_device *dev, u64 since_ns)
+{
+    u64 lat = ktime_get_ns() - since_ns;
+
+    s64 max = atomic64_read(&dev->stats.persist_lat_max_ns);
+
+    atomic64_inc(&dev->stats.persisted);
+    atomic64_add(lat, &dev->stats.persist_lat_ns);
+
+    /* The shards of the device race on the maximum */
+    while ((s64)lat > max && !atomic64_try_cmpxchg(&dev->stats.persist_lat_max_ns, &max, lat))
+        ;
+}
+
+/* -------------------------------------------------------------------
+ * Grow the preallocated region of the block log so that it can hold
+ * at least 'end' bytes (caller holds dev->store_lock, or the store
+ * exclusively)
+ * ------------------------------------------------------------------- */
+static int snap_prealloc_data(struct snap_device *dev, loff_t end)
+{
+    loff_t len;
+    int ret;
+
+    if (end <= dev->data_prealloc)
+        return 0;
+
+    len = round_up(end - dev->data_prealloc, SNAP_DATA_PREALLOC);
+
+    ret = vfs_fallocate(dev->data_filp, FALLOC_FL_KEEP_SIZE, dev->data_prealloc, len);
+    if (ret == -EOPNOTSUPP) {
+        /* Not fatal: the log simply grows on write */
+        dev->data_prealloc = end;
+        return 0;
+    }
+    if (ret < 0)
+        return ret;
+
+    dev->data_prealloc += len;
+    return 0;
+}
+
+/* -------------------------------------------------------------------
+ * Open one of the files of the snapshot store
+ * ------------------------------------------------------------------- */
+struct file *snap_open_store_file(struct snap_device *dev, const char *name, int flags)
+{
+    struct file *filp;
+    char *path;
 
     path = kmalloc(PATH_MAX, GFP_KERNEL);
     if (!path)
-        return -ENOMEM;
+        return ERR_PTR(-ENOMEM);
 
-    scnprintf(path, PATH_MAX, "%s/%s/block_%08llu",
-              SNAP_ROOT_DIR, dev->snapshot_dir, (unsigned long long)block_num);
+    scnprintf(path, PATH_MAX, "%s/%s/%s", SNAP_ROOT_DIR, dev->snapshot_dir, name);
+    filp = filp_open(path, flags | O_LARGEFILE, 0600);
+    kfree(path);
 
-    filp = filp_open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
-    if (IS_ERR(filp)) {       
-        ret = PTR_ERR(filp);
-        goto out_free;
+    return filp;
+}
+
+/* Batches are synced before their index, and the index after them */
+static bool snap_store_strict(struct snap_device *dev)
+{
+    return READ_ONCE(dev->cfg.durability) == SNAP_DURABILITY_STRICT ||
+           READ_ONCE(dev->cfg.ordered);
+}
+
+static int snap_cmp_pending_block(const void *a, const void *b)
+{
+    const struct snap_pending_block *x = *(const struct snap_pending_block * const *)a;
+    const struct snap_pending_block *y = *(const struct snap_pending_block * const *)b;
+
+    return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+}
+
+/* -------------------------------------------------------------------
+ * Append the records of batch 'seq' to the metadata index once every
+ * earlier batch has appended its own, then hand the turn over. A batch
+ * whose data could not be written passes with no record: its space
+ * stays a hole in the block log that nothing points into.
+ * ------------------------------------------------------------------- */
+static int snap_append_index(struct snap_shard *shard, u64 seq, unsigned int nr_ext, bool strict)
+{
+    struct snap_device *dev = shard->dev;
+    size_t len = nr_ext * sizeof(struct snap_extent_rec);
+    loff_t idx_pos, start;
+    ssize_t written = 0;
+    int ret = 0;
+
+    wait_event(dev->index_wait, smp_load_acquire(&dev->index_seq) == seq);
+
+    start = idx_pos = dev->index_tail;
+    if (len) {
+        written = kernel_write(dev->meta_filp, shard->flush_recs, len, &idx_pos);
+        /* Commit: the slots are only reused if the records could not be written */
+        if (written == len)
+            dev->index_tail = idx_pos;
+    }
+
+    smp_store_release(&dev->index_seq, seq + 1);
+    wake_up_all(&dev->index_wait);
+
+    if (written != len) {
+        pr_warn("%s: failed to index %u extents\n", MOD_NAME, nr_ext);
+        return written < 0 ? written : -EIO;
     }
 
-    ret = kernel_write(filp, data, len, &pos);
+    if (len && strict) {
+        ret = snap_sync_file(dev, dev->meta_filp, start, idx_pos - 1);
+        if (ret < 0) {
+            /* The blocks are in the store, just not known to be durable */
+            WRITE_ONCE(dev->incomplete, true);
+        }
+    }
+
+    return 0;
+}
+
+/* Bounce buffer of a flusher batch for the data of spilled blocks (shard->lock held) */
+static void *snap_shard_spill_buf(struct snap_shard *shard)
+{
+    size_t size = SNAP_FLUSH_BATCH_MAX * shard->dev->pool_block_size;
+
+    if (shard->spill_buf_size < size) {
+        kvfree(shard->spill_buf);
+        shard->spill_buf = kvmalloc(size, GFP_KERNEL);
+        shard->spill_buf_size = shard->spill_buf ? size : 0;
+    }
+    return shard->spill_buf;
+}
+
+/* -------------------------------------------------------------------
+ * Append a batch of blocks of a shard to the packed block log with one
+ * vectored write, then their records to the metadata index with one
+ * write. The batch is sorted first, so that runs of consecutive blocks
+ * land contiguously in the log and are indexed by a single extent record.
+ *
+ * The shards of a device write their data in parallel, each into the
+ * space it reserved at the tail of the log, but append their records
+ * in reservation order, so the index stays in log order
+ * (caller holds shard->lock and dev->store_sem shared).
+ * ------------------------------------------------------------------- */
+static int snap_write_batch(struct snap_shard *shard, struct llist_node *first, unsigned int nr)
+{
+    struct snap_device *dev = shard->dev;
+    struct snap_pending_block *blk, **blks = shard->flush_blks;
+    struct snap_extent_rec *ext = NULL;
+    struct llist_node *node = first;
+    bool strict = snap_store_strict(dev);
+    struct iov_iter iter;
+    loff_t base, pos;
+    unsigned int i, nr_ext = 0;
+    size_t total = 0;
+    void *data;
+    u32 crc = 0;
+    ssize_t written;
+    u64 seq;
+    int ret = 0;
+
+    if (!dev->data_filp || !dev->meta_filp)
+        return -EBADF;
+
+    for (i = 0; i < nr; i++, node = node->next)
+        blks[i] = llist_entry(node, struct snap_pending_block, node);
+
+    if (nr > 1)
+        sort(blks, nr, sizeof(*blks), snap_cmp_pending_block, NULL);
+
+    /* Offsets are relative to the batch until its space is reserved */
+    for (i = 0; i < nr; i++) {
+        blk = blks[i];
+        data = blk->data;
+        if (!data) {
+            /* Spilled: read back from the overflow file */
+            data = snap_shard_spill_buf(shard);
+            if (!data)
+                return -ENOMEM;
+            data += (size_t)i * dev->pool_block_size;
+            ret = snap_spill_read(dev, blk, data);
+            if (ret < 0)
+                return ret;
+        }
+        shard->flush_vec[i].iov_base = data;
+        shard->flush_vec[i].iov_len = blk->len;
+
+        if (ext && blk->block_num == blks[i - 1]->block_num + 1) {
+            le32_add_cpu(&ext->nr, 1);
+        } else {
+            ext = &shard->flush_recs[nr_ext++];
+            ext->start = cpu_to_le64(blk->block_num);
+            ext->offset = cpu_to_le64(total);
+            ext->nr = cpu_to_le32(1);
+            crc = SNAP_CRC_SEED;
+        }
+        crc = crc32_le(crc, data, blk->len);
+        ext->crc = cpu_to_le32(crc);
+        total += blk->len;
+    }
+
+    mutex_lock(&dev->store_lock);
+    ret = snap_prealloc_data(dev, dev->data_tail + total);
+    if (ret < 0) {
+        mutex_unlock(&dev->store_lock);
+        pr_warn("%s: failed to preallocate block log (err=%d)\n", MOD_NAME, ret);
+        return ret;
+    }
+    base = dev->data_tail;
+    dev->data_tail += total;
+    seq = dev->store_seq++;
+    mutex_unlock(&dev->store_lock);
+
+    for (i = 0; i < nr_ext; i++)
+        le64_add_cpu(&shard->flush_recs[i].offset, base);
+
+    /* One write of the data, one of the records */
+    snap_qos_charge(&dev->qos, total, 2);
+
+    pos = base;
+    iov_iter_kvec(&iter, ITER_SOURCE, shard->flush_vec, nr, total);
+    written = vfs_iter_write(dev->data_filp, &iter, &pos, 0);
+    if (written != total) {
+        pr_warn("%s: failed to write %u blocks to the block log\n", MOD_NAME, nr);
+        ret = written < 0 ? written : -EIO;
+    } else if (strict) {
+        /* Strict: the index never points at data that is not yet durable */
+        ret = snap_sync_file(dev, dev->data_filp, base, pos - 1);
+    }
+
+    /* The index turn is taken even on failure, the next batches wait for it */
+    if (ret < 0) {
+        snap_append_index(shard, seq, 0, false);
+        return ret;
+    }
+
+    ret = snap_append_index(shard, seq, nr_ext, strict);
     if (ret < 0)
-        pr_warn("%s: failed to write block %llu\n", MOD_NAME, (unsigned long long)block_num);
+        return ret;
 
-    filp_close(filp, NULL);
-    
-out_free:    
-    kfree(path);    
-    return ret;
+    atomic64_add(nr_ext, &dev->stats.flushed_extents);
+    atomic64_add(total, &dev->stats.flushed_bytes);
+    return 0;
 }
 
 /* -------------------------------------------------------------------
- * Update metadata.json by adding a new block
+ * Fill the fixed header of the metadata index from the device state
  * ------------------------------------------------------------------- */
-static int snap_update_metadata_block(struct snap_device *dev, u64 block_num)
+static void snap_fill_meta_header(struct snap_device *dev, struct snap_meta_header *hdr, u16 flags)
 {
-    char *path = NULL, *buf = NULL, *new_buf = NULL;
-    struct file *filp;
-    struct inode *inode;
-    loff_t size;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = cpu_to_le32(SNAP_MAGIC);
+    hdr->version = cpu_to_le16(SNAP_VERSION);
+    hdr->flags = cpu_to_le16(flags);
+    hdr->block_size = cpu_to_le64(dev->block_size);
+    hdr->num_blocks = cpu_to_le64(dev->num_blocks);
+    hdr->device_size = cpu_to_le64(dev->device_size);
+    hdr->timestamp = cpu_to_le64(dev->snapshot_time);
+    hdr->opened = cpu_to_le64(dev->mount_time.tv_sec);
+}
+
+/* -------------------------------------------------------------------
+ * Rewrite the header of the metadata index in place
+ * ------------------------------------------------------------------- */
+static int snap_write_meta_header(struct snap_device *dev, u16 flags)
+{
+    struct snap_meta_header hdr;
     loff_t pos = 0;
-    int ret = 0;
-    char *p, *end;
-    int new_len;
+    ssize_t written;
+
+    if (!dev->meta_filp)
+        return -EBADF;
+
+    snap_fill_meta_header(dev, &hdr, flags);
+
+    written = kernel_write(dev->meta_filp, &hdr, sizeof(hdr), &pos);
+    if (written != sizeof(hdr))
+        return written < 0 ? written : -EIO;
+
+    return 0;
+}
+
+static int mark_snapshot_closed(struct snap_device *dev)
+{
+    int ret;
 
     if (!dev)
         return -EINVAL;
 
-    path = kmalloc(PATH_MAX, GFP_KERNEL);
-    if (!path)
+    ret = snap_write_meta_header(dev, (READ_ONCE(dev->incomplete) ? SNAP_META_INCOMPLETE : 0) |
+                                      (READ_ONCE(dev->unordered) ? SNAP_META_UNORDERED : 0));
+    if (ret < 0)
+        pr_err("%s: failed to update 'open' in %s, err=%d\n", MOD_NAME, SNAP_META_FILE, ret);
+
+    return ret;
+}
+
+/* -------------------------------------------------------------------
+ * Atomically check and mark a block as saved
+ * Returns true if block was already saved, false if it was just marked
+ * ------------------------------------------------------------------- */
+bool snap_try_mark_block_saved(struct snap_device *dev, u64 block)
+{
+    struct snap_bitmap *bitmap;
+    int ret;
+
+    if (!dev)
+        return true; /* treat invalid dev as "already saved" */
+
+    bitmap = snapdev_get_saved_bitmap(dev);
+    if (!bitmap)
+        return true; /* treat invalid bitmap as already saved */
+
+    ret = snap_bitmap_test_and_set(bitmap, block);
+    if (ret < 0) {
+        /* No leaf for the region: none of its blocks will be preserved */
+        WRITE_ONCE(dev->incomplete, true);
+        pr_warn_ratelimited("%s: no memory for the saved bitmap of %s, "
+                            "blocks %llu-%llu not preserved\n",
+                            MOD_NAME, dev->dev_name,
+                            round_down(block, SNAP_BITMAP_LEAF_BITS),
+                            min_t(u64, round_up(block + 1, SNAP_BITMAP_LEAF_BITS),
+                                  dev->num_blocks) - 1);
+        return true;
+    }
+
+    /* 1 = already set */
+    return ret;
+}
+
+/* -------------------------------------------------------------------
+ * Lockless check of the saved bitmap (fast path of the capture)
+ * ------------------------------------------------------------------- */
+bool snap_block_is_saved(struct snap_device *dev, u64 block)
+{
+    struct snap_bitmap *bitmap;
+
+    if (!dev)
+        return true;
+
+    bitmap = snapdev_get_saved_bitmap(dev);
+    if (!bitmap)
+        return true;
+
+    /* Pairs with the full barrier of test_and_set_bit() in the claim */
+    return snap_bitmap_test(bitmap, block);
+}
+
+/* Number of shards of a device mounted now */
+static unsigned int snap_shards_wanted(void)
+{
+    unsigned int nr = READ_ONCE(wb_shards);
+
+    if (!nr)
+        nr = snap_wb_workers();
+    return clamp_t(unsigned int, nr, 1, SNAP_SHARDS_MAX);
+}
+
+/* Shard saving 'block': ranges of SNAP_SHARD_SPAN blocks are dealt round-robin */
+static struct snap_shard *snap_block_shard(struct snap_device *dev, u64 block)
+{
+    u32 idx;
+
+    div_u64_rem(block >> SNAP_SHARD_SPAN_SHIFT, dev->nr_shards, &idx);
+    return &dev->shards[idx];
+}
+
+static int snap_shard_init(struct snap_device *dev, struct snap_shard *shard)
+{
+    shard->dev = dev;
+    mutex_init(&shard->lock);
+    init_llist_head(&shard->capture_q);
+    atomic_set(&shard->queue_depth, 0);
+    snap_wb_ctx_init(&shard->wb, &dev->flush_cpus);
+    snap_wb_job_init(&shard->flush_job, snap_flush_job_handler);
+    INIT_DELAYED_WORK(&shard->flush_work, snap_flush_work_handler);
+    shard->flush_backlog = NULL;
+
+    shard->flush_vec = kcalloc(SNAP_FLUSH_BATCH_MAX, sizeof(*shard->flush_vec), GFP_KERNEL);
+    shard->flush_blks = kcalloc(SNAP_FLUSH_BATCH_MAX, sizeof(*shard->flush_blks), GFP_KERNEL);
+    shard->flush_recs = kcalloc(SNAP_FLUSH_BATCH_MAX, sizeof(*shard->flush_recs), GFP_KERNEL);
+    if (!shard->flush_vec || !shard->flush_blks || !shard->flush_recs)
         return -ENOMEM;
 
-    scnprintf(path, PATH_MAX, "%s/%s/metadata.json",
-              SNAP_ROOT_DIR, dev->snapshot_dir);
+    return 0;
+}
 
-    mutex_lock(&dev->lock);
+void snap_shards_drain(struct snap_device *dev)
+{
+    unsigned int i;
 
-    filp = filp_open(path, O_RDWR, 0);
-    kfree(path);
-    if (IS_ERR(filp)) {
-        ret = PTR_ERR(filp);
-        goto out_unlock;
+    for (i = 0; i < dev->nr_shards; i++) {
+        flush_delayed_work(&dev->shards[i].flush_work);
+        snap_wb_drain(&dev->shards[i].wb);
     }
+}
 
-    inode = file_inode(filp);
-    size  = i_size_read(inode);
-    if (size <= 0) {
-        ret = -EINVAL;
-        goto out_close;
+static void snap_free_pending_blocks(struct snap_pending_block *blk);
+
+/* Free the shards of a device, with the blocks left in them (shards idle) */
+static void snap_shards_release(struct snap_device *dev)
+{
+    struct snap_shard *shard;
+    struct llist_node *left;
+    unsigned int i;
+
+    for (i = 0; i < dev->nr_shards; i++) {
+        shard = &dev->shards[i];
+
+        left = shard->flush_backlog;
+        if (left)
+            snap_free_pending_blocks(llist_entry(left, struct snap_pending_block, node));
+        left = llist_del_all(&shard->capture_q);
+        if (left)
+            snap_free_pending_blocks(llist_entry(left, struct snap_pending_block, node));
+
+        kfree(shard->flush_vec);
+        kfree(shard->flush_blks);
+        kfree(shard->flush_recs);
+        kvfree(shard->spill_buf);
     }
 
-    buf = kmalloc(size + 1, GFP_KERNEL);
-    if (!buf) {
-        ret = -ENOMEM;
-        goto out_close;
+    kfree(dev->shards);
+    dev->shards = NULL;
+    dev->nr_shards = 0;
+    atomic_set(&dev->queue_depth, 0);
+}
+
+/* -------------------------------------------------------------------
+ * Create the capture pools and writeback shards of a device, or resize
+ * them when the block size or the wb_shards setting changed since the
+ * previous mount (dev->lock held).
+ *
+ * Called from the mount job, which holds an engine slot: nothing here
+ * may wait for shard jobs, as they may need that very slot. The shards
+ * are only resized once the cleanup work drained them after the last
+ * snapshot closed; until then the new setting waits for a later mount.
+ * ------------------------------------------------------------------- */
+int snap_capture_pools_setup(struct snap_device *dev)
+{
+    unsigned int i, nr = snap_shards_wanted();
+    bool new_shards = false;
+    int ret;
+
+    if (dev->shards && dev->nr_shards != nr) {
+        if (dev->shards_idle) {
+            snap_shards_release(dev);
+        } else {
+            pr_info("%s: %s keeps %u writeback shards until its last flushes are drained\n",
+                    MOD_NAME, dev->dev_name, dev->nr_shards);
+        }
+    }
+
+    /* A snapshot opens: the shards get jobs again */
+    dev->shards_idle = false;
+
+    if (!dev->shards) {
+        new_shards = true;
+        dev->shards = kcalloc(nr, sizeof(*dev->shards), GFP_KERNEL);
+        if (!dev->shards) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+
+        for (i = 0; i < nr; i++) {
+            ret = snap_shard_init(dev, &dev->shards[i]);
+            dev->nr_shards = i + 1;
+            if (ret < 0)
+                goto fail;
+        }
+    }
+
+    if (snap_pool_ready(&dev->blk_pool) && dev->pool_block_size == dev->block_size)
+        return 0;
+
+    snap_pool_destroy(&dev->blk_pool);
+
+    ret = snap_pool_init(&dev->blk_pool, sizeof(struct snap_pending_block) + dev->block_size);
+    if (ret < 0)
+        goto fail;
+
+    dev->pool_block_size = dev->block_size;
+    return 0;
+
+fail:
+    pr_err("%s: cannot allocate capture pools for %s\n", MOD_NAME, dev->dev_name);
+    /* Shards created here never had a job; older ones are drained at close */
+    if (new_shards)
+        snap_shards_release(dev);
+    snap_pool_destroy(&dev->blk_pool);
+    dev->pool_block_size = 0;
+    return ret;
+}
+
+void snap_capture_pools_release(struct snap_device *dev)
+{
+    /* The blocks left in the shards go back to the pool first */
+    snap_shards_release(dev);
+
+    snap_pool_destroy(&dev->blk_pool);
+    dev->pool_block_size = 0;
+}
+
+/* -------------------------------------------------------------------
+ * The pre-image of a claimed block will not be saved: the snapshot no
+ * longer holds every pre-image, say so instead of dropping it silently.
+ * The block stays claimed, so that no later write saves its own result
+ * as the pre-image.
+ * ------------------------------------------------------------------- */
+static void snap_capture_dropped(struct snap_device *dev, unsigned long nr_blocks,
+                                 const char *why)
+{
+    atomic64_add(nr_blocks, &dev->stats.pool_exhausted);
+    WRITE_ONCE(dev->incomplete, true);
+    pr_warn_ratelimited("%s: %lu block(s) of %s not preserved, %s\n",
+                        MOD_NAME, nr_blocks, dev->dev_name, why);
+}
+
+/* -------------------------------------------------------------------
+ * Ordered mode, or a capture over the memory budget of a throttled
+ * device ('mem_hold'): keep the buffer of a captured block locked, so
+ * that the original write, which locks it to write it out, waits until
+ * the pre-image is saved. Nothing may sleep here: if the buffer is busy
+ * the write simply is not held. Its pre-image is saved all the same, but
+ * in ordered mode the snapshot is then recorded as unordered.
+ * ------------------------------------------------------------------- */
+static void snap_hold_buffer(struct snap_device *dev, struct snap_pending_block *blk,
+                             struct buffer_head *bh, bool mem_hold)
+{
+    bool ordered = READ_ONCE(dev->cfg.ordered);
+
+    if (!ordered && !mem_hold)
+        return;
+
+    if (!trylock_buffer(bh)) {
+        if (ordered) {
+            atomic64_inc(&dev->stats.ordered_misses);
+            WRITE_ONCE(dev->unordered, true);
+            pr_warn_ratelimited("%s: buffer of block %llu of %s busy, its write is not "
+                                "held until its pre-image is durable\n",
+                                MOD_NAME, blk->block_num, dev->dev_name);
+        }
+        return;
+    }
+
+    get_bh(bh);
+    blk->held_bh = bh;
+    atomic64_inc(ordered ? &dev->stats.ordered_holds : &dev->stats.mem_holds);
+}
+
+/* Release a pending block, letting its original write go if it was held */
+static void snap_release_pending_block(struct snap_pending_block *blk)
+{
+    struct snap_device *dev = blk->dev;
+
+    if (blk->held_bh) {
+        snap_lat_record(dev->stats.lat_hold, ktime_get_ns() - blk->captured_ns);
+        unlock_buffer(blk->held_bh);
+        put_bh(blk->held_bh);
+        blk->held_bh = NULL;
+    }
+
+    /* Spilled: only a descriptor, its data is in the overflow file */
+    if (!blk->data) {
+        atomic_dec(&dev->nr_spilled);
+        kfree(blk);
+        return;
+    }
+
+    snap_pool_free(&dev->blk_pool, blk);
+    snap_mem_uncharge(dev, dev->blk_pool.obj_size);
+}
+
+static void snap_free_pending_blocks(struct snap_pending_block *blk)
+{
+    struct llist_node *node, *next;
+
+    if (!blk)
+        return;
+
+    for (node = &blk->node; node; node = next) {
+        next = node->next;
+        snap_release_pending_block(llist_entry(node, struct snap_pending_block, node));
+    }
+}
+
+/* Schedule the flusher of a shard, keeping the device alive while it is queued */
+static void snap_kick_flusher(struct snap_shard *shard, unsigned long delay)
+{
+    struct snap_device *dev = shard->dev;
+
+    snap_device_get(dev);
+
+    if (delay) {
+        if (!queue_delayed_work(system_wq, &shard->flush_work, delay))
+            snap_device_put(dev);
+        return;
+    }
+
+    /* Now: the latency timer, if armed, is no longer needed */
+    if (cancel_delayed_work(&shard->flush_work))
+        snap_device_put(dev);
+
+    if (!snap_wb_queue(&shard->wb, &shard->flush_job))
+        snap_device_put(dev);
+}
+
+/* -------------------------------------------------------------------
+ * Write one batch taken from the capture queue of a shard and release
+ * its blocks. Blocks that could not be saved stay claimed: their writes
+ * went through already, so a later capture would only see their result.
+ * ------------------------------------------------------------------- */
+static void snap_flush_batch(struct snap_shard *shard, struct llist_node *first, unsigned int nr)
+{
+    struct snap_device *dev = shard->dev;
+    struct snap_pending_block *blk;
+    struct llist_node *node, *next;
+    /* FIFO order: the first block of the batch is its oldest capture */
+    u64 oldest = llist_entry(first, struct snap_pending_block, node)->captured_ns;
+    u64 t0 = ktime_get_ns();
+    unsigned int i;
+    int ret;
+
+    ret = snap_write_batch(shard, first, nr);
+    if (ret < 0) {
+        pr_err("%s: failed to save %u blocks of %s (err=%d)\n", MOD_NAME, nr, dev->dev_name, ret);
+        snap_capture_dropped(dev, nr, "the batch could not be saved");
+    } else {
+        atomic64_inc(&dev->stats.flush_batches);
+        atomic64_add(nr, &dev->stats.flushed_blocks);
+
+        /* Group commit: persistent at the next commit, not now */
+        if (snap_store_strict(dev) || READ_ONCE(dev->cfg.durability) != SNAP_DURABILITY_GROUP) {
+            snap_account_persisted(dev, oldest);
+        } else {
+            mutex_lock(&dev->store_lock);
+            if (!dev->commit_since_ns || oldest < dev->commit_since_ns)
+                dev->commit_since_ns = oldest;
+            mutex_unlock(&dev->store_lock);
+        }
+    }
+    atomic64_add(ktime_get_ns() - t0, &dev->stats.flush_ns);
+
+    for (i = 0, node = first; i < nr; i++, node = next) {
+        next = node->next;
+        blk = llist_entry(node, struct snap_pending_block, node);
+        snap_release_pending_block(blk);
+    }
+}
+
+/* -------------------------------------------------------------------
+ * Group commit: one fdatasync of the block log, then of the index, for
+ * everything the shards wrote since the previous commit. Without
+ * 'force', waits for cfg.commit_interval_ms since that commit by arming
+ * the flusher of 'shard' (caller holds dev->store_sem).
+ * ------------------------------------------------------------------- */
+static void snap_group_commit(struct snap_device *dev, struct snap_shard *shard, bool force)
+{
+    unsigned long due;
+    u64 since, t0;
+
+    mutex_lock(&dev->store_lock);
+    since = dev->commit_since_ns;
+    if (!since || !dev->data_filp || !dev->meta_filp) {
+        mutex_unlock(&dev->store_lock);
+        return;
+    }
+
+    due = dev->last_commit + msecs_to_jiffies(READ_ONCE(dev->cfg.commit_interval_ms));
+    if (!force && shard && time_before(jiffies, due)) {
+        mutex_unlock(&dev->store_lock);
+        /* An otherwise idle flusher run performs it */
+        snap_kick_flusher(shard, due - jiffies);
+        return;
+    }
+
+    /* Batches written from now on belong to the next commit */
+    dev->commit_since_ns = 0;
+    dev->last_commit = jiffies;
+    mutex_unlock(&dev->store_lock);
+
+    t0 = ktime_get_ns();
+    if (snap_sync_file(dev, dev->data_filp, 0, LLONG_MAX) < 0 ||
+        snap_sync_file(dev, dev->meta_filp, 0, LLONG_MAX) < 0)
+        WRITE_ONCE(dev->incomplete, true);
+    atomic64_add(ktime_get_ns() - t0, &dev->stats.flush_ns);
+
+    snap_account_persisted(dev, since);
+}
+
+/* -------------------------------------------------------------------
+ * Write at most 'budget' batches of at most cfg.flush_batch blocks of a
+ * shard, in FIFO order. Returns true if captured blocks remain
+ * (shard->lock and dev->store_sem shared held).
+ *
+ * Past the I/O caps of the device, stops and sets '*throttle' to the
+ * jiffies to wait before the next batch; without 'throttle', sleeps.
+ * ------------------------------------------------------------------- */
+static bool snap_flush_some(struct snap_shard *shard, unsigned int budget,
+                            unsigned long *throttle)
+{
+    struct snap_device *dev = shard->dev;
+    struct llist_node *first;
+    unsigned int nr, max;
+    u64 delay;
+
+    while (budget--) {
+        /* The backlog is older than anything still in the queue */
+        if (!shard->flush_backlog)
+            shard->flush_backlog = llist_reverse_order(llist_del_all(&shard->capture_q));
+        if (!shard->flush_backlog)
+            break;
+
+        delay = snap_qos_delay(&dev->qos);
+        if (delay) {
+            atomic64_add(delay, &dev->stats.throttled_ns);
+            if (throttle) {
+                *throttle = max_t(unsigned long, nsecs_to_jiffies(delay), 1);
+                break;
+            }
+            fsleep(max_t(u64, div_u64(delay, NSEC_PER_USEC), 1));
+        }
+
+        max = clamp_t(unsigned int, READ_ONCE(dev->cfg.flush_batch), 1, SNAP_FLUSH_BATCH_MAX);
+
+        first = shard->flush_backlog;
+        for (nr = 0; shard->flush_backlog && nr < max; nr++)
+            shard->flush_backlog = shard->flush_backlog->next;
+
+        atomic_sub(nr, &shard->queue_depth);
+        atomic_sub(nr, &dev->queue_depth);
+        snap_flush_batch(shard, first, nr);
+    }
+
+    return shard->flush_backlog || !llist_empty(&shard->capture_q);
+}
+
+/* -------------------------------------------------------------------
+ * Drain the capture queues of all the shards (caller must hold
+ * dev->lock). The shards are kicked first so that they drain in
+ * parallel; taking each shard lock in turn then waits for their
+ * batches in flight and writes whatever is left.
+ * ------------------------------------------------------------------- */
+void snap_flush_capture_queue(struct snap_device *dev)
+{
+    struct snap_qos_scope scope;
+    struct snap_shard *shard;
+    unsigned int i;
+
+    for (i = 0; i < dev->nr_shards; i++) {
+        if (atomic_read(&dev->shards[i].queue_depth) > 0)
+            snap_kick_flusher(&dev->shards[i], 0);
     }
 
-    ret = kernel_read(filp, buf, size, &pos);
+    /* Everything is written, within the caps of the device */
+    snap_qos_enter(&dev->qos, &scope);
+    down_read(&dev->store_sem);
+    for (i = 0; i < dev->nr_shards; i++) {
+        shard = &dev->shards[i];
+        mutex_lock(&shard->lock);
+        snap_flush_some(shard, UINT_MAX, NULL);
+        mutex_unlock(&shard->lock);
+    }
+    if (dev->nr_shards)
+        snap_group_commit(dev, &dev->shards[0], false);
+    up_read(&dev->store_sem);
+    snap_qos_exit(&scope);
+}
+
+/* -------------------------------------------------------------------
+ * Flusher of a shard: a job of the shared writeback engine, queued
+ * after cfg.flush_latency_us or as soon as a full batch is queued. A
+ * turn writes at most snap_wb_quantum() batches, then yields to the
+ * other devices and shards if more remain.
+ *
+ * The I/O runs with the priority and cgroup of the device; past its
+ * caps, the job ends and the latency timer queues it again when the
+ * caps allow, so a throttled device never holds a worker.
+ * ------------------------------------------------------------------- */
+void snap_flush_job_handler(struct snap_wb_job *job)
+{
+    struct snap_shard *shard = container_of(job, struct snap_shard, flush_job);
+    struct snap_device *dev = shard->dev;
+    struct snap_qos_scope scope;
+    unsigned long throttle = 0;
+    bool more;
+
+    snap_qos_enter(&dev->qos, &scope);
+    down_read(&dev->store_sem);
+    mutex_lock(&shard->lock);
+    more = snap_flush_some(shard, snap_wb_quantum(), &throttle);
+    mutex_unlock(&shard->lock);
+    if (!more)
+        snap_group_commit(dev, shard, false);
+    up_read(&dev->store_sem);
+    snap_qos_exit(&scope);
+
+    if (more)
+        snap_kick_flusher(shard, throttle);
+
+    /* Reference taken when the job was queued */
+    snap_device_put(dev);
+}
+
+/* Flush latency timer: hands its device reference over to the flush job */
+void snap_flush_work_handler(struct work_struct *work)
+{
+    struct snap_shard *shard = container_of(to_delayed_work(work), struct snap_shard, flush_work);
+
+    if (!snap_wb_queue(&shard->wb, &shard->flush_job))
+        snap_device_put(shard->dev);
+}
+
+/*
+ * Copy a pre-image into a block charged to the memory budget; '*hold'
+ * tells whether the budget asks to hold the write until it is saved
+ */
+static struct snap_pending_block *snap_alloc_block_from_bh(struct snap_device *dev,
+                                                           struct buffer_head *bh,
+                                                           u64 block_nr,
+                                                           size_t block_size,
+                                                           bool *hold)
+{
+    struct snap_pending_block *blk = NULL;
+    enum snap_mem_verdict verdict;
+
+    if (!bh || !dev || !snap_pool_ready(&dev->blk_pool))
+        return NULL;
+
+    if (WARN_ON_ONCE(block_size > dev->pool_block_size))
+        return NULL;
+
+    verdict = snap_mem_charge(dev, dev->blk_pool.obj_size);
+    if (verdict == SNAP_MEM_DROP)
+        return NULL;
+
+    blk = snap_pool_alloc(&dev->blk_pool);
+    if (!blk) {
+        snap_mem_uncharge(dev, dev->blk_pool.obj_size);
+        return NULL;
+    }
+    *hold = verdict == SNAP_MEM_HOLD;
+
+    blk->data = blk + 1;
+    memcpy(blk->data, bh->b_data, block_size);
+
+    blk->dev = dev;
+    blk->block_num = block_nr;
+    blk->len = block_size;
+    blk->captured_ns = ktime_get_ns();
+    blk->held_bh = NULL;
+    blk->spill_pos = 0;
+    blk->node.next = NULL;
+
+    return blk;
+}
+
+/* Deferred capture states, stored in dev->deferred */
+#define SNAP_DEFERRED_ARMING  xa_mk_value(1)   /* claim in progress */
+#define SNAP_DEFERRED_ARMED   xa_mk_value(2)   /* claimed, waiting for the block read */
+
+/* Longest a reader waits for a capture being armed before dropping it */
+#define SNAP_DEFERRED_ARMING_WAIT_NS  (100 * NSEC_PER_USEC)
+
+/* -------------------------------------------------------------------
+ * Capture the pre-image of a block that is not in the buffer cache.
+ *
+ * Nothing may sleep here, so the block is not read: it is claimed and
+ * armed instead. Any writer has to read the block before it can modify
+ * it, and snap_complete_deferred_capture() copies it from that read,
+ * which runs in the writer's own sleepable context. The arming marker
+ * is inserted before the claim so that a writer skipping the block
+ * can never reach its read before the capture is armed.
+ * ------------------------------------------------------------------- */
+static bool snap_defer_block_capture(struct snap_device *dev, u64 block_nr)
+{
+    int ret;
+
+    /* dev->deferred is indexed by unsigned long */
+    if (block_nr > ULONG_MAX)
+        return false;
+
+    ret = xa_insert(&dev->deferred, block_nr, SNAP_DEFERRED_ARMING, GFP_ATOMIC);
+    if (ret == -EBUSY)
+        return false; /* already being armed by another writer */
     if (ret < 0) {
-        pr_err("%s: failed to read metadata.json, err=%d\n", MOD_NAME, ret);
-        goto out_free;
+        /*
+         * No memory to arm it: claim the block all the same, so that a
+         * later writer does not take this write's result for the
+         * pre-image, and report it dropped
+         */
+        if (snap_try_mark_block_saved(dev, block_nr))
+            return false;
+        snap_capture_dropped(dev, 1, "no memory to defer the capture");
+        return true;
     }
-    buf[size] = '\0';
 
-    p = strnstr(buf, "\"blocks\": [", size);
-    if (!p) {
-        pr_err("%s: metadata.json unexpected format (missing blocks)\n", MOD_NAME);
-        ret = -EINVAL;
-        goto out_free;
+    if (snap_try_mark_block_saved(dev, block_nr)) {
+        /* Another writer claimed the block first */
+        xa_cmpxchg(&dev->deferred, block_nr, SNAP_DEFERRED_ARMING, NULL, GFP_ATOMIC);
+        return false;
     }
 
-    end = strchr(p, ']');
-    if (!end) {
-        pr_err("%s: metadata.json unexpected format (missing ])\n", MOD_NAME);
-        ret = -EINVAL;
-        goto out_free;
-    }
+    /* A reader that waited too long for the arming gave the capture up */
+    if (xa_cmpxchg(&dev->deferred, block_nr, SNAP_DEFERRED_ARMING, SNAP_DEFERRED_ARMED,
+                   GFP_ATOMIC) != SNAP_DEFERRED_ARMING)
+        return true;
+    atomic64_inc(&dev->stats.capture_deferred);
+    return true;
+}
 
-    new_buf = kmalloc(size + 32, GFP_KERNEL);
-    if (!new_buf) {
-        ret = -ENOMEM;
-        goto out_free;
+/* -------------------------------------------------------------------
+ * Capture the pre-image of a block not yet saved.
+ *
+ * The copy is taken before the block is claimed in the saved bitmap,
+ * and every writer tries the claim before modifying the block, so the
+ * first writer to claim it necessarily holds an untouched pre-image.
+ * Losers of a concurrent first write simply drop their copy.
+ * The block is only looked up in the buffer cache, never read.
+ * ------------------------------------------------------------------- */
+static struct snap_pending_block *snap_capture_block(struct snap_device *dev,
+                                                     struct super_block *sb,
+                                                     u64 block_nr,
+                                                     size_t block_size,
+                                                     bool *claimed)
+{
+    struct snap_pending_block *blk;
+    struct buffer_head *bh;
+    bool hold = false;
+
+    if (block_nr >= dev->num_blocks)
+        return NULL;
+
+    /* Steady state: already preserved, nothing to read or copy */
+    if (snap_block_is_saved(dev, block_nr))
+        return NULL;
+
+    bh = __find_get_block(sb->s_bdev, block_nr, block_size);
+    if (!bh || !buffer_uptodate(bh)) {
+        brelse(bh);
+        if (snap_defer_block_capture(dev, block_nr))
+            *claimed = true;
+        return NULL;
     }
 
-    new_len = end - buf;
-    memcpy(new_buf, buf, new_len);
+    blk = snap_alloc_block_from_bh(dev, bh, block_nr, block_size, &hold);
 
-    if (*(end - 1) == '[') {
-        new_len += scnprintf(new_buf + new_len,
-                             32, "%llu", (unsigned long long)block_num);
-    } else {
-        new_len += scnprintf(new_buf + new_len,
-                             32, ", %llu", (unsigned long long)block_num);
+    if (snap_try_mark_block_saved(dev, block_nr)) {
+        /* Another writer claimed the block first */
+        brelse(bh);
+        snap_free_pending_blocks(blk);
+        return NULL;
     }
 
-    strcpy(new_buf + new_len, end);
+    *claimed = true;
+    atomic64_inc(&dev->stats.capture_hits);
 
-    pos = 0;
-    ret = kernel_write(filp, new_buf, strlen(new_buf), &pos);
-    if (ret < 0)
-        pr_err("%s: failed to write metadata.json, err=%d\n", MOD_NAME, ret);
+    if (blk)
+        snap_hold_buffer(dev, blk, bh, hold);
+    else
+        snap_capture_dropped(dev, 1, "no capture memory left");
 
-    kfree(new_buf);
-out_free:
-    kfree(buf);
-out_close:
-    filp_close(filp, NULL);
-out_unlock:
-    mutex_unlock(&dev->lock);
-    return ret;
+    brelse(bh);
+    return blk;
 }
 
-static int mark_snapshot_closed(struct snap_device *dev)
+/* -------------------------------------------------------------------
+ * Complete an armed deferred capture from a freshly read buffer, before
+ * the reader gets a chance to modify it.
+ *
+ * Only the first read after the arming holds the pre-image. 'fresh' is
+ * false when the block was already cached as the read started, or when
+ * the block read probe missed hits since the snapshot opened: a read
+ * that went unseen may have let its writer modify the block, so the
+ * capture is dropped rather than completed from modified data.
+ * ------------------------------------------------------------------- */
+void snap_complete_deferred_capture(struct snap_device *dev, struct buffer_head *bh, bool fresh)
 {
-    char *path = NULL, *buf = NULL;
-    struct file *filp;
-    struct inode *inode;
-    loff_t size;
-    loff_t pos = 0;
-    int ret = 0;
+    struct snap_pending_block *blk;
+    bool hold = false;
+    u64 block_nr, deadline;
+    void *entry;
 
-    if (!dev)
-        return -EINVAL;
+    if (!dev || !bh || xa_empty(&dev->deferred))
+        return;
 
-    path = kmalloc(PATH_MAX, GFP_KERNEL);
-    if (!path)
-        return -ENOMEM;
+    block_nr = bh->b_blocknr;
+    if (block_nr >= dev->num_blocks)
+        return;
 
-    scnprintf(path, PATH_MAX, "%s/%s/metadata.json",
-              SNAP_ROOT_DIR, dev->snapshot_dir);
+    /* The arming writer is in a non-preemptible handler: wait it out, for a while */
+    deadline = ktime_get_ns() + SNAP_DEFERRED_ARMING_WAIT_NS;
+    while ((entry = xa_load(&dev->deferred, block_nr)) == SNAP_DEFERRED_ARMING) {
+        if (ktime_get_ns() > deadline) {
+            /* Give the capture up: the arming writer finds it gone */
+            if (xa_cmpxchg(&dev->deferred, block_nr, SNAP_DEFERRED_ARMING, NULL,
+                           GFP_ATOMIC) == SNAP_DEFERRED_ARMING)
+                snap_capture_dropped(dev, 1, "its capture was not armed in time");
+            return;
+        }
+        cpu_relax();
+    }
 
-    filp = filp_open(path, O_RDWR, 0);
-    kfree(path);
-    if (IS_ERR(filp))
-        return PTR_ERR(filp);
+    if (entry != SNAP_DEFERRED_ARMED)
+        return;
 
-    inode = file_inode(filp);
-    size  = i_size_read(inode);
+    /* Only one reader completes the capture */
+    if (xa_cmpxchg(&dev->deferred, block_nr, SNAP_DEFERRED_ARMED, NULL, GFP_ATOMIC) !=
+        SNAP_DEFERRED_ARMED)
+        return;
 
-    buf = kmalloc(size + 1, GFP_KERNEL);
-    if (!buf) {
-        filp_close(filp, NULL);
-        return -ENOMEM;
+    if (!fresh) {
+        snap_capture_dropped(dev, 1, "the first read of the block went unseen");
+        return;
     }
 
-    ret = kernel_read(filp, buf, size, &pos);
-    if (ret < 0) {
-        pr_err("%s: failed to read metadata.json, err=%d\n", MOD_NAME, ret);
-        kfree(buf);
-        filp_close(filp, NULL);
-        return ret;
+    if (!buffer_uptodate(bh)) {
+        snap_capture_dropped(dev, 1, "the read of the block failed");
+        return;
     }
-    buf[size] = '\0';
 
-    {
-        char *p = strnstr(buf, "\"open\":", size);
-        if (p) {
-            /* Salti gli spazi dopo i due punti */
-            char *val = p + 7;
-            while (*val == ' ' || *val == '\t')
-                val++;
-
-            if (*val == '1')
-                *val = '0';
-        } else {
-            pr_warn("%s: 'open' field not found in metadata.json\n", MOD_NAME);
-        }
+    blk = snap_alloc_block_from_bh(dev, bh, block_nr, bh->b_size, &hold);
+    if (!blk) {
+        snap_capture_dropped(dev, 1, "no capture memory left");
+        return;
     }
 
-    pos = 0;
-    ret = kernel_write(filp, buf, size, &pos);
-    if (ret < 0)
-        pr_err("%s: failed to update 'open' in metadata.json, err=%d\n", MOD_NAME, ret);
-
-    kfree(buf);
-    filp_close(filp, NULL);
-
-    return ret;
+    atomic64_inc(&dev->stats.deferred_done);
+    snap_hold_buffer(dev, blk, bh, hold);
+    snap_queue_pending_blocks(blk);
 }
 
 /* -------------------------------------------------------------------
- * Atomically check and mark a block as saved
- * Returns true if block was already saved, false if it was just marked
+ * Forget the armed captures of a closing snapshot. A block never seen
+ * read is unchanged, unless a read went unseen ('reads_missed'): then
+ * its writer may have modified it, and the capture is dropped.
  * ------------------------------------------------------------------- */
-bool snap_try_mark_block_saved(struct snap_device *dev, u64 block)
+void snap_release_deferred_captures(struct snap_device *dev, bool reads_missed)
 {
-    unsigned long *bitmap;
-
-    if (!dev)
-        return true; /* treat invalid dev as "already saved" */
+    unsigned long index, nr = 0;
+    void *entry;
+
+    if (reads_missed) {
+        xa_for_each(&dev->deferred, index, entry)
+            nr++;
+        if (nr)
+            snap_capture_dropped(dev, nr, "a read of the block went unseen");
+    }
 
-    bitmap = snapdev_get_saved_bitmap(dev);
-    if (!bitmap)
-        return true; /* treat invalid bitmap as already saved */
+    xa_destroy(&dev->deferred);
+}
 
-    /* test_and_set_bit returns previous value: true = already set */
-    return test_and_set_bit(block, bitmap);
+/* Queue a chain of claimed blocks of one shard (atomic context) */
+static void snap_shard_queue(struct snap_shard *shard, struct snap_pending_block *first,
+                             struct snap_pending_block *last, unsigned int nr)
+{
+    struct snap_device *dev = shard->dev;
+    bool was_empty;
+    int depth;
+
+    was_empty = llist_add_batch(&first->node, &last->node, &shard->capture_q);
+    depth = atomic_add_return(nr, &shard->queue_depth);
+    atomic_add(nr, &dev->queue_depth);
+
+    /*
+     * A full batch goes out now, a partial one waits for the latency
+     * bound, except in strict and ordered modes where nothing waits.
+     * Past the I/O caps of the device, the flusher timer is already
+     * armed for when they allow the next batch.
+     */
+    if ((depth >= READ_ONCE(dev->cfg.flush_batch) || snap_store_strict(dev)) &&
+        !snap_qos_delay(&dev->qos))
+        snap_kick_flusher(shard, 0);
+    else if (was_empty)
+        snap_kick_flusher(shard, usecs_to_jiffies(READ_ONCE(dev->cfg.flush_latency_us)));
 }
 
 /* -------------------------------------------------------------------
- * Workqueue handler: save a single block into snapshot
+ * Hand a list of claimed pre-images of one device over to the flusher.
+ * Lock-free: producers only push to the capture queues of the shards,
+ * each run of blocks of the same shard as a single unit.
  * ------------------------------------------------------------------- */
-void snap_block_work_handler(struct work_struct *work)
+void snap_queue_pending_blocks(struct snap_pending_block *blk)
 {
-    struct snap_block_work *bw = container_of(work, struct snap_block_work, work);
+    struct snap_pending_block *last, *next;
+    struct snap_shard *shard;
     struct snap_device *dev;
+    unsigned int nr;
 
-    if (!bw || !bw->dev || !bw->data)
-        goto out_free;
+    if (!blk)
+        return;
 
-    dev = bw->dev;
+    dev = blk->dev;
+    while (blk) {
+        shard = snap_block_shard(dev, blk->block_num);
 
-    if (snap_save_block_to_file(dev, bw->block_num, bw->data, bw->len) < 0) {
-        pr_err("%s: failed to save block %llu\n", MOD_NAME, (unsigned long long)bw->block_num);
-        
-        /* Removes the flag in the bitmap on error */
-        unsigned long *bitmap = snapdev_get_saved_bitmap(dev);
-        if (bitmap)
-            clear_bit(bw->block_num, bitmap);
-    } else {
-        if (snap_update_metadata_block(dev, bw->block_num) < 0) {
-            pr_err("%s: failed to update metadata for block %llu\n",
-                   MOD_NAME, (unsigned long long)bw->block_num);
+        for (last = blk, nr = 1; last->node.next; last = next, nr++) {
+            next = llist_entry(last->node.next, struct snap_pending_block, node);
+            if (snap_block_shard(dev, next->block_num) != shard)
+                break;
         }
-    }
 
-out_free:
-    if (bw->data)
-        kfree(bw->data);
-    snap_device_put(dev);
-    kfree(bw);
+        /* Cut the run off the list before it is published */
+        next = last->node.next ? llist_entry(last->node.next, struct snap_pending_block, node) : NULL;
+        last->node.next = NULL;
+
+        snap_shard_queue(shard, blk, last, nr);
+        blk = next;
+    }
 }
 
-static struct snap_pending_block *snap_alloc_block_from_bh(struct snap_device *dev,
-                                                           struct buffer_head *bh,
-                                                           int block_nr,
-                                                           size_t block_size)
+/* Append a captured block to a pending list */
+static void snap_pending_append(struct snap_pending_block **first,
+                                struct snap_pending_block **last,
+                                struct snap_pending_block *blk)
 {
-    struct snap_pending_block *blk = NULL;
-
-    if (!bh || !dev)
-        return NULL;
-
-    blk = kmalloc(sizeof(*blk), GFP_ATOMIC);
     if (!blk)
-        return NULL;
-
-    blk->data = kmemdup(bh->b_data, block_size, GFP_ATOMIC);
-    if (!blk->data) {
-        kfree(blk);
-        return NULL;
-    }
-
-    blk->dev = dev;
-    blk->block_num = block_nr;
-    blk->len = block_size;
-    blk->next = NULL;
+        return;
 
-    return blk;
+    if (!*first)
+        *first = blk;
+    if (*last)
+        (*last)->node.next = &blk->node;
+    *last = blk;
 }
 
-
-/* Returns list of snap_block_work ready to schedule, NULL if nothing */
+/*
+ * Returns list of claimed blocks ready to schedule, NULL if nothing.
+ * All the blocks touched by [*off, *off + len) are captured in one pass.
+ */
 struct snap_pending_block *snap_prepare_singlefilefs_block_save(struct snap_device *dev,
                                                                 struct inode *inode,
-                                                                loff_t *off)
+                                                                loff_t *off,
+                                                                size_t len,
+                                                                bool *claimed)
 {
     size_t block_size;
-    struct buffer_head *bh;
-    int block_nr;
-    struct snap_pending_block *blk, *first = NULL, *last = NULL;
+    u64 block_nr, first_nr, last_nr;
+    struct snap_pending_block *first = NULL, *last = NULL;
+
+    if (!dev || !inode || !inode->i_sb || !off || len == 0)
+        return NULL;
 
-    if (!dev || !inode || !inode->i_sb || !off)
+    /*
+     * A device marked mounted before its mount job opened the snapshot
+     * has no saved bitmap and no size yet. The bitmap is published
+     * under dev->spin_lock after num_blocks is set, so checking it
+     * first makes num_blocks valid below.
+     */
+    if (!snapdev_get_saved_bitmap(dev) || dev->num_blocks == 0)
         return NULL;
 
     block_size = snap_get_filesystem_block_size_from_inode(inode);
     if (block_size == 0)
         return NULL;
 
-    /* Data block */
-    block_nr = *off / block_size + SINGLEFILEFS_RESERVED_BLOCKS;
-    bh = sb_bread(inode->i_sb, block_nr);
-    if (bh) {
-        blk = snap_alloc_block_from_bh(dev, bh, block_nr, block_size);
-        if (blk) {
-            first = blk;
-            last = blk;
-        }
-        brelse(bh);
+    /* Data blocks */
+    first_nr = *off / block_size + SINGLEFILEFS_RESERVED_BLOCKS;
+    last_nr = (*off + len - 1) / block_size + SINGLEFILEFS_RESERVED_BLOCKS;
+    if (first_nr < dev->num_blocks) {
+        if (last_nr >= dev->num_blocks)
+            last_nr = dev->num_blocks - 1;
+
+        for (block_nr = first_nr; block_nr <= last_nr; block_nr++)
+            snap_pending_append(&first, &last,
+                                snap_capture_block(dev, inode->i_sb, block_nr, block_size, claimed));
     }
 
-    /* Inode block */
-    block_nr = SINGLEFILEFS_INODE_BLOCK_NUMBER;
-    bh = sb_bread(inode->i_sb, block_nr);
-    if (bh) {
-        blk = snap_alloc_block_from_bh(dev, bh, block_nr, block_size);
-        if (blk) {
-            if (!first) first = blk;
-            if (last) last->next = blk;
-            last = blk;
-        }
-        brelse(bh);
+    /* Inode block: only modified if the write extends the file */
+    if (*off + len > i_size_read(inode)) {
+        block_nr = SINGLEFILEFS_INODE_BLOCK_NUMBER;
+        snap_pending_append(&first, &last,
+                            snap_capture_block(dev, inode->i_sb, block_nr, block_size, claimed));
     }
 
     return first;
@@ -368,83 +1299,360 @@ static int create_snapshot_dir(const char *dir_name)
 }
 
 /* -------------------------------------------------------------------
- * Initialize snapshot: create metadata.json inside the snapshot dir
+ * Initialize snapshot: create the metadata index inside the snapshot
+ * dir and keep it open for appending block records
  * ------------------------------------------------------------------- */
-static int initialize_snapshot(struct snap_device *dev, const char *dir_name)
+static int initialize_snapshot(struct snap_device *dev)
 {
-    char *path = NULL, *json_buf = NULL;
     struct file *filp;
-    loff_t pos = 0;
-    ssize_t written;
     int ret;
 
-    if (!dev || !dir_name)
+    if (!dev)
         return -EINVAL;
 
-    path = kmalloc(PATH_MAX, GFP_KERNEL);
-    json_buf = kmalloc(1024, GFP_KERNEL);
-    if (!path || !json_buf) {
-        kfree(path);
-        kfree(json_buf);
-        return -ENOMEM;
+    filp = snap_open_store_file(dev, SNAP_META_FILE, O_CREAT | O_RDWR | O_TRUNC);
+    if (IS_ERR(filp)) {
+        pr_err("%s: cannot create %s for %s\n", MOD_NAME, SNAP_META_FILE, dev->dev_name);
+        return PTR_ERR(filp);
+    }
+
+    dev->meta_filp = filp;
+    dev->index_tail = sizeof(struct snap_meta_header);
+
+    ret = snap_write_meta_header(dev, SNAP_META_OPEN);
+    if (ret < 0) {
+        pr_err("%s: failed to write %s for %s, err=%d\n",
+               MOD_NAME, SNAP_META_FILE, dev->dev_name, ret);
+        filp_close(filp, NULL);
+        dev->meta_filp = NULL;
+        return ret;
+    }
+
+    pr_info("%s: %s initialized for %s\n", MOD_NAME, SNAP_META_FILE, dev->dev_name);
+    return 0;
+}
+
+/* -------------------------------------------------------------------
+ * Create the packed block log for a new snapshot
+ * ------------------------------------------------------------------- */
+static int open_snapshot_store(struct snap_device *dev)
+{
+    struct file *data_filp;
+    int ret;
+
+    data_filp = snap_open_store_file(dev, SNAP_DATA_FILE, O_CREAT | O_RDWR | O_TRUNC);
+    if (IS_ERR(data_filp)) {
+        pr_err("%s: cannot create %s for %s\n", MOD_NAME, SNAP_DATA_FILE, dev->dev_name);
+        return PTR_ERR(data_filp);
+    }
+
+    dev->data_filp = data_filp;
+    dev->data_tail = 0;
+    dev->data_prealloc = 0;
+    dev->commit_since_ns = 0;
+    dev->last_commit = jiffies;
+
+    ret = snap_prealloc_data(dev, SNAP_DATA_PREALLOC);
+    if (ret < 0)
+        pr_warn("%s: block log preallocation failed for %s (err=%d)\n",
+                MOD_NAME, dev->dev_name, ret);
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------
+ * Close the packed block log, releasing the unused preallocation
+ * ------------------------------------------------------------------- */
+static void close_snapshot_store(struct snap_device *dev)
+{
+    snap_spill_close(dev);
+
+    if (dev->data_filp) {
+        if (dev->data_prealloc > dev->data_tail)
+            vfs_truncate(&dev->data_filp->f_path, dev->data_tail);
+        filp_close(dev->data_filp, NULL);
+        dev->data_filp = NULL;
     }
+}
+
+/* -------------------------------------------------------------------
+ * Open the saved bitmap of the snapshot and check its header against
+ * the device geometry; the file is left positioned on the first leaf
+ * ------------------------------------------------------------------- */
+static struct file *snap_open_bitmap(struct snap_device *dev, struct snap_bitmap_header *bhdr,
+                                     loff_t *pos)
+{
+    u64 max_leaves = DIV_ROUND_UP_ULL(dev->num_blocks, SNAP_BITMAP_LEAF_BITS);
+    struct file *filp;
+    u32 nr_leaves;
+
+    filp = snap_open_store_file(dev, SNAP_BITMAP_FILE, O_RDONLY);
+    if (IS_ERR(filp))
+        return filp;
+
+    *pos = 0;
+    if (kernel_read(filp, bhdr, sizeof(*bhdr), pos) != sizeof(*bhdr))
+        goto stale;
+
+    nr_leaves = le32_to_cpu(bhdr->nr_leaves);
+    if (le32_to_cpu(bhdr->magic) != SNAP_BITMAP_MAGIC ||
+        le32_to_cpu(bhdr->long_size) != sizeof(long) ||
+        le32_to_cpu(bhdr->leaf_size) != PAGE_SIZE ||
+        le64_to_cpu(bhdr->num_blocks) != dev->num_blocks ||
+        nr_leaves > max_leaves ||
+        i_size_read(file_inode(filp)) !=
+            (loff_t)(sizeof(*bhdr) + (u64)nr_leaves * (sizeof(__le64) + PAGE_SIZE)))
+        goto stale;
+
+    return filp;
+
+stale:
+    filp_close(filp, NULL);
+    return ERR_PTR(-ESTALE);
+}
+
+/* -------------------------------------------------------------------
+ * Session mode: persist the saved bitmap, along with the sizes of the
+ * store it describes. Only the leaves allocated are written. Claims
+ * still armed were never saved, so their blocks are left to be
+ * captured by the next session.
+ * ------------------------------------------------------------------- */
+int snap_save_session(struct snap_device *dev)
+{
+    struct snap_bitmap_header bhdr;
+    struct snap_bitmap *bitmap = dev->saved_bitmap;
+    unsigned long *leaf, *ones = NULL;
+    unsigned long idx;
+    u32 nr_leaves = 0;
+    struct file *filp;
+    void *entry;
+    loff_t pos = 0;
+    __le64 rec;
+    int ret = 0;
+
+    if (!bitmap || !dev->meta_filp || !dev->data_filp)
+        return -EINVAL;
+
+    xa_for_each(&dev->deferred, idx, entry)
+        snap_bitmap_clear(bitmap, idx);
 
-    scnprintf(path, PATH_MAX, "%s/%s/metadata.json", SNAP_ROOT_DIR, dir_name);
+    for (idx = 0; idx < bitmap->nr_leaves; idx++) {
+        if (snap_bitmap_leaf(bitmap, idx) || test_bit(idx, bitmap->full))
+            nr_leaves++;
+    }
 
-    filp = filp_open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+    filp = snap_open_store_file(dev, SNAP_BITMAP_FILE, O_CREAT | O_WRONLY | O_TRUNC);
     if (IS_ERR(filp)) {
-        pr_err("%s: cannot create metadata.json for %s\n", MOD_NAME, dev->dev_name);
         ret = PTR_ERR(filp);
         goto out;
     }
 
-    /* Write initial JSON */
-    written = scnprintf(json_buf, 1024,
-        "{\n"
-        "  \"magic\": 0x%X,\n"
-        "  \"version\": %u,\n"
-        "  \"device_name\": \"%s\",\n"
-        "  \"snapshot_id\": \"%s\",\n"
-        "  \"timestamp\": \"%llu\",\n"
-        "  \"block_size\": %llu,\n"
-        "  \"device_size\": %llu,\n"
-        "  \"num_blocks\": %llu,\n"
-        "  \"open\": 1,\n"
-        "  \"blocks\": []\n"
-        "}\n",
-        SNAP_MAGIC,
-        SNAP_VERSION,
-        dev->dev_name,
-        dir_name,
-        (unsigned long long)dev->mount_time.tv_sec,
-        (unsigned long long)dev->block_size,
-        (unsigned long long)dev->device_size,
-        (unsigned long long)dev->num_blocks
-    );
-
-    written = kernel_write(filp, json_buf, written, &pos);
-    if (written < 0) {
-        pr_err("%s: failed to write metadata.json for %s, err=%zd\n",
-               MOD_NAME, dev->dev_name, written);
-        ret = (int)written;
-        goto close_file;
+    memset(&bhdr, 0, sizeof(bhdr));
+    bhdr.magic = cpu_to_le32(SNAP_BITMAP_MAGIC);
+    bhdr.long_size = cpu_to_le32(sizeof(long));
+    bhdr.leaf_size = cpu_to_le32(PAGE_SIZE);
+    bhdr.nr_leaves = cpu_to_le32(nr_leaves);
+    bhdr.num_blocks = cpu_to_le64(dev->num_blocks);
+    bhdr.index_size = cpu_to_le64(dev->index_tail);
+    bhdr.data_size = cpu_to_le64(dev->data_tail);
+
+    if (kernel_write(filp, &bhdr, sizeof(bhdr), &pos) != sizeof(bhdr)) {
+        ret = -EIO;
+        goto out_close;
+    }
+
+    for (idx = 0; idx < bitmap->nr_leaves; idx++) {
+        leaf = snap_bitmap_leaf(bitmap, idx);
+        if (!leaf) {
+            if (!test_bit(idx, bitmap->full))
+                continue;
+
+            /* Region given up for lack of memory: keep it out of later sessions too */
+            if (!ones) {
+                ones = kmalloc(PAGE_SIZE, GFP_KERNEL);
+                if (!ones) {
+                    ret = -ENOMEM;
+                    goto out_close;
+                }
+                memset(ones, 0xff, PAGE_SIZE);
+            }
+            leaf = ones;
+        }
+
+        rec = cpu_to_le64(idx);
+        if (kernel_write(filp, &rec, sizeof(rec), &pos) != sizeof(rec) ||
+            kernel_write(filp, leaf, PAGE_SIZE, &pos) != PAGE_SIZE) {
+            ret = -EIO;
+            goto out_close;
+        }
     }
-    
-    pr_info("%s: metadata.json initialized for %s\n", MOD_NAME, dev->dev_name);
 
-close_file:    
+    if (READ_ONCE(dev->cfg.durability) != SNAP_DURABILITY_NONE)
+        ret = snap_sync_file(dev, filp, 0, LLONG_MAX);
+
+out_close:
+    kfree(ones);
     filp_close(filp, NULL);
-    
-out:    
-    kfree(path);
-    kfree(json_buf);
+out:
+    if (ret < 0)
+        pr_err("%s: failed to save %s for %s, err=%d\n",
+               MOD_NAME, SNAP_BITMAP_FILE, dev->dev_name, ret);
+    return ret;
+}
 
-        
+/* -------------------------------------------------------------------
+ * Session mode: read the saved bitmap of a resumed snapshot
+ * ------------------------------------------------------------------- */
+int snap_load_saved_bitmap(struct snap_device *dev, struct snap_bitmap *bitmap)
+{
+    struct snap_bitmap_header bhdr;
+    struct file *filp;
+    void *buf;
+    __le64 rec;
+    loff_t pos;
+    u32 i;
+    int ret = 0;
+
+    filp = snap_open_bitmap(dev, &bhdr, &pos);
+    if (IS_ERR(filp))
+        return PTR_ERR(filp);
+
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out_close;
+    }
+
+    for (i = 0; i < le32_to_cpu(bhdr.nr_leaves); i++) {
+        if (kernel_read(filp, &rec, sizeof(rec), &pos) != sizeof(rec) ||
+            kernel_read(filp, buf, PAGE_SIZE, &pos) != PAGE_SIZE) {
+            ret = -EIO;
+            break;
+        }
+
+        ret = snap_bitmap_load_leaf(bitmap, le64_to_cpu(rec), buf);
+        if (ret < 0)
+            break;
+    }
+
+    kfree(buf);
+out_close:
+    filp_close(filp, NULL);
+    return ret;
+}
+
+/* -------------------------------------------------------------------
+ * Session mode: reopen the newest snapshot of the device for appending,
+ * if it was closed cleanly with a saved bitmap that still describes it
+ * ------------------------------------------------------------------- */
+static int snap_resume_snapshot(struct snap_device *dev)
+{
+    char (*timestamps)[SNAP_TIMESTAMP_MAX];
+    struct snap_meta_header hdr;
+    struct snap_bitmap_header bhdr;
+    struct file *meta_filp, *data_filp = NULL, *bitmap_filp;
+    loff_t meta_size, data_size, pos = 0;
+    int count = 0;
+    u16 flags;
+    int ret;
+
+    timestamps = kcalloc(MAX_SNAPSHOTS, SNAP_TIMESTAMP_MAX, GFP_KERNEL);
+    if (!timestamps)
+        return -ENOMEM;
+
+    ret = list_snapshots_for_device(dev->dev_name, timestamps, &count);
+    if (ret == 0) {
+        sanitize_devname(dev->dev_name, dev->snapshot_dir, sizeof(dev->snapshot_dir));
+        strlcat(dev->snapshot_dir, "_", sizeof(dev->snapshot_dir));
+        strlcat(dev->snapshot_dir, timestamps[0], sizeof(dev->snapshot_dir));
+    }
+    kfree(timestamps);
+    if (ret < 0)
+        return ret;
+
+    meta_filp = snap_open_store_file(dev, SNAP_META_FILE, O_RDWR);
+    if (IS_ERR(meta_filp))
+        return PTR_ERR(meta_filp);
+
+    meta_size = i_size_read(file_inode(meta_filp));
+    if (meta_size < (loff_t)sizeof(hdr) ||
+        kernel_read(meta_filp, &hdr, sizeof(hdr), &pos) != sizeof(hdr)) {
+        ret = -EIO;
+        goto out_close;
+    }
+
+    /* Open or recovered: the bitmap, if any, was not saved at a clean unmount */
+    flags = le16_to_cpu(hdr.flags);
+    if (le32_to_cpu(hdr.magic) != SNAP_MAGIC || le16_to_cpu(hdr.version) != SNAP_VERSION ||
+        (flags & (SNAP_META_OPEN | SNAP_META_RECOVERED)) ||
+        le64_to_cpu(hdr.block_size) != dev->block_size ||
+        le64_to_cpu(hdr.num_blocks) != dev->num_blocks ||
+        le64_to_cpu(hdr.device_size) != dev->device_size) {
+        ret = -ESTALE;
+        goto out_close;
+    }
+
+    bitmap_filp = snap_open_bitmap(dev, &bhdr, &pos);
+    if (IS_ERR(bitmap_filp)) {
+        ret = PTR_ERR(bitmap_filp);
+        goto out_close;
+    }
+    filp_close(bitmap_filp, NULL);
+
+    data_filp = snap_open_store_file(dev, SNAP_DATA_FILE, O_RDWR);
+    if (IS_ERR(data_filp)) {
+        ret = PTR_ERR(data_filp);
+        data_filp = NULL;
+        goto out_close;
+    }
+
+    /* Anything appended after the bitmap was saved makes it stale */
+    data_size = i_size_read(file_inode(data_filp));
+    if (le64_to_cpu(bhdr.index_size) != meta_size || le64_to_cpu(bhdr.data_size) != data_size) {
+        ret = -ESTALE;
+        goto out_close;
+    }
+
+    dev->meta_filp = meta_filp;
+    dev->data_filp = data_filp;
+    dev->index_tail = meta_size;
+    dev->data_tail = data_size;
+    dev->data_prealloc = data_size;
+    dev->commit_since_ns = 0;
+    dev->last_commit = jiffies;
+    dev->snapshot_time = le64_to_cpu(hdr.timestamp);
+    WRITE_ONCE(dev->incomplete, !!(flags & SNAP_META_INCOMPLETE));
+    WRITE_ONCE(dev->unordered, !!(flags & SNAP_META_UNORDERED));
+
+    ret = snap_write_meta_header(dev, SNAP_META_OPEN);
+    if (ret < 0) {
+        dev->meta_filp = NULL;
+        dev->data_filp = NULL;
+        dev->snapshot_time = dev->mount_time.tv_sec;
+        WRITE_ONCE(dev->incomplete, false);
+        WRITE_ONCE(dev->unordered, false);
+        goto out_close;
+    }
+
+    ret = snap_prealloc_data(dev, dev->data_tail + SNAP_DATA_PREALLOC);
+    if (ret < 0)
+        pr_warn("%s: block log preallocation failed for %s (err=%d)\n",
+                MOD_NAME, dev->dev_name, ret);
+
+    dev->resumed = true;
+    pr_info("%s: resumed snapshot %s for %s\n", MOD_NAME, dev->snapshot_dir, dev->dev_name);
+    return 0;
+
+out_close:
+    if (data_filp)
+        filp_close(data_filp, NULL);
+    filp_close(meta_filp, NULL);
     return ret;
 }
 
 /* -------------------------------------------------------------------
- * Create/open snapshot directory and metadata.json
+ * Create/open snapshot directory, metadata index and block log (caller
+ * holds dev->store_sem exclusively)
  * ------------------------------------------------------------------- */
 int open_snapshot(struct snap_device *dev)
 {
@@ -453,6 +1661,7 @@ int open_snapshot(struct snap_device *dev)
     u64 block_size;
     loff_t dev_size;
     struct file *backing_filp;
+    int ret;
 
     if (!dev)
         return -EINVAL;
@@ -485,6 +1694,21 @@ int open_snapshot(struct snap_device *dev)
     
     filp_close(backing_filp, NULL);
 
+    dev->snapshot_time = dev->mount_time.tv_sec;
+    dev->resumed = false;
+    WRITE_ONCE(dev->incomplete, false);
+    WRITE_ONCE(dev->unordered, false);
+
+    /* Session mode: keep capturing into the last snapshot */
+    if (READ_ONCE(dev->cfg.session)) {
+        ret = snap_resume_snapshot(dev);
+        if (ret == 0)
+            return 0;
+
+        pr_info("%s: no snapshot of %s to resume (err=%d), starting a new one\n",
+                MOD_NAME, dev->dev_name, ret);
+    }
+
     /* Create folder name: <devname>_<timestamp> */
     sanitize_devname(dev->dev_name, dev->snapshot_dir, sizeof(dev->snapshot_dir));
     snapshot_time_to_string(dev->mount_time.tv_sec, tsbuf, sizeof(tsbuf));
@@ -497,19 +1721,41 @@ int open_snapshot(struct snap_device *dev)
         return -EIO;
     }
 
-    /* Initialize metadata.json */
-    return initialize_snapshot(dev, dev->snapshot_dir);
+    /* Initialize the metadata index */
+    ret = initialize_snapshot(dev);
+    if (ret < 0)
+        return ret;
+
+    /* Open the packed block log */
+    ret = open_snapshot_store(dev);
+    if (ret < 0) {
+        filp_close(dev->meta_filp, NULL);
+        dev->meta_filp = NULL;
+    }
+
+    return ret;
 }
 
 /* -------------------------------------------------------------------
- * Close snapshot file
+ * Close snapshot file (caller holds dev->store_sem exclusively)
  * ------------------------------------------------------------------- */
 void close_snapshot(struct snap_device *dev)
 {   
     if (!dev)
         return;
         
+    /* Do not leave a pending group commit behind */
+    snap_group_commit(dev, NULL, true);
+    close_snapshot_store(dev);
     mark_snapshot_closed(dev);
+
+    if (dev->meta_filp && READ_ONCE(dev->cfg.durability) != SNAP_DURABILITY_NONE)
+        snap_sync_file(dev, dev->meta_filp, 0, LLONG_MAX);
+
+    if (dev->meta_filp) {
+        filp_close(dev->meta_filp, NULL);
+        dev->meta_filp = NULL;
+    }
     
     pr_debug("%s: snapshot file closed for %s\n", MOD_NAME, dev->dev_name);
 }
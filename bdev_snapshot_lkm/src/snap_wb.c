@@ -0,0 +1,241 @@
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/topology.h>
+#include <linux/wait.h>
+
+#include "snap_wb.h"
+#include "uapi/bdev_snapshot.h"
+
+/* Global concurrency cap: workers serving all the devices */
+static unsigned int wb_workers;
+module_param(wb_workers, uint, 0444);
+MODULE_PARM_DESC(wb_workers, "Snapshot writeback workers busy at once, shared by all devices (0 = one per CPU, up to 8)");
+
+static unsigned int wb_quantum = 4;
+module_param(wb_quantum, uint, 0644);
+MODULE_PARM_DESC(wb_quantum, "Batches a device may write per turn before yielding to the others");
+
+#define SNAP_WB_WORKERS_DEFAULT_MAX  8
+
+/* The worker of the engine on one CPU */
+struct snap_wb_slot {
+    struct work_struct work;
+    int cpu;
+    bool busy;                  /* queued or running (snap_wb_lock) */
+};
+
+static struct workqueue_struct *snap_wb_wq;
+static struct snap_wb_slot *snap_wb_slots;  /* indexed by CPU */
+static unsigned int snap_wb_nr_slots;       /* busy workers at most */
+static unsigned int snap_wb_active;         /* busy workers */
+
+/* Protects the run queue, the contexts and the slots */
+static DEFINE_SPINLOCK(snap_wb_lock);
+static LIST_HEAD(snap_wb_runq);
+static DECLARE_WAIT_QUEUE_HEAD(snap_wb_idle);
+
+unsigned int snap_wb_quantum(void)
+{
+    return max_t(unsigned int, READ_ONCE(wb_quantum), 1);
+}
+
+unsigned int snap_wb_workers(void)
+{
+    return snap_wb_nr_slots;
+}
+
+/* Whether the jobs of a context may run on 'cpu' (snap_wb_lock held) */
+static bool snap_wb_cpu_allowed(const struct snap_wb_ctx *ctx, int cpu)
+{
+    if (!ctx->cpus || cpumask_test_cpu(cpu, ctx->cpus))
+        return true;
+
+    /* None of its CPUs is online: anywhere rather than never */
+    return !cpumask_intersects(ctx->cpus, cpu_online_mask);
+}
+
+/* Start the worker of an idle allowed CPU for 'ctx', on its node if possible */
+static void snap_wb_wake_locked(struct snap_wb_ctx *ctx)
+{
+    int cpu, pick = -1;
+
+    if (snap_wb_active >= snap_wb_nr_slots)
+        return;
+
+    for_each_online_cpu(cpu) {
+        if (snap_wb_slots[cpu].busy || !snap_wb_cpu_allowed(ctx, cpu))
+            continue;
+        if (pick < 0)
+            pick = cpu;
+        if (cpu_to_node(cpu) == ctx->node) {
+            pick = cpu;
+            break;
+        }
+    }
+
+    /* Otherwise a busy worker of an allowed CPU serves it */
+    if (pick < 0)
+        return;
+
+    snap_wb_slots[pick].busy = true;
+    snap_wb_active++;
+    queue_work_on(pick, snap_wb_wq, &snap_wb_slots[pick].work);
+}
+
+/* Start workers for the waiting contexts, within the concurrency cap */
+static void snap_wb_wake_runq_locked(void)
+{
+    struct snap_wb_ctx *ctx;
+
+    list_for_each_entry(ctx, &snap_wb_runq, run_node) {
+        if (snap_wb_active >= snap_wb_nr_slots)
+            break;
+        snap_wb_wake_locked(ctx);
+    }
+}
+
+bool snap_wb_queue(struct snap_wb_ctx *ctx, struct snap_wb_job *job)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&snap_wb_lock, flags);
+    if (job->pending) {
+        spin_unlock_irqrestore(&snap_wb_lock, flags);
+        return false;
+    }
+
+    job->pending = true;
+    list_add_tail(&job->node, &ctx->jobs);
+
+    if (!ctx->scheduled) {
+        ctx->scheduled = true;
+        ctx->node = numa_node_id();
+        list_add_tail(&ctx->run_node, &snap_wb_runq);
+        snap_wb_wake_locked(ctx);
+    }
+    spin_unlock_irqrestore(&snap_wb_lock, flags);
+
+    return true;
+}
+
+void snap_wb_set_cpus(struct cpumask *cpus, const struct cpumask *new_cpus)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&snap_wb_lock, flags);
+    cpumask_copy(cpus, new_cpus);
+    snap_wb_wake_runq_locked();
+    spin_unlock_irqrestore(&snap_wb_lock, flags);
+}
+
+/* First waiting context allowed on 'cpu' (snap_wb_lock held) */
+static struct snap_wb_ctx *snap_wb_next_ctx(int cpu)
+{
+    struct snap_wb_ctx *ctx;
+
+    list_for_each_entry(ctx, &snap_wb_runq, run_node) {
+        if (snap_wb_cpu_allowed(ctx, cpu))
+            return ctx;
+    }
+    return NULL;
+}
+
+/* -------------------------------------------------------------------
+ * Worker: one job of the first context allowed on its CPU per turn,
+ * until no such context waits
+ * ------------------------------------------------------------------- */
+static void snap_wb_worker(struct work_struct *work)
+{
+    struct snap_wb_slot *slot = container_of(work, struct snap_wb_slot, work);
+    struct snap_wb_ctx *ctx;
+    struct snap_wb_job *job;
+
+    spin_lock_irq(&snap_wb_lock);
+    while ((ctx = snap_wb_next_ctx(slot->cpu)) != NULL) {
+        list_del_init(&ctx->run_node);
+
+        job = list_first_entry(&ctx->jobs, struct snap_wb_job, node);
+        list_del_init(&job->node);
+        job->pending = false;
+        spin_unlock_irq(&snap_wb_lock);
+
+        job->fn(job);
+        cond_resched();
+
+        /* The context stays alive until snap_wb_drain() sees it idle */
+        spin_lock_irq(&snap_wb_lock);
+        if (!list_empty(&ctx->jobs)) {
+            list_add_tail(&ctx->run_node, &snap_wb_runq);
+        } else {
+            ctx->scheduled = false;
+            wake_up_all(&snap_wb_idle);
+        }
+    }
+    slot->busy = false;
+    snap_wb_active--;
+
+    /* What is left may not run here: hand it to workers of its own CPUs */
+    snap_wb_wake_runq_locked();
+    spin_unlock_irq(&snap_wb_lock);
+}
+
+static bool snap_wb_ctx_idle(struct snap_wb_ctx *ctx)
+{
+    bool idle;
+
+    spin_lock_irq(&snap_wb_lock);
+    idle = !ctx->scheduled;
+    spin_unlock_irq(&snap_wb_lock);
+
+    return idle;
+}
+
+void snap_wb_drain(struct snap_wb_ctx *ctx)
+{
+    wait_event(snap_wb_idle, snap_wb_ctx_idle(ctx));
+}
+
+int snap_wb_init(void)
+{
+    int cpu;
+
+    snap_wb_nr_slots = READ_ONCE(wb_workers);
+    if (!snap_wb_nr_slots)
+        snap_wb_nr_slots = min_t(unsigned int, num_online_cpus(), SNAP_WB_WORKERS_DEFAULT_MAX);
+
+    snap_wb_slots = kcalloc(nr_cpu_ids, sizeof(*snap_wb_slots), GFP_KERNEL);
+    if (!snap_wb_slots)
+        return -ENOMEM;
+
+    /*
+     * Per-CPU workers, so that a job runs on the CPU it was given to;
+     * CPU intensive, as checksums and copies are not to hold back the
+     * other work items of that CPU. WQ_MEM_RECLAIM: one rescuer for all
+     * devices.
+     */
+    snap_wb_wq = alloc_workqueue("snap_wb_wq", WQ_MEM_RECLAIM | WQ_CPU_INTENSIVE, 1);
+    if (!snap_wb_wq) {
+        kfree(snap_wb_slots);
+        snap_wb_slots = NULL;
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        INIT_WORK(&snap_wb_slots[cpu].work, snap_wb_worker);
+        snap_wb_slots[cpu].cpu = cpu;
+    }
+
+    pr_debug("%s: up to %u writeback workers\n", MOD_NAME, snap_wb_nr_slots);
+    return 0;
+}
+
+void snap_wb_exit(void)
+{
+    if (snap_wb_wq) {
+        destroy_workqueue(snap_wb_wq);
+        snap_wb_wq = NULL;
+    }
+    kfree(snap_wb_slots);
+    snap_wb_slots = NULL;
+}
@@ -7,6 +7,7 @@
 #include <linux/types.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/uio.h>
 #include <linux/version.h>      /* For LINUX_VERSION_CODE */
 #include <linux/user_namespace.h>
 
@@ -15,6 +16,7 @@
 
 ssize_t onefilefs_read(struct file *, char __user *, size_t, loff_t *); 
 ssize_t onefilefs_write(struct file *, const char __user *, size_t, loff_t *); 
+ssize_t onefilefs_write_iter(struct kiocb *, struct iov_iter *);
 loff_t onefilefs_seek(struct file *, loff_t, int);
 struct dentry *onefilefs_lookup(struct inode *, struct dentry *, unsigned int);
 
@@ -28,7 +30,7 @@ ssize_t onefilefs_read(struct file * filp, char __user * buf, size_t len, loff_t
     uint64_t file_size;
     int ret;
     loff_t offset;
-    int block_to_read;//index of the block to be read from device
+    sector_t block_to_read;//index of the block to be read from device
 
     inode_lock(the_inode);
 
@@ -52,7 +54,7 @@ ssize_t onefilefs_read(struct file * filp, char __user * buf, size_t len, loff_t
     //compute the actual index of the the block to be read from device
     block_to_read = *off / DEFAULT_BLOCK_SIZE + 2; //the value 2 accounts for superblock and file-inode on device
     
-    printk("%s: read operation must access block %d of the device",MOD_NAME, block_to_read);
+    printk("%s: read operation must access block %llu of the device",MOD_NAME, (unsigned long long)block_to_read);
 
     bh = (struct buffer_head *)sb_bread(filp->f_path.dentry->d_inode->i_sb, block_to_read);
     if(!bh){
@@ -78,7 +80,7 @@ ssize_t onefilefs_write(struct file * filp, const char __user * buf, size_t len,
     struct onefilefs_sb_info *sb_disk;
     int ret;
     loff_t offset;
-    int block_to_write;//index of the block to be written from device
+    sector_t block_to_write;//index of the block to be written from device
 
     inode_lock(the_inode);
     file_size = the_inode->i_size;
@@ -118,7 +120,7 @@ ssize_t onefilefs_write(struct file * filp, const char __user * buf, size_t len,
     //compute the actual index of the the block to be read from device
     block_to_write = *off / DEFAULT_BLOCK_SIZE + 2; //the value 2 accounts for superblock and file-inode on device
 
-    printk("%s: write operation must access block %d of the device",MOD_NAME, block_to_write);
+    printk("%s: write operation must access block %llu of the device",MOD_NAME, (unsigned long long)block_to_write);
 
     bh = (struct buffer_head *)sb_bread(filp->f_path.dentry->d_inode->i_sb, block_to_write);
     if(!bh){
@@ -154,6 +156,95 @@ ssize_t onefilefs_write(struct file * filp, const char __user * buf, size_t len,
 
 }
 
+/*
+ * Minimal ->write_iter, for the write paths that need one (AIO, splice,
+ * and the vectored writes that then use it): the whole iterator, one
+ * block at a time, with the same bounds as onefilefs_write()
+ */
+ssize_t onefilefs_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+
+    struct onefilefs_inode *FS_specific_inode;
+    struct buffer_head *bh = NULL;
+    struct inode * the_inode = file_inode(iocb->ki_filp);
+    struct super_block *sb = the_inode->i_sb;
+    struct onefilefs_sb_info *sb_disk;
+    uint64_t max_file_size;
+    loff_t pos = iocb->ki_pos;
+    loff_t offset;
+    size_t len, copied;
+    ssize_t written = 0;
+
+    inode_lock(the_inode);
+
+    bh = sb_bread(sb, SB_BLOCK_NUMBER);
+    if(!bh){
+        inode_unlock(the_inode);
+        return -EIO;
+    }
+    sb_disk = (struct onefilefs_sb_info *)bh->b_data;
+    max_file_size = sb_disk->max_file_size;
+    brelse(bh);
+
+    if(pos > max_file_size){
+        inode_unlock(the_inode);
+        return -(ENOMEM);
+    }
+
+    //check that pos is within boundaries
+    if(pos > the_inode->i_size){
+        inode_unlock(the_inode);
+        return 0;
+    }
+
+    while(iov_iter_count(from) && pos < max_file_size){
+        offset = pos % DEFAULT_BLOCK_SIZE;
+        len = min_t(size_t, iov_iter_count(from), DEFAULT_BLOCK_SIZE - offset);
+        if(pos + len > max_file_size)
+            len = max_file_size - pos;
+
+        //the value 2 accounts for superblock and file-inode on device
+        bh = sb_bread(sb, pos / DEFAULT_BLOCK_SIZE + 2);
+        if(!bh){
+            if(!written)
+                written = -EIO;
+            break;
+        }
+
+        copied = copy_from_iter(bh->b_data + offset, len, from);
+        bh->b_state = bh->b_state | BH_Dirty;
+        write_dirty_buffer(bh, 0);
+        brelse(bh);
+
+        pos += copied;
+        written += copied;
+        if(copied < len){
+            if(!written)
+                written = -EFAULT;
+            break;
+        }
+    }
+
+    if(written > 0){
+        iocb->ki_pos = pos;
+        if(the_inode->i_size < pos){
+            the_inode->i_size = pos;
+            //update file i-node on device
+            bh = sb_bread(sb, SINGLEFILEFS_INODES_BLOCK_NUMBER);
+            if(bh){
+                FS_specific_inode = (struct onefilefs_inode*)bh->b_data;
+                FS_specific_inode->file_size = the_inode->i_size;
+                bh->b_state = bh->b_state | BH_Dirty;
+                write_dirty_buffer(bh, 0);
+                brelse(bh);
+            }
+        }
+    }
+
+    inode_unlock(the_inode);
+    return written;
+
+}
+
 loff_t onefilefs_seek(struct file * filp, loff_t off, int command) {
     struct inode * the_inode = filp->f_inode;
     loff_t ret;  
@@ -245,5 +336,7 @@ const struct file_operations onefilefs_file_operations = {
     .llseek = onefilefs_seek,
     .read = onefilefs_read,
     .write = onefilefs_write,
+    .write_iter = onefilefs_write_iter,
+    .splice_write = iter_file_splice_write,
     //.write = onefilefs_write //please implement this function to complete the exercise
 };
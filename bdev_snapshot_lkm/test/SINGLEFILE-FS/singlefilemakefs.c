@@ -27,8 +27,8 @@ int main(int argc, char *argv[])
 	struct stat stat_buf;
 	char *file_body = "Wathever content you would like.\n";//this is the default content of the unique file 
 
-	if (argc != 2) {
-		printf("Usage: mkfs-singlefilefs <device>\n");
+	if (argc != 2 && argc != 3) {
+		printf("Usage: mkfs-singlefilefs <device> [file-size]\n");
 		return -1;
 	}
 
@@ -63,6 +63,14 @@ int main(int argc, char *argv[])
 	file_inode.mode = S_IFREG;
 	file_inode.inode_no = SINGLEFILEFS_FILE_INODE_NUMBER;
 	file_inode.file_size = strlen(file_body);
+	//optional initial size: the rest of the file reads as zeros (sparse image)
+	if (argc == 3) {
+		file_inode.file_size = strtoull(argv[2], NULL, 10);
+		if (file_inode.file_size < strlen(file_body))
+			file_inode.file_size = strlen(file_body);
+		if (file_inode.file_size > sb.max_file_size)
+			file_inode.file_size = sb.max_file_size;
+	}
 	printf("File size is %ld\n",file_inode.file_size);
 	fflush(stdout);
 	ret = write(fd, (char *)&file_inode, sizeof(file_inode));
@@ -7,8 +7,8 @@
 int main(int argc, char ** argv){
 
 	int fd;
-	long off;
-	int ret;
+	off_t off;
+	ssize_t ret;
 	char * p;
 	int to_write;
 
@@ -24,7 +24,7 @@ int main(int argc, char ** argv){
 	        exit(1);
 	 }  
 
-	off = strtol(argv[3],NULL,10);
+	off = strtoll(argv[3],NULL,10);
 
 	ret = lseek(fd,off,SEEK_SET);
 	if (ret == -1){
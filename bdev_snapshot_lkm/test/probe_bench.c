@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WRITE_SIZE  64              /* bytes per write: the probe cost dominates */
+#define MAX_THREADS 1024
+
+struct bench_thread {
+    pthread_t tid;
+    int fd;
+    uint64_t writes;
+    int err;
+};
+
+static volatile int stop;
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Small writes over and over at the start of the thread's own file */
+static void *bench_writer(void *arg) {
+    struct bench_thread *t = arg;
+    char buf[WRITE_SIZE];
+
+    memset(buf, 0x5a, sizeof(buf));
+    while (!stop) {
+        if (pwrite(t->fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+            t->err = errno;
+            break;
+        }
+        t->writes++;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_thread *threads;
+    char path[4096];
+    uint64_t total = 0;
+    double t0, elapsed;
+    int nr_threads, nr_open = 0, seconds, i, ret = 0;
+
+    if (argc != 4) {
+        printf("Usage: %s <directory> <threads> <seconds>\n", argv[0]);
+        return 1;
+    }
+
+    nr_threads = atoi(argv[2]);
+    seconds = atoi(argv[3]);
+    if (nr_threads < 1 || nr_threads > MAX_THREADS || seconds < 1) {
+        printf("Between 1 and %d threads, for at least 1 second.\n", MAX_THREADS);
+        return 1;
+    }
+
+    threads = calloc(nr_threads, sizeof(*threads));
+    if (!threads) {
+        perror("calloc");
+        return 1;
+    }
+
+    /* One file per thread: the writers only contend in the probes */
+    for (i = 0; i < nr_threads; i++) {
+        snprintf(path, sizeof(path), "%s/probe_bench.%d", argv[1], i);
+        threads[i].fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+        if (threads[i].fd < 0) {
+            perror("Error opening a bench file");
+            ret = 1;
+            goto out;
+        }
+        nr_open++;
+        unlink(path);
+    }
+
+    t0 = now_sec();
+    for (i = 0; i < nr_threads; i++) {
+        if (pthread_create(&threads[i].tid, NULL, bench_writer, &threads[i]) != 0) {
+            fprintf(stderr, "Cannot start writer %d\n", i);
+            stop = 1;
+            nr_threads = i;
+            ret = 1;
+            break;
+        }
+    }
+
+    if (!ret)
+        sleep(seconds);
+    stop = 1;
+
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        total += threads[i].writes;
+        if (threads[i].err) {
+            fprintf(stderr, "Writer %d: %s\n", i, strerror(threads[i].err));
+            ret = 1;
+        }
+    }
+    elapsed = now_sec() - t0;
+
+    if (total) {
+        /* CPU time per write, as all the writers run at once */
+        printf("threads: %d, writes: %llu in %.2f s -> %.0f writes/s, %.0f ns/write per thread\n",
+               nr_threads, (unsigned long long)total, elapsed, total / elapsed,
+               elapsed * nr_threads * 1e9 / total);
+    }
+
+out:
+    for (i = 0; i < nr_open; i++)
+        close(threads[i].fd);
+    free(threads);
+    return ret;
+}
@@ -0,0 +1,98 @@
+#!/bin/bash
+
+# Explanation:
+# Microbenchmark of the per-write cost of the write interception, on
+# writes the host does to a file system that is not snapshotted (tmpfs
+# by default). It runs THREADS writers (default: one per CPU) for
+# SECONDS each time:
+#   - with no snapshot open, when no write probe is registered
+#   - with a snapshot open, for each way of intercepting the writes
+#     (write_fprobe module parameter: kretprobe, fprobes)
+# The difference with the first run is the cost of the probes.
+#
+# Usage:
+#   ./run_bench_probe.sh prepare   create and format the image to mount
+#   ./run_bench_probe.sh run       run the benchmark (root)
+#
+# Between 'prepare' and 'run', activate the snapshot for the image (see
+# README.md): mounting it is what opens a snapshot.
+
+THREADS="${THREADS:-$(nproc)}"
+SECONDS_PER_RUN="${SECONDS_PER_RUN:-5}"
+BENCH_DIR="${BENCH_DIR:-/dev/shm}"          # where the benchmark writes
+
+IMAGE="./SINGLEFILE-FS/probe_image"
+MOUNT_DIR="./SINGLEFILE-FS/mount"
+MAKEFS_PROG="./SINGLEFILE-FS/singlefilemakefs"
+BENCH_PROG="./probe_bench"
+PARAM_DIR="/sys/module/bdev_snapshot/parameters"
+
+do_prepare() {
+    if [ ! -x "$MAKEFS_PROG" ]; then
+        echo "Error: '$MAKEFS_PROG' not found, run 'make' in SINGLEFILE-FS first."
+        exit 1
+    fi
+
+    rm -f "$IMAGE"
+    truncate -s 16M "$IMAGE" || exit 1
+    "$MAKEFS_PROG" "$IMAGE" "$(stat -c %s "$IMAGE")" > /dev/null || exit 1
+    echo "Image $IMAGE ready."
+}
+
+bench() {
+    echo "--- $1 ---"
+    "$BENCH_PROG" "$BENCH_DIR" "$THREADS" "$SECONDS_PER_RUN" || exit 1
+}
+
+do_run() {
+    local image old hook
+
+    if [ ! -x "$BENCH_PROG" ]; then
+        echo "Error: '$BENCH_PROG' not found, run 'make' first."
+        exit 1
+    fi
+    if [ ! -d "$PARAM_DIR" ] || [ "$(id -u)" -ne 0 ]; then
+        echo "Error: the snapshot module is not loaded, or not running as root."
+        exit 1
+    fi
+
+    image=$(realpath "$IMAGE")
+    echo "$(nproc) CPUs, $THREADS writer threads, $SECONDS_PER_RUN s per run, writing to $BENCH_DIR"
+
+    bench "no snapshot open"
+
+    if [ ! -w "$PARAM_DIR/write_fprobe" ]; then
+        echo "The kernel has no fprobes: writes are intercepted by a kretprobe."
+        mount -o loop -t singlefilefs "$image" "$MOUNT_DIR" || exit 1
+        bench "snapshot open, kretprobe"
+        umount "$MOUNT_DIR"
+        return
+    fi
+
+    old=$(cat "$PARAM_DIR/write_fprobe")
+    for hook in N Y; do
+        # Applied when the probes are registered, by the mount
+        echo "$hook" > "$PARAM_DIR/write_fprobe" || exit 1
+        mount -o loop -t singlefilefs "$image" "$MOUNT_DIR" || exit 1
+        sleep 1
+        if [ "$hook" = "Y" ]; then
+            bench "snapshot open, fprobes"
+        else
+            bench "snapshot open, kretprobe"
+        fi
+        umount "$MOUNT_DIR"
+
+        # Snapshot directories are named after the mount time, in seconds
+        sleep 1
+    done
+    echo "$old" > "$PARAM_DIR/write_fprobe"
+}
+
+case "$1" in
+    prepare) do_prepare ;;
+    run)     do_run ;;
+    *)
+        echo "Usage: $0 {prepare|run}"
+        exit 1
+        ;;
+esac
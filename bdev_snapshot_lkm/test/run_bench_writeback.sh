@@ -0,0 +1,85 @@
+#!/bin/bash
+
+# Explanation:
+# Benchmark of the snapshot writeback of a single device, as the number of
+# writeback shards (workers writing the saves of the device in parallel)
+# grows. Each run mounts the image, which opens a new snapshot, writes
+# BENCH_MIB of the unique file in a scattered order, so that the captured
+# blocks spread over all the shards, and reports how fast the flusher
+# saved their pre-images.
+#
+# Usage:
+#   ./run_bench_writeback.sh prepare   create and format the benchmark image
+#   ./run_bench_writeback.sh run       one run per shard count in SHARDS (root)
+#
+# Between 'prepare' and 'run', activate the snapshot for the image (see
+# README.md). wb_workers, a load-time parameter, caps the useful shard count.
+
+BENCH_SIZE="${BENCH_SIZE:-2G}"              # image size
+BENCH_MIB="${BENCH_MIB:-1024}"              # data written per run
+SHARDS="${SHARDS:-1 2 4 8}"                 # shard counts to compare
+
+IMAGE="./SINGLEFILE-FS/bench_image"
+MOUNT_DIR="./SINGLEFILE-FS/mount"
+MAKEFS_PROG="./SINGLEFILE-FS/singlefilemakefs"
+BENCH_PROG="./wb_bench"
+PARAM_DIR="/sys/module/bdev_snapshot/parameters"
+
+do_prepare() {
+    if [ ! -x "$MAKEFS_PROG" ]; then
+        echo "Error: '$MAKEFS_PROG' not found, run 'make' in SINGLEFILE-FS first."
+        exit 1
+    fi
+
+    rm -f "$IMAGE"
+    fallocate -l "$BENCH_SIZE" "$IMAGE" 2>/dev/null || truncate -s "$BENCH_SIZE" "$IMAGE" || exit 1
+
+    # The unique file covers the whole image
+    "$MAKEFS_PROG" "$IMAGE" "$(stat -c %s "$IMAGE")" > /dev/null || exit 1
+    echo "Benchmark image $IMAGE ready ($BENCH_SIZE)."
+}
+
+do_run() {
+    local image shards old
+
+    if [ ! -x "$BENCH_PROG" ]; then
+        echo "Error: '$BENCH_PROG' not found, run 'make' first."
+        exit 1
+    fi
+    if [ ! -w "$PARAM_DIR/wb_shards" ]; then
+        echo "Error: the snapshot module is not loaded, or not running as root."
+        exit 1
+    fi
+
+    image=$(realpath "$IMAGE")
+    old=$(cat "$PARAM_DIR/wb_shards")
+    echo "Writeback workers: $(nproc) CPUs, wb_workers=$(cat "$PARAM_DIR/wb_workers") (0 = one per CPU, up to 8)"
+
+    for shards in $SHARDS; do
+        echo "$shards" > "$PARAM_DIR/wb_shards" || exit 1
+
+        # Start from a cold cache: every pre-image is read from the device
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+
+        mount -o loop -t singlefilefs "$image" "$MOUNT_DIR" || exit 1
+        echo "--- $shards shard(s) ---"
+        "$BENCH_PROG" "$image" "$MOUNT_DIR/the-file" "$BENCH_MIB"
+        umount "$MOUNT_DIR"
+
+        # Snapshot directories are named after the mount time, in seconds
+        sleep 1
+    done
+
+    echo "$old" > "$PARAM_DIR/wb_shards"
+    echo "Each run left a snapshot of about $BENCH_MIB MiB under /snapshot."
+}
+
+case "$1" in
+    prepare) do_prepare ;;
+    run)     do_run ;;
+    *)
+        echo "Usage: $0 {prepare|run}"
+        exit 1
+        ;;
+esac
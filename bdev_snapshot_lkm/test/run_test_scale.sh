@@ -0,0 +1,114 @@
+#!/bin/bash
+
+# Explanation:
+# The purpose of this test is to verify capture and restore of blocks whose
+# number does not fit in 32 bits. The device-file is a sparse image larger
+# than 2^31 blocks of 4 KiB (8 TiB); its unique file spans the whole image,
+# so that writes can land anywhere on it without allocating the blocks in
+# between. Only the written blocks are compared, never the whole image.
+#
+# Usage:
+#   ./run_test_scale.sh prepare   create and format the sparse image, save a reference copy
+#   ./run_test_scale.sh write     modify the test blocks through the mounted file system
+#   ./run_test_scale.sh check     compare the test blocks with the reference copy
+#
+# Between 'prepare' and 'write', activate the snapshot for the image and mount
+# it (see README.md); between 'write' and the last 'check', unmount and restore.
+
+BLOCK_SIZE=4096
+RESERVED_BLOCKS=2                           # superblock and file inode
+
+# Image size: at least 9 TiB, more than 16 TiB also covers blocks past 2^32
+SCALE_SIZE="${SCALE_SIZE:-9T}"
+
+IMAGE="./SINGLEFILE-FS/scale_image"
+ORIGINAL_FILE="./original_image/scale_image"
+MOUNT_DIR="./SINGLEFILE-FS/mount"
+MAKEFS_PROG="./SINGLEFILE-FS/singlefilemakefs"
+WRITE_PROG="./SINGLEFILE-FS/user/user"
+
+# Device blocks written by the test: low, past 2^31, past 2^32
+TEST_BLOCKS="2 $(( (1 << 31) + 5 )) $(( (1 << 32) + 7 ))"
+
+image_blocks() {
+    echo $(( $(stat -c %s "$1") / BLOCK_SIZE ))
+}
+
+do_prepare() {
+    if [ ! -x "$MAKEFS_PROG" ]; then
+        echo "Error: '$MAKEFS_PROG' not found, run 'make' in SINGLEFILE-FS first."
+        exit 1
+    fi
+
+    rm -f "$IMAGE"
+    truncate -s "$SCALE_SIZE" "$IMAGE" || exit 1
+
+    # The unique file covers the whole image
+    "$MAKEFS_PROG" "$IMAGE" "$(stat -c %s "$IMAGE")" > /dev/null || exit 1
+
+    cp --sparse=always "$IMAGE" "$ORIGINAL_FILE" || exit 1
+    echo "Sparse image $IMAGE ready ($(image_blocks "$IMAGE") blocks)."
+}
+
+do_write() {
+    local blocks block off
+
+    if [ ! -f "$MOUNT_DIR/the-file" ]; then
+        echo "Error: the image is not mounted on '$MOUNT_DIR'."
+        exit 1
+    fi
+
+    blocks=$(image_blocks "$IMAGE")
+    for block in $TEST_BLOCKS; do
+        if [ "$block" -ge "$blocks" ]; then
+            echo "Block $block: beyond the image, skipped."
+            continue
+        fi
+
+        off=$(( (block - RESERVED_BLOCKS) * BLOCK_SIZE ))
+        "$WRITE_PROG" "$MOUNT_DIR/the-file" "Block $block has been modified!" "$off" || exit 1
+        echo "Block $block: modified."
+    done
+}
+
+do_check() {
+    local blocks block off failed=0
+
+    if [ ! -f "$IMAGE" ] || [ ! -f "$ORIGINAL_FILE" ]; then
+        echo "Error: run '$0 prepare' first."
+        exit 1
+    fi
+
+    echo "Comparing test blocks..."
+    blocks=$(image_blocks "$IMAGE")
+    for block in $TEST_BLOCKS; do
+        if [ "$block" -ge "$blocks" ]; then
+            continue
+        fi
+
+        off=$(( block * BLOCK_SIZE ))
+        if cmp -s -n "$BLOCK_SIZE" -i "$off:$off" "$ORIGINAL_FILE" "$IMAGE"; then
+            echo "Block $block: identical."
+        else
+            echo "Block $block: different."
+            failed=1
+        fi
+    done
+
+    if [ "$failed" -eq 0 ]; then
+        echo "All test blocks match the original image."
+    else
+        echo "Some test blocks differ from the original image."
+    fi
+    return $failed
+}
+
+case "$1" in
+    prepare) do_prepare ;;
+    write)   do_write ;;
+    check)   do_check ;;
+    *)
+        echo "Usage: $0 {prepare|write|check}"
+        exit 1
+        ;;
+esac
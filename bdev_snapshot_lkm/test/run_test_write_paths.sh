@@ -0,0 +1,129 @@
+#!/bin/bash
+
+# Explanation:
+# The purpose of this test is to verify that writes are captured whatever
+# system call they come through, not only write(2). Each write path of
+# the matrix modifies its own range of blocks of the unique file:
+#   pwrite     vfs_write()
+#   pwritev    vectored write, segment by segment for SINGLEFILE-FS
+#   io_uring   IORING_OP_WRITE
+#   aio        native AIO (io_submit)
+#   splice     from a pipe
+# The test build of SINGLEFILE-FS implements ->write_iter and
+# ->splice_write, so that aio and splice reach the file system; they are
+# only skipped on a kernel without them. After the restore, every range
+# the paths wrote and the whole image must be identical to the reference
+# copy; the range of a skipped path is not checked, and says so.
+#
+# Usage:
+#   ./run_test_write_paths.sh prepare   create and format the image, save a reference copy
+#   ./run_test_write_paths.sh write     write through each path on the mounted file system
+#   ./run_test_write_paths.sh check     compare each range, then the image, with the reference
+#
+# Between 'prepare' and 'write', activate the snapshot for the image and mount
+# it (see README.md); between 'write' and the last 'check', unmount and restore.
+
+BLOCK_SIZE=4096
+RESERVED_BLOCKS=2                           # superblock and file inode
+RANGE_BLOCKS=4                              # blocks written by each path
+
+PATHS="pwrite pwritev io_uring aio splice"
+
+IMAGE="./SINGLEFILE-FS/paths_image"
+ORIGINAL_FILE="./original_image/paths_image"
+MOUNT_DIR="./SINGLEFILE-FS/mount"
+MAKEFS_PROG="./SINGLEFILE-FS/singlefilemakefs"
+WRITE_PROG="./write_paths"
+WRITTEN_LIST="./SINGLEFILE-FS/paths_written"    # paths that wrote, for 'check'
+
+# Offset in the unique file of the range of the path number $1
+range_offset() {
+    echo $(( ($1 + 1) * RANGE_BLOCKS * BLOCK_SIZE ))
+}
+
+do_prepare() {
+    if [ ! -x "$MAKEFS_PROG" ]; then
+        echo "Error: '$MAKEFS_PROG' not found, run 'make' in SINGLEFILE-FS first."
+        exit 1
+    fi
+
+    rm -f "$IMAGE"
+    truncate -s 16M "$IMAGE" || exit 1
+
+    # The unique file covers the whole image
+    "$MAKEFS_PROG" "$IMAGE" "$(stat -c %s "$IMAGE")" > /dev/null || exit 1
+
+    cp "$IMAGE" "$ORIGINAL_FILE" || exit 1
+    echo "Image $IMAGE ready."
+}
+
+do_write() {
+    local i=0 path off ret failed=0
+
+    if [ ! -x "$WRITE_PROG" ]; then
+        echo "Error: '$WRITE_PROG' not found, run 'make' first."
+        exit 1
+    fi
+    if [ ! -f "$MOUNT_DIR/the-file" ]; then
+        echo "Error: the image is not mounted on '$MOUNT_DIR'."
+        exit 1
+    fi
+
+    : > "$WRITTEN_LIST" || exit 1
+    for path in $PATHS; do
+        off=$(range_offset $i)
+        "$WRITE_PROG" "$path" "$MOUNT_DIR/the-file" "$off" $(( RANGE_BLOCKS * BLOCK_SIZE )) $(( 0x41 + i ))
+        ret=$?
+        if [ "$ret" -eq 0 ]; then
+            echo "$path" >> "$WRITTEN_LIST"
+        elif [ "$ret" -eq 2 ]; then
+            echo "$path: skipped."
+        else
+            failed=1
+        fi
+        i=$(( i + 1 ))
+    done
+
+    return $failed
+}
+
+do_check() {
+    local i=0 path off failed=0
+
+    if [ ! -f "$IMAGE" ] || [ ! -f "$ORIGINAL_FILE" ]; then
+        echo "Error: run '$0 prepare' first."
+        exit 1
+    fi
+
+    echo "Comparing the range of each write path..."
+    for path in $PATHS; do
+        off=$(( $(range_offset $i) + RESERVED_BLOCKS * BLOCK_SIZE ))
+        if ! grep -qx "$path" "$WRITTEN_LIST" 2>/dev/null; then
+            echo "$path: not written, not checked."
+        elif cmp -s -n $(( RANGE_BLOCKS * BLOCK_SIZE )) -i "$off:$off" "$ORIGINAL_FILE" "$IMAGE"; then
+            echo "$path: identical."
+        else
+            echo "$path: different."
+            failed=1
+        fi
+        i=$(( i + 1 ))
+    done
+
+    if cmp -s "$ORIGINAL_FILE" "$IMAGE"; then
+        echo "The image is identical to the original image."
+    else
+        echo "The image differs from the original image."
+        failed=1
+    fi
+    return $failed
+}
+
+case "$1" in
+    prepare) do_prepare ;;
+    write)   do_write ;;
+    check)   do_check ;;
+    *)
+        echo "Usage: $0 {prepare|write|check}"
+        exit 1
+        ;;
+esac
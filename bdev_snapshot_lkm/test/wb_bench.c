@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uapi/bdev_snapshot.h"
+
+#define CHUNK_SIZE  (64 * 1024)     /* bytes per write: 16 blocks of 4 KiB */
+#define POLL_US     1000
+#define POLL_MAX_S  120             /* give up waiting for the flusher after this */
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_stats(int fd, const char *dev_name, struct snap_dev_stats *st) {
+    struct snap_stats_args args;
+
+    memset(&args, 0, sizeof(args));
+    snprintf(args.dev_name, sizeof(args.dev_name), "%s", dev_name);
+    if (ioctl(fd, SNAP_STATS, &args) < 0)
+        return -1;
+
+    *st = args.stats;
+    return 0;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t t = a % b;
+
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Captured blocks not yet written (or dropped) by the flusher */
+static uint64_t blocks_in_flight(const struct snap_dev_stats *st, const struct snap_dev_stats *base) {
+    uint64_t claimed = (st->capture_hits - base->capture_hits) +
+                       (st->deferred_done - base->deferred_done);
+    uint64_t done = (st->flushed_blocks - base->flushed_blocks) +
+                    (st->pool_exhausted - base->pool_exhausted);
+
+    return claimed > done ? claimed - done : 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct snap_dev_stats base, st;
+    uint64_t nr_chunks, i, k, step;
+    double t0, t_write, t_done;
+    char *buf;
+    int ctl, fd;
+
+    if (argc != 4) {
+        printf("Usage: %s <device-file> <file-on-device> <MiB>\n", argv[0]);
+        return 1;
+    }
+
+    nr_chunks = strtoull(argv[3], NULL, 10) * 1024 * 1024 / CHUNK_SIZE;
+    if (nr_chunks == 0) {
+        printf("Nothing to write.\n");
+        return 1;
+    }
+
+    ctl = open(SNAP_DEVICE_PATH, O_RDONLY);
+    if (ctl < 0) {
+        perror("Error opening " SNAP_DEVICE_PATH);
+        return 1;
+    }
+
+    fd = open(argv[2], O_WRONLY);
+    if (fd < 0) {
+        perror("Error opening the file on the device");
+        close(ctl);
+        return 1;
+    }
+
+    buf = malloc(CHUNK_SIZE);
+    if (!buf) {
+        perror("malloc");
+        close(fd);
+        close(ctl);
+        return 1;
+    }
+    memset(buf, 0x5a, CHUNK_SIZE);
+
+    if (read_stats(ctl, argv[1], &base) < 0) {
+        fprintf(stderr, "Unable to read statistics of %s: %s\n", argv[1], strerror(errno));
+        goto fail;
+    }
+
+    /*
+     * Visit every chunk once, in a scattered order (a step coprime with
+     * the number of chunks), so that consecutive writes land in different
+     * block ranges, hence in different shards
+     */
+    step = nr_chunks / 2 + 1;
+    while (gcd(step, nr_chunks) != 1)
+        step++;
+
+    t0 = now_sec();
+    for (i = 0, k = 0; i < nr_chunks; i++, k = (k + step) % nr_chunks) {
+        if (pwrite(fd, buf, CHUNK_SIZE, (off_t)k * CHUNK_SIZE) != CHUNK_SIZE) {
+            perror("Error writing the file");
+            goto fail;
+        }
+    }
+    t_write = now_sec();
+
+    /* Wait until the flusher has saved everything the writes captured */
+    do {
+        if (read_stats(ctl, argv[1], &st) < 0) {
+            fprintf(stderr, "Unable to read statistics of %s: %s\n", argv[1], strerror(errno));
+            goto fail;
+        }
+        if (st.queue_depth == 0 && blocks_in_flight(&st, &base) == 0)
+            break;
+        if (now_sec() - t_write > POLL_MAX_S) {
+            fprintf(stderr, "%llu captured blocks were never saved (see the kernel log)\n",
+                    (unsigned long long)blocks_in_flight(&st, &base));
+            goto fail;
+        }
+        usleep(POLL_US);
+    } while (1);
+    t_done = now_sec();
+
+    printf("written: %llu MiB in %.3f s\n",
+           (unsigned long long)(nr_chunks * CHUNK_SIZE >> 20), t_write - t0);
+    printf("saved:   %llu blocks, %.1f MiB in %.3f s -> %.1f MiB/s\n",
+           (unsigned long long)(st.flushed_blocks - base.flushed_blocks),
+           (st.flushed_bytes - base.flushed_bytes) / 1048576.0, t_done - t0,
+           (st.flushed_bytes - base.flushed_bytes) / 1048576.0 / (t_done - t0));
+    printf("batches: %llu, flusher time %.3f s, dropped %llu\n",
+           (unsigned long long)(st.flush_batches - base.flush_batches),
+           (st.flush_ns - base.flush_ns) / 1e9,
+           (unsigned long long)(st.pool_exhausted - base.pool_exhausted));
+
+    free(buf);
+    close(fd);
+    close(ctl);
+    return 0;
+
+fail:
+    free(buf);
+    close(fd);
+    close(ctl);
+    return 1;
+}
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define FS_BLOCK_SIZE  4096        /* SINGLEFILE-FS block */
+
+/* Exit status when the kernel does not offer the path (aio and splice only) */
+#define EXIT_UNSUPPORTED  2
+
+/*
+ * Each path writes at most 'len' bytes of 'buf' at 'off' and returns the
+ * bytes written, or -errno. SINGLEFILE-FS writes at most one block per
+ * call: the caller writes the rest.
+ */
+typedef ssize_t (*write_path_fn)(int fd, const char *buf, size_t len, off_t off);
+
+static ssize_t path_pwrite(int fd, const char *buf, size_t len, off_t off) {
+    ssize_t ret = pwrite(fd, buf, len, off);
+
+    return ret < 0 ? -errno : ret;
+}
+
+/* One segment per block, as vectored writes are split by segment for SINGLEFILE-FS */
+static ssize_t path_pwritev(int fd, const char *buf, size_t len, off_t off) {
+    struct iovec iov[16];
+    int nr = 0;
+    ssize_t ret;
+
+    while (len && nr < 16) {
+        iov[nr].iov_base = (void *)buf;
+        iov[nr].iov_len = len < FS_BLOCK_SIZE ? len : FS_BLOCK_SIZE;
+        buf += iov[nr].iov_len;
+        len -= iov[nr].iov_len;
+        nr++;
+    }
+
+    ret = pwritev(fd, iov, nr, off);
+    return ret < 0 ? -errno : ret;
+}
+
+/* One IORING_OP_WRITE on a ring of its own */
+static ssize_t path_io_uring(int fd, const char *buf, size_t len, off_t off) {
+    struct io_uring_params p;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqe;
+    size_t sq_size, cq_size;
+    unsigned int *sq_tail, *sq_array, *cq_head;
+    void *sq, *cq;
+    ssize_t ret;
+    int ring;
+
+    memset(&p, 0, sizeof(p));
+    ring = syscall(__NR_io_uring_setup, 1, &p);
+    if (ring < 0)
+        return -errno;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, p.sq_entries * sizeof(*sqes), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    memset(&sqes[0], 0, sizeof(sqes[0]));
+    sqes[0].opcode = IORING_OP_WRITE;
+    sqes[0].fd = fd;
+    sqes[0].addr = (uintptr_t)buf;
+    sqes[0].len = len;
+    sqes[0].off = off;
+
+    sq_tail = (unsigned int *)((char *)sq + p.sq_off.tail);
+    sq_array = (unsigned int *)((char *)sq + p.sq_off.array);
+    sq_array[*sq_tail & *(unsigned int *)((char *)sq + p.sq_off.ring_mask)] = 0;
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, ring, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    cq_head = (unsigned int *)((char *)cq + p.cq_off.head);
+    cqe = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes) +
+          (*cq_head & *(unsigned int *)((char *)cq + p.cq_off.ring_mask));
+    ret = cqe->res;
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+
+out:
+    if (sqes != MAP_FAILED)
+        munmap(sqes, p.sq_entries * sizeof(*sqes));
+    if (cq != MAP_FAILED)
+        munmap(cq, cq_size);
+    if (sq != MAP_FAILED)
+        munmap(sq, sq_size);
+    close(ring);
+    return ret;
+}
+
+/* One IOCB_CMD_PWRITE of the native AIO interface */
+static ssize_t path_aio(int fd, const char *buf, size_t len, off_t off) {
+    aio_context_t ctx = 0;
+    struct iocb cb, *cbs[1] = { &cb };
+    struct io_event ev;
+    ssize_t ret;
+
+    if (syscall(__NR_io_setup, 1, &ctx) < 0)
+        return -errno;
+
+    memset(&cb, 0, sizeof(cb));
+    cb.aio_fildes = fd;
+    cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+    cb.aio_buf = (uintptr_t)buf;
+    cb.aio_nbytes = len;
+    cb.aio_offset = off;
+
+    if (syscall(__NR_io_submit, ctx, 1, cbs) != 1)
+        ret = -errno;
+    else if (syscall(__NR_io_getevents, ctx, 1, 1, &ev, NULL) != 1)
+        ret = -errno;
+    else
+        ret = ev.res;
+
+    syscall(__NR_io_destroy, ctx);
+    return ret;
+}
+
+/* From a pipe, one block at most at a time */
+static ssize_t path_splice(int fd, const char *buf, size_t len, off_t off) {
+    loff_t pos = off;
+    ssize_t ret;
+    int pipefd[2];
+
+    if (len > FS_BLOCK_SIZE)
+        len = FS_BLOCK_SIZE;
+    if (pipe(pipefd) < 0)
+        return -errno;
+
+    if (write(pipefd[1], buf, len) != (ssize_t)len) {
+        ret = -EIO;
+    } else {
+        ret = splice(pipefd[0], NULL, fd, &pos, len, 0);
+        if (ret < 0)
+            ret = -errno;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return ret;
+}
+
+/*
+ * Only AIO (CONFIG_AIO) and splice may be missing from a kernel or a file
+ * system: any error of the others is a failure
+ */
+static const struct {
+    const char *name;
+    write_path_fn fn;
+    int may_skip;
+} paths[] = {
+    { "pwrite",   path_pwrite,   0 },
+    { "pwritev",  path_pwritev,  0 },
+    { "io_uring", path_io_uring, 0 },
+    { "aio",      path_aio,      1 },
+    { "splice",   path_splice,   1 },
+};
+
+int main(int argc, char *argv[]) {
+    write_path_fn fn = NULL;
+    int may_skip = 0;
+    size_t len, done = 0;
+    off_t off;
+    ssize_t ret;
+    char *buf;
+    unsigned int i;
+    int fd;
+
+    if (argc != 6) {
+        printf("Usage: %s <path> <file> <offset> <length> <byte>\n", argv[0]);
+        printf("Paths:");
+        for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+            printf(" %s", paths[i].name);
+        printf("\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        if (strcmp(argv[1], paths[i].name) == 0) {
+            fn = paths[i].fn;
+            may_skip = paths[i].may_skip;
+        }
+    }
+    if (!fn) {
+        fprintf(stderr, "Unknown write path '%s'\n", argv[1]);
+        return 1;
+    }
+
+    off = strtoll(argv[3], NULL, 0);
+    len = strtoull(argv[4], NULL, 0);
+    buf = malloc(len ? len : 1);
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    memset(buf, (int)strtol(argv[5], NULL, 0), len);
+
+    fd = open(argv[2], O_WRONLY);
+    if (fd < 0) {
+        perror("Error opening the file");
+        free(buf);
+        return 1;
+    }
+
+    while (done < len) {
+        ret = fn(fd, buf + done, len - done, off + done);
+        if (may_skip && done == 0 && (ret == -EINVAL || ret == -EOPNOTSUPP || ret == -ENOSYS)) {
+            printf("%s: not supported here (%s)\n", argv[1], strerror(-ret));
+            close(fd);
+            free(buf);
+            return EXIT_UNSUPPORTED;
+        }
+        if (ret <= 0) {
+            fprintf(stderr, "%s: write failed at offset %lld: %s\n", argv[1],
+                    (long long)(off + done), ret < 0 ? strerror(-ret) : "nothing written");
+            close(fd);
+            free(buf);
+            return 1;
+        }
+        done += ret;
+    }
+
+    printf("%s: %zu bytes written at offset %lld\n", argv[1], done, (long long)off);
+    close(fd);
+    free(buf);
+    return 0;
+}
@@ -364,6 +364,322 @@ static void do_restore_snapshot(int fd)
     secure_memzero(password, sizeof(password));
 }
 
+/* --- Percentage helper for the statistics report --- */
+static double pct(unsigned long long part, unsigned long long total)
+{
+    return total ? (100.0 * (double)part / (double)total) : 0.0;
+}
+
+/* --- Print the non-empty buckets of the latency histograms --- */
+static void print_latency_histograms(const struct snap_dev_stats *st)
+{
+    printf("\nWrite latency          first touch    steady state   held (ordered)\n");
+
+    for (int i = 0; i < SNAP_LAT_BUCKETS; i++) {
+        char label[32];
+
+        if (!st->lat_first_write[i] && !st->lat_steady_write[i] && !st->lat_hold[i])
+            continue;
+
+        if (i == 0)
+            snprintf(label, sizeof(label), "< 1 us");
+        else if (i == SNAP_LAT_BUCKETS - 1)
+            snprintf(label, sizeof(label), ">= %llu us", 1ULL << (i - 1));
+        else
+            snprintf(label, sizeof(label), "%llu-%llu us", 1ULL << (i - 1), 1ULL << i);
+
+        printf("  %-20s %12llu   %12llu   %12llu\n", label,
+               (unsigned long long)st->lat_first_write[i],
+               (unsigned long long)st->lat_steady_write[i],
+               (unsigned long long)st->lat_hold[i]);
+    }
+}
+
+/* --- Show device statistics --- */
+static void do_show_stats(int fd)
+{
+    struct snap_stats_args args;
+    memset(&args, 0, sizeof(args));
+
+    char dev[DEV_NAME_LEN_MAX];
+    if (get_valid_dev_name(dev, sizeof(dev)) != 0)
+        return;
+    snprintf(args.dev_name, sizeof(args.dev_name), "%s", dev);
+
+    errno = 0;
+    if (ioctl(fd, SNAP_STATS, &args) < 0) {
+        if (errno == ENOENT) {
+            printf("Snapshot is not active for this device.\n");
+        } else {
+            fprintf(stderr, "Unable to read statistics: %s\n", strerror(errno));
+
+            PRINT_FOR_MORE_INFO_MSG;
+        }
+        return;
+    }
+
+    const struct snap_dev_stats *st = &args.stats;
+    unsigned long long captures = st->capture_hits + st->capture_deferred;
+
+    printf("\nCapture\n");
+    printf("  buffer cache hits:   %llu (%.1f%%)\n",
+           (unsigned long long)st->capture_hits, pct(st->capture_hits, captures));
+    printf("  deferred captures:   %llu (%.1f%%)\n",
+           (unsigned long long)st->capture_deferred, pct(st->capture_deferred, captures));
+    printf("  deferred completed:  %llu\n", (unsigned long long)st->deferred_done);
+    printf("  captures dropped:    %llu\n", (unsigned long long)st->pool_exhausted);
+    printf("  saved bitmap:        %llu KiB\n", (unsigned long long)(st->bitmap_bytes >> 10));
+    printf("  capture memory:      %llu KiB (%llu captures over budget, %llu writes held)\n",
+           (unsigned long long)(st->mem_bytes >> 10), (unsigned long long)st->mem_overloads,
+           (unsigned long long)st->mem_holds);
+    printf("  spilled blocks:      %llu\n", (unsigned long long)st->spilled_blocks);
+
+    printf("\nFlusher\n");
+    printf("  queue depth:         %u\n", st->queue_depth);
+    printf("  batches written:     %llu\n", (unsigned long long)st->flush_batches);
+    printf("  blocks written:      %llu (%.1f per batch)\n",
+           (unsigned long long)st->flushed_blocks,
+           st->flush_batches ? (double)st->flushed_blocks / (double)st->flush_batches : 0.0);
+    printf("  extents written:     %llu (%.1f blocks per extent)\n",
+           (unsigned long long)st->flushed_extents,
+           st->flushed_extents ? (double)st->flushed_blocks / (double)st->flushed_extents : 0.0);
+    printf("  throughput:          %.1f MiB/s while flushing\n",
+           st->flush_ns ? ((double)st->flushed_bytes / (1 << 20)) / ((double)st->flush_ns / 1e9)
+                        : 0.0);
+    printf("  throttled:           %.1f ms waiting for the I/O caps\n",
+           (double)st->throttled_ns / 1e6);
+
+    printf("\nDurability\n");
+    printf("  fdatasync calls:     %llu (avg %.1f us)\n", (unsigned long long)st->syncs,
+           st->syncs ? (double)st->sync_ns / (double)st->syncs / 1e3 : 0.0);
+    printf("  capture to stored:   avg %.1f us, max %.1f us over %llu commits\n",
+           st->persisted ? (double)st->persist_lat_ns / (double)st->persisted / 1e3 : 0.0,
+           (double)st->persist_lat_max_ns / 1e3, (unsigned long long)st->persisted);
+    printf("  ordered holds:       %llu (%llu not held, buffer busy)\n",
+           (unsigned long long)st->ordered_holds, (unsigned long long)st->ordered_misses);
+
+    printf("\nMissed probe hits (all devices)\n");
+    printf("  mount / unmount:     %llu / %llu\n",
+           (unsigned long long)st->probe_missed[SNAP_PROBE_MOUNT],
+           (unsigned long long)st->probe_missed[SNAP_PROBE_UNMOUNT]);
+    printf("  write / block read:  %llu / %llu (%llu latency samples lost)\n",
+           (unsigned long long)st->probe_missed[SNAP_PROBE_WRITE],
+           (unsigned long long)st->probe_missed[SNAP_PROBE_BREAD],
+           (unsigned long long)st->probe_missed[SNAP_PROBE_WRITE_LAT]);
+
+    print_latency_histograms(st);
+    if (st->incomplete)
+        printf("  WARNING: the current snapshot is incomplete (blocks were dropped or missed)\n");
+}
+
+/* --- Read an optional unsigned value: SNAP_CFG_KEEP when left empty --- */
+static int read_u32(const char *prompt, unsigned int min, unsigned int max, __u32 *out)
+{
+    char buf[32];
+
+    for (;;) {
+        printf("%s", prompt);
+        if (!fgets(buf, sizeof(buf), stdin)) {
+            clearerr(stdin);
+            return -1;
+        }
+
+        if (!strchr(buf, '\n'))
+            flush_stdin();
+
+        buf[strcspn(buf, "\n")] = 0;
+
+        if (buf[0] == '\0') {
+            *out = SNAP_CFG_KEEP;
+            return 0;
+        }
+
+        char *end;
+        unsigned long val = strtoul(buf, &end, 10);
+        if (end != buf && *end == '\0' && val >= min && val <= max) {
+            *out = (__u32)val;
+            return 0;
+        }
+
+        printf("Invalid input. Please enter a number between %u and %u.\n", min, max);
+    }
+}
+
+/* --- Read an optional CPU list ("0-3,8" or "all"): empty when left empty --- */
+static int read_cpulist(const char *prompt, char *out, size_t size)
+{
+    char buf[SNAP_CPULIST_MAX];
+
+    for (;;) {
+        printf("%s", prompt);
+        if (!fgets(buf, sizeof(buf), stdin)) {
+            clearerr(stdin);
+            return -1;
+        }
+
+        if (!strchr(buf, '\n'))
+            flush_stdin();
+
+        buf[strcspn(buf, "\n")] = 0;
+
+        if (buf[0] == '\0' || strcmp(buf, "all") == 0 ||
+            strspn(buf, "0123456789,-") == strlen(buf)) {
+            snprintf(out, size, "%s", buf);
+            return 0;
+        }
+
+        printf("Invalid input. Please enter a CPU list such as 0-3,8, or 'all'.\n");
+    }
+}
+
+/* --- Read an optional cgroup path ("/" for none): empty when left empty --- */
+static int read_cgroup(const char *prompt, char *out, size_t size)
+{
+    char buf[SNAP_CGROUP_PATH_MAX];
+
+    for (;;) {
+        printf("%s", prompt);
+        if (!fgets(buf, sizeof(buf), stdin)) {
+            clearerr(stdin);
+            return -1;
+        }
+
+        if (!strchr(buf, '\n'))
+            flush_stdin();
+
+        buf[strcspn(buf, "\n")] = 0;
+
+        if (buf[0] == '\0' || buf[0] == '/') {
+            snprintf(out, size, "%s", buf);
+            return 0;
+        }
+
+        printf("Invalid input. Please enter an absolute path such as /snapshot.slice, or '/'.\n");
+    }
+}
+
+static const char *ioprio_class_name(__u32 class)
+{
+    switch (class) {
+    case 1:  return "realtime";
+    case 2:  return "best effort";
+    case 3:  return "idle";
+    default: return "inherited";
+    }
+}
+
+/* --- Configure an activated device --- */
+static void do_config(int fd)
+{
+    struct snap_config_args args;
+    memset(&args, 0, sizeof(args));
+
+    char dev[DEV_NAME_LEN_MAX];
+    if (get_valid_dev_name(dev, sizeof(dev)) != 0)
+        return;
+    snprintf(args.dev_name, sizeof(args.dev_name), "%s", dev);
+
+    printf("Leave a value empty to keep the current setting.\n");
+    if (read_u32("Flush batch size in blocks: ", 1, SNAP_FLUSH_BATCH_MAX,
+                 &args.config.flush_batch) < 0)
+        return;
+    if (read_u32("Flush latency in microseconds: ", 0, SNAP_FLUSH_LATENCY_MAX_US,
+                 &args.config.flush_latency_us) < 0)
+        return;
+    if (read_u32("Durability (0 = none, 1 = group commit, 2 = strict): ", 0,
+                 SNAP_DURABILITY_MAX - 1, &args.config.durability) < 0)
+        return;
+    if (read_u32("Group commit interval in ms (0 = every batch): ", 0,
+                 SNAP_COMMIT_INTERVAL_MAX_MS, &args.config.commit_interval_ms) < 0)
+        return;
+    if (read_u32("Ordered COW, first writes wait for their pre-image (0/1): ", 0, 1,
+                 &args.config.ordered) < 0)
+        return;
+    if (read_u32("Session mode, remounts resume the last snapshot (0/1): ", 0, 1,
+                 &args.config.session) < 0)
+        return;
+    if (read_cpulist("CPUs for the snapshot writeback (e.g. 0-3,8, or 'all'): ",
+                     args.config.flush_cpus, sizeof(args.config.flush_cpus)) < 0)
+        return;
+    if (read_u32("I/O priority class (0 = inherited, 1 = realtime, 2 = best effort, 3 = idle): ",
+                 0, 3, &args.config.ioprio_class) < 0)
+        return;
+    if (read_u32("I/O priority level (0 = highest .. 7): ", 0, 7,
+                 &args.config.ioprio_level) < 0)
+        return;
+    if (read_u32("Bandwidth cap in KiB/s (0 = none): ", 0, SNAP_CFG_KEEP - 1,
+                 &args.config.max_kbps) < 0)
+        return;
+    if (read_u32("I/O rate cap in IOPS (0 = none): ", 0, SNAP_CFG_KEEP - 1,
+                 &args.config.max_iops) < 0)
+        return;
+    if (read_cgroup("Cgroup charged with the snapshot I/O (e.g. /snapshot.slice, or '/'): ",
+                    args.config.cgroup, sizeof(args.config.cgroup)) < 0)
+        return;
+    if (read_u32("Over the memory budget (0 = drop, incomplete snapshot, 1 = throttle writes, "
+                 "2 = spill to disk): ", 0, SNAP_OVERLOAD_MAX - 1, &args.config.overload) < 0)
+        return;
+    if (read_u32("Capture memory budget in KiB (0 = global budget only): ", 0,
+                 SNAP_CFG_KEEP - 1, &args.config.mem_budget_kb) < 0)
+        return;
+
+    if (read_password(args.password, sizeof(args.password),
+                      "Enter snapshot password (or 'q' to cancel): ") < 0)
+        return;
+
+    if (strcmp(args.password, "q") == 0) {
+        secure_memzero(args.password, sizeof(args.password));
+        return;
+    }
+
+    errno = 0;
+    if (ioctl(fd, SNAP_CONFIG, &args) < 0) {
+        if (errno == ENOENT) {
+            printf("Snapshot is not active for this device.\n");
+        } else {
+            fprintf(stderr, "Configuration failed: %s\n", strerror(errno));
+
+            PRINT_FOR_MORE_INFO_MSG;
+        }
+    } else {
+        printf("\nConfiguration\n");
+        printf("  flush batch:         %u blocks\n", args.config.flush_batch);
+        printf("  flush latency:       %u us\n", args.config.flush_latency_us);
+        printf("  durability:          %s\n",
+               (args.config.durability == SNAP_DURABILITY_GROUP) ? "group commit" :
+               (args.config.durability == SNAP_DURABILITY_STRICT) ? "strict" : "none");
+        printf("  commit interval:     %u ms\n", args.config.commit_interval_ms);
+        printf("  ordered COW:         %s\n", args.config.ordered ? "on" : "off");
+        printf("  session mode:        %s\n", args.config.session ? "on" : "off");
+        printf("  writeback CPUs:      %s\n", args.config.flush_cpus);
+        printf("  I/O priority:        %s", ioprio_class_name(args.config.ioprio_class));
+        if (args.config.ioprio_class)
+            printf(", level %u", args.config.ioprio_level);
+        printf("\n");
+        printf("  bandwidth cap:       ");
+        if (args.config.max_kbps)
+            printf("%u KiB/s\n", args.config.max_kbps);
+        else
+            printf("none\n");
+        printf("  I/O rate cap:        ");
+        if (args.config.max_iops)
+            printf("%u IOPS\n", args.config.max_iops);
+        else
+            printf("none\n");
+        printf("  cgroup:              %s\n", args.config.cgroup);
+        printf("  over memory budget:  %s\n",
+               (args.config.overload == SNAP_OVERLOAD_THROTTLE) ? "throttle" :
+               (args.config.overload == SNAP_OVERLOAD_SPILL) ? "spill" : "drop (incomplete)");
+        printf("  memory budget:       ");
+        if (args.config.mem_budget_kb)
+            printf("%u KiB\n", args.config.mem_budget_kb);
+        else
+            printf("global only\n");
+    }
+
+    secure_memzero(args.password, sizeof(args.password));
+}
+
 /* -------------------------------------------------------------------
  * Menu
  * ------------------------------------------------------------------- */
@@ -372,6 +688,8 @@ enum menu_choice {
     MENU_DEACTIVATE,
     MENU_RESTORE,
     MENU_SETPW,
+    MENU_STATS,
+    MENU_CONFIG,
     MENU_EXIT
 };
 
@@ -386,10 +704,12 @@ static int menu(void)
     printf("2) Deactivate snapshot\n");
     printf("3) Restore snapshot\n");
     printf("4) Set password\n");
-    printf("5) Exit\n\n");
+    printf("5) Show device statistics\n");
+    printf("6) Configure device\n");
+    printf("7) Exit\n\n");
 
     while (1) {
-        printf("Select option (1-5): ");
+        printf("Select option (1-%d): ", MENU_EXIT);
         if (!fgets(buf, sizeof(buf), stdin)) {
             clearerr(stdin);
             continue;
@@ -402,8 +722,8 @@ static int menu(void)
 
         char *end;
         long val = strtol(buf, &end, 10);
-        if (end == buf || *end != '\0' || val < 1 || val > 5) {
-            printf("Invalid input. Please enter a number between 1 and 5.\n\n");
+        if (end == buf || *end != '\0' || val < 1 || val > MENU_EXIT) {
+            printf("Invalid input. Please enter a number between 1 and %d.\n\n", MENU_EXIT);
             continue;
         }
 
@@ -412,7 +732,9 @@ static int menu(void)
                (choice == MENU_ACTIVATE) ? "Activate snapshot" :
                (choice == MENU_DEACTIVATE) ? "Deactivate snapshot" :
                (choice == MENU_RESTORE) ? "Restore snapshot" :
-               (choice == MENU_SETPW) ? "Set password" : "Exit");
+               (choice == MENU_SETPW) ? "Set password" :
+               (choice == MENU_STATS) ? "Show device statistics" :
+               (choice == MENU_CONFIG) ? "Configure device" : "Exit");
         break;
     }
 
@@ -456,6 +778,16 @@ int main(int argc, char *argv[])
                 print_separator();
                 break;
 
+            case MENU_STATS:
+                do_show_stats(fd);
+                print_separator();
+                break;
+
+            case MENU_CONFIG:
+                do_config(fd);
+                print_separator();
+                break;
+
             case MENU_EXIT:
                 printf("Exiting...\n\n");
                 close(fd);